@@ -0,0 +1,330 @@
+/*
+ * MicroBench -- times the parsing, alias, history and settings code of OopShell in-process,
+ * linked against the shell's objects.
+ *
+ * Each benchmark runs in batches of enough iterations to last -m milliseconds, and its result is
+ * the fastest of -r batches, the one least disturbed by the rest of the machine, in nanoseconds per iteration:
+ *	 tokenize_* -- tokenize on a three stage pipeline, and on a 100 stage one
+ *	 verify_* -- Scanner::verifyInput on a typical line, a 100 stage pipeline, and one it rejects at its end
+ *	 parse_hit -- Scanner::parse of a line the plan cache has
+ *	 parse_miss_* -- Scanner::buildCommands, the work of parse on a plan cache miss, on a typical line,
+ *	   a 100 stage pipeline, a command of 1000 words, and one of 200 variables
+ *	 alias_* -- Runtime::expandAlias through a chain of 64 aliases, and of a word that is no alias
+ *	 complete_* -- Runtime::completeCommand on 10000 and 100000 history lines, with a match and without one
+ *	 write_settings -- Runtime::writeSettingsFile of 264 aliases, after a change
+ *
+ * The results are written as JSON with -o, one benchmark per line. With -b they are compared with
+ * a baseline written the same way: a benchmark more than -t percent slower than its baseline is a
+ * regression, and the exit status is then 1.
+ * The Runtime is started in a scratch directory, so no settings of the user are read or written.
+ *
+ * Usage: MicroBench [-o results.json] [-b baseline.json] [-t percent] [-m ms] [-r batches] [name...]
+ */
+
+#include "OopShell.h"
+
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+// keeps the compiler from dropping work whose result is unused
+static volatile size_t sink;
+
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/**
+ * Class MicroBench
+ * Reaches the private Scanner methods being timed; Scanner names it a friend.
+ */
+class MicroBench {
+public:
+	static bool parse(Scanner* scanner, const string& line) {
+		return (*scanner).parse(line);
+	}
+	static bool buildCommands(Scanner* scanner, const string& line) {
+		return (*scanner).buildCommands(line);
+	}
+	static bool verifyInput(Scanner* scanner, string* line) {
+		return (*scanner).verifyInput(line);
+	}
+};
+
+struct Benchmark {
+	string name;
+	std::function<void()> body;
+	double nsPerOp;
+	uint64_t iterations;
+};
+
+static uint64_t timeBatch(const Benchmark& b, uint64_t n) {
+	uint64_t start = nowNs();
+	for (uint64_t i=0;i<n;i++)
+		b.body();
+	return nowNs()-start;
+}
+
+/**
+ * Doubles the batch until it lasts minNs, then keeps the fastest time per iteration of a number of batches.
+ */
+static void measure(Benchmark* b, uint64_t minNs, int batches) {
+	uint64_t n = 1;
+	while (timeBatch(*b,n)<minNs)
+		n *= 2;
+	uint64_t best = 0;
+	for (int i=0;i<batches;i++) {
+		uint64_t ns = timeBatch(*b,n);
+		if (i==0 || ns<best)
+			best = ns;
+	}
+	(*b).nsPerOp = (double)best/n;
+	(*b).iterations = n;
+}
+
+/**
+ * Reads results written by -o: each line holding a benchmark gives its name and ns_per_op.
+ */
+static bool readBaseline(const string& file, std::map<string,double>* baseline) {
+	std::ifstream in(file.c_str());
+	if (!in)
+		return false;
+	string line;
+	while (std::getline(in,line)) {
+		char name[128];
+		double ns;
+		size_t at = line.find("{\"name\":");
+		if (at!=string::npos && sscanf(line.c_str()+at,"{\"name\":\"%127[^\"]\",\"ns_per_op\":%lf",name,&ns)==2)
+			(*baseline)[name] = ns;
+	}
+	return true;
+}
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+	return remove(path);
+}
+
+/**
+ * A pipeline of n stages, of commands that are not built-ins.
+ */
+static string pipeline(int n) {
+	string line = "cat data.txt";
+	for (int i=1;i<n;i++)
+		line += i%2 ? " | grep -v x"+std::to_string(i) : " | sort -k"+std::to_string(i%9+1);
+	return line;
+}
+
+int main(int argc, char** argv) {
+	string outFile, baselineFile;
+	double threshold = 10;
+	uint64_t minNs = 50000000;
+	int batches = 5;
+	vector<string> only;
+	for (int i=1;i<argc;i++) {
+		if (strcmp(argv[i],"-o")==0 && i+1<argc) outFile = argv[++i];
+		else if (strcmp(argv[i],"-b")==0 && i+1<argc) baselineFile = argv[++i];
+		else if (strcmp(argv[i],"-t")==0 && i+1<argc) threshold = atof(argv[++i]);
+		else if (strcmp(argv[i],"-m")==0 && i+1<argc) minNs = (uint64_t)(atof(argv[++i])*1e6);
+		else if (strcmp(argv[i],"-r")==0 && i+1<argc) batches = atoi(argv[++i]);
+		else if (argv[i][0]!='-') only.push_back(argv[i]);
+		else {
+			std::cerr << "Usage: MicroBench [-o results.json] [-b baseline.json] [-t percent] [-m ms] [-r batches] [name...]"
+					<< std::endl;
+			return 2;
+		}
+	}
+	if (batches<1) batches = 1;
+	std::map<string,double> baseline;
+	if (baselineFile.size()>0 && !readBaseline(baselineFile,&baseline)) {
+		perror(baselineFile.c_str());
+		return 2;
+	}
+
+	// -o is relative to where we were started, not the scratch directory
+	char cwd[PATH_MAX];
+	if (outFile.size()>0 && outFile[0]!='/' && getcwd(cwd,sizeof(cwd))!=NULL)
+		outFile = string(cwd)+"/"+outFile;
+
+	char dir[] = "/tmp/oopshell-micro-XXXXXX";
+	if (mkdtemp(dir)==NULL || chdir(dir)<0) {
+		perror("scratch dir");
+		return 1;
+	}
+	Runtime* runtime = Runtime::getRuntime();
+	Scanner scanner;
+	vector<string>* history = (*runtime).getHistory();
+
+	// a0 -> a1 -x0 -> ... -> a63 -> ls -l, and 200 unrelated aliases for the settings file
+	for (int i=63;i>=0;i--)
+		(*runtime).addAlias("a"+std::to_string(i),i==63 ? "ls -l" : "a"+std::to_string(i+1)+" -x"+std::to_string(i));
+	for (int i=0;i<200;i++)
+		(*runtime).addAlias("w"+std::to_string(i),"grep --color=auto -n pattern"+std::to_string(i));
+	string vars;
+	for (int i=0;i<200;i++) {
+		(*runtime).setVar("V"+std::to_string(i),"value"+std::to_string(i),false);
+		vars += i%2 ? " ${V"+std::to_string(i)+"}" : " $V"+std::to_string(i);
+	}
+	vector<string> history10k, history100k;
+	const char* shapes[] = { "ls -la src", "grep -rn TODO src | sort | uniq -c", "make -j8 all", "cd build",
+			"git log --oneline | head -20", "cat out.log | grep error > errors.txt" };
+	for (int i=0;i<100000;i++) {
+		string line = string(shapes[i%6])+" "+std::to_string(i);
+		if (i<10000) history10k.push_back(line);
+		history100k.push_back(line);
+	}
+
+	const string typical = "grep -rn TODO src | sort | uniq -c > todo.txt";
+	const string stages100 = pipeline(100);
+	string words1000 = "echo";
+	for (int i=0;i<1000;i++)
+		words1000 += " word"+std::to_string(i);
+	const string vars200 = "echo"+vars;
+	const string rejected = stages100+" |";
+	vector<string> tokens;
+
+	vector<Benchmark> all = {
+		{ "tokenize_pipeline", [&]() {
+			string line = typical;
+			tokens.clear();
+			tokenize(&line,"|",&tokens);
+			sink = tokens.size();
+		} },
+		{ "tokenize_100_stages", [&]() {
+			string line = stages100;
+			tokens.clear();
+			tokenize(&line,"|",&tokens);
+			sink = tokens.size();
+		} },
+		{ "verify_typical", [&]() {
+			string line = typical;
+			sink = MicroBench::verifyInput(&scanner,&line);
+		} },
+		{ "verify_100_stages", [&]() {
+			string line = stages100;
+			sink = MicroBench::verifyInput(&scanner,&line);
+		} },
+		{ "verify_rejected", [&]() {
+			string line = rejected;
+			sink = MicroBench::verifyInput(&scanner,&line);
+		} },
+		{ "parse_hit", [&]() {
+			sink = MicroBench::parse(&scanner,typical);
+			// parse adds every line to the history; keep it from growing
+			(*history).pop_back();
+		} },
+		{ "parse_miss_typical", [&]() {
+			sink = MicroBench::buildCommands(&scanner,typical);
+		} },
+		{ "parse_miss_100_stages", [&]() {
+			sink = MicroBench::buildCommands(&scanner,stages100);
+		} },
+		{ "parse_miss_1000_words", [&]() {
+			sink = MicroBench::buildCommands(&scanner,words1000);
+		} },
+		{ "parse_miss_200_vars", [&]() {
+			sink = MicroBench::buildCommands(&scanner,vars200);
+		} },
+		{ "alias_chain_64", [&]() {
+			vector<string> args = { "a0", "file" };
+			(*runtime).expandAlias(&args);
+			sink = args.size();
+		} },
+		{ "alias_none", [&]() {
+			vector<string> args = { "cat", "file" };
+			(*runtime).expandAlias(&args);
+			sink = args.size();
+		} },
+		{ "complete_10k_match", [&]() {
+			string cmd = "uniq\\";
+			sink = (*runtime).completeCommand(&cmd);
+		} },
+		{ "complete_10k_none", [&]() {
+			string cmd = "rsync\\";
+			sink = (*runtime).completeCommand(&cmd);
+		} },
+		{ "complete_100k_match", [&]() {
+			string cmd = "uniq\\";
+			sink = (*runtime).completeCommand(&cmd);
+		} },
+		{ "complete_100k_none", [&]() {
+			string cmd = "rsync\\";
+			sink = (*runtime).completeCommand(&cmd);
+		} },
+		{ "write_settings", [&]() {
+			// a changed prompt marks the settings dirty, so each call writes the file
+			static int writes = 0;
+			(*runtime).setPrompt(writes++%2 ? "bench$ " : "micro$ ");
+			sink = (*runtime).writeSettingsFile();
+		} },
+	};
+
+	bool regressed = false;
+	char line[256];
+	snprintf(line,sizeof(line),"%-24s %12s %12s %12s %9s","benchmark","iterations","ns/op","baseline","change");
+	std::cout << line << std::endl;
+	string json = "{\"benchmarks\":[\n";
+	bool first = true;
+	for (size_t i=0;i<all.size();i++) {
+		Benchmark* b = &all[i];
+		bool wanted = only.size()==0;
+		for (size_t k=0;k<only.size();k++)
+			if ((*b).name.find(only[k])!=string::npos)
+				wanted = true;
+		if (!wanted)
+			continue;
+		(*history).clear();
+		if ((*b).name.compare(0,12,"complete_10k")==0) *history = history10k;
+		else if ((*b).name.compare(0,13,"complete_100k")==0) *history = history100k;
+		measure(b,minNs,batches);
+		string base = "-", change = "";
+		std::map<string,double>::iterator found = baseline.find((*b).name);
+		if (found!=baseline.end() && found->second>0) {
+			double pct = ((*b).nsPerOp/found->second-1)*100;
+			snprintf(line,sizeof(line),"%.1f",found->second);
+			base = line;
+			snprintf(line,sizeof(line),"%+.1f%%%s",pct,pct>threshold ? " REGRESSED" : "");
+			change = line;
+			if (pct>threshold)
+				regressed = true;
+		}
+		snprintf(line,sizeof(line),"%-24s %12llu %12.1f %12s %9s",(*b).name.c_str(),(unsigned long long)(*b).iterations,
+				(*b).nsPerOp,base.c_str(),change.c_str());
+		std::cout << line << std::endl;
+		snprintf(line,sizeof(line),"%s{\"name\":\"%s\",\"ns_per_op\":%.1f,\"iterations\":%llu}",first ? "" : ",\n",
+				(*b).name.c_str(),(*b).nsPerOp,(unsigned long long)(*b).iterations);
+		json += line;
+		first = false;
+	}
+	json += "\n]}\n";
+	(*history).clear();
+
+	if (chdir("/")==0)
+		nftw(dir,removeEntry,16,FTW_DEPTH|FTW_PHYS);
+	if (outFile.size()>0) {
+		std::ofstream out(outFile.c_str());
+		if (!out || !out.write(json.data(),json.size()) || !out.flush()) {
+			perror(outFile.c_str());
+			return 1;
+		}
+	}
+	if (regressed) {
+		std::cout << "slower than the baseline by more than " << threshold << "%" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * StartupBench -- measures how long OopShell takes to start.
+ *
+ * Two numbers are reported, in microseconds over a number of runs:
+ *	 first_prompt -- from spawning the shell with -i to the first prompt arriving on its stdout
+ *	 exit -- from spawning the shell on an empty script (stdin is /dev/null) to its exit
+ *
+ * The shell runs in a scratch directory holding a settings file with the given number of aliases,
+ * so the settings load is part of what is measured. The first run builds the settings snapshot,
+ * and is excluded from the results.
+ *
+ * Usage: StartupBench <shell> [-n runs] [-a aliases] [shell args...]
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+extern char** environ;
+
+static double nowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e6+ts.tv_nsec/1e3;
+}
+
+/**
+ * Spawns the shell with the given fds as stdin and stdout.
+ */
+static pid_t spawnShell(const vector<char*>& argv, int in, int out) {
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa,in,0);
+	posix_spawn_file_actions_adddup2(&fa,out,1);
+	pid_t pid;
+	int rc = posix_spawn(&pid,argv[0],&fa,NULL,&argv[0],environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (rc!=0) {
+		std::cerr << "spawn " << argv[0] << ": " << strerror(rc) << std::endl;
+		exit(1);
+	}
+	return pid;
+}
+
+/**
+ * Time from spawn until the prompt is seen on the shell's stdout.
+ */
+static double timeFirstPrompt(const vector<char*>& argv) {
+	int in[2], out[2];
+	if (pipe2(in,O_CLOEXEC)<0 || pipe2(out,O_CLOEXEC)<0) {
+		perror("pipe");
+		exit(1);
+	}
+	double start = nowUs();
+	pid_t pid = spawnShell(argv,in[0],out[1]);
+	close(in[0]);
+	close(out[1]);
+	string seen;
+	char buf[4096];
+	double elapsed = -1;
+	ssize_t n;
+	while ((n = read(out[0],buf,sizeof(buf)))>0) {
+		seen.append(buf,n);
+		if (seen.find("$ ")!=string::npos) {
+			elapsed = nowUs()-start;
+			break;
+		}
+	}
+	close(in[1]);
+	while (read(out[0],buf,sizeof(buf))>0);
+	close(out[0]);
+	waitpid(pid,NULL,0);
+	if (elapsed<0) {
+		std::cerr << "shell exited without printing a prompt" << std::endl;
+		exit(1);
+	}
+	return elapsed;
+}
+
+/**
+ * Time from spawn until exit, on an empty script.
+ */
+static double timeExit(const vector<char*>& argv) {
+	int in = open("/dev/null",O_RDONLY|O_CLOEXEC);
+	int out = open("/dev/null",O_WRONLY|O_CLOEXEC);
+	double start = nowUs();
+	pid_t pid = spawnShell(argv,in,out);
+	waitpid(pid,NULL,0);
+	double elapsed = nowUs()-start;
+	close(in);
+	close(out);
+	return elapsed;
+}
+
+static void printStats(const char* name, vector<double> v) {
+	std::sort(v.begin(),v.end());
+	double sum = 0;
+	for (size_t i=0;i<v.size();i++)
+		sum += v[i];
+	std::cout << "\"" << name << "\":{\"min\":" << (long)v[0]
+		<< ",\"median\":" << (long)v[v.size()/2]
+		<< ",\"mean\":" << (long)(sum/v.size()) << "}";
+}
+
+int main(int argc, char** argv) {
+	if (argc<2) {
+		std::cerr << "Usage: StartupBench <shell> [-n runs] [-a aliases] [shell args...]" << std::endl;
+		return 2;
+	}
+	char shell[PATH_MAX];
+	if (realpath(argv[1],shell)==NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	int runs = 200, aliasCount = 100;
+	vector<char*> shellArgv(1,shell);
+	char interactiveFlag[] = "-i";
+	for (int i=2;i<argc;i++) {
+		if (strcmp(argv[i],"-n")==0 && i+1<argc) runs = atoi(argv[++i]);
+		else if (strcmp(argv[i],"-a")==0 && i+1<argc) aliasCount = atoi(argv[++i]);
+		else shellArgv.push_back(argv[i]);
+	}
+	shellArgv.push_back(NULL);
+	vector<char*> promptArgv(shellArgv);
+	promptArgv.insert(promptArgv.begin()+1,interactiveFlag);
+	if (runs<1) runs = 1;
+
+	char dir[] = "/tmp/oopshell-startup-XXXXXX";
+	if (mkdtemp(dir)==NULL || chdir(dir)<0) {
+		perror("scratch dir");
+		return 1;
+	}
+	{
+		std::ofstream rc("oopshell_rc");
+		rc << "prompt bench$" << std::endl;
+		for (int i=0;i<aliasCount;i++)
+			rc << "alias a" << i << " " << (i ? "a" + std::to_string(i-1) : string("ls")) << " -l" << std::endl;
+	}
+
+	timeFirstPrompt(promptArgv);
+	vector<double> prompt, exitTimes;
+	for (int i=0;i<runs;i++) {
+		prompt.push_back(timeFirstPrompt(promptArgv));
+		exitTimes.push_back(timeExit(shellArgv));
+	}
+
+	std::cout << "{\"bench\":\"startup\",\"runs\":" << runs << ",\"aliases\":" << aliasCount << ",";
+	printStats("first_prompt_us",prompt);
+	std::cout << ",";
+	printStats("exit_us",exitTimes);
+	std::cout << "}" << std::endl;
+
+	unlink("oopshell_rc");
+	unlink("oopshell_rc.journal");
+	unlink("oopshell_rc.snap");
+	if (chdir("/")==0)
+		rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,132 @@
+#!/bin/sh
+# e2e.sh -- end-to-end cost of launching processes and moving data through OopShell, driven by scripts.
+#
+# Each number is the best of R runs of a script, less the best run of the same script without the work:
+#   launch    -- launches per second of true, from a loop of N
+#   pipeline  -- latency of a 1, 10 and 100 stage pipeline (echo x, then cats), from a loop of P
+#   cat       -- GB/s through cat reading S MB with < and writing it with >, alone and as 4 stages;
+#                the output is compared with the input
+# For a shell that runs each of them once:
+#   peak RSS  -- VmHWM of the shell
+#   peak fds  -- the lowest ulimit -n it still runs under, i.e. the most fds it had open at once
+# Nothing needs the network: the data is made from /dev/zero in a scratch directory.
+#
+# Usage: bench/e2e.sh [path/to/OopShell] [N] [P] [S] [R]
+
+SHELL_BIN=${1:-./OopShell}
+N=${2:-2000}
+P=${3:-100}
+S=${4:-256}
+R=${5:-3}
+TRUE=$(command -v true)
+[ -x /bin/true ] && TRUE=/bin/true
+
+SHELL_BIN=$(cd "$(dirname "$SHELL_BIN")" && pwd)/$(basename "$SHELL_BIN")
+TMP=$(mktemp -d /tmp/oopshell-e2e-XXXXXX) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+
+words() {
+	i=0
+	while [ $i -lt "$1" ]; do
+		printf ' %d' $i
+		i=$((i+1))
+	done
+}
+
+# stages <k>: a pipeline of echo and k-1 cats
+stages() {
+	printf 'echo x'
+	i=1
+	while [ $i -lt "$1" ]; do
+		printf ' | cat'
+		i=$((i+1))
+	done
+}
+
+# loop <n> <body>: a script running body n times
+loop() {
+	printf 'for i in%s\n%s\nend\n' "$(words "$1")" "$2"
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# best <script>: nanoseconds of the fastest of R runs
+best() {
+	min=0
+	r=0
+	while [ $r -lt "$R" ]; do
+		start=$(now_ns)
+		"$SHELL_BIN" "$1" > /dev/null 2>&1 < /dev/null
+		end=$(now_ns)
+		ns=$((end-start))
+		[ $min -eq 0 ] || [ $ns -lt $min ] && min=$ns
+		r=$((r+1))
+	done
+	echo $min
+}
+
+# net <script> <empty script>: nanoseconds the work of the script took, at least 1
+net() {
+	ns=$(( $(best "$1") - $(best "$2") ))
+	[ $ns -le 0 ] && ns=1
+	echo $ns
+}
+
+head -c "${S}M" /dev/zero > in.dat
+# run by OopShell, so $PPID is the shell
+echo 'grep VmHWM /proc/$PPID/status' > rss.sh
+
+loop "$N" "$TRUE" > launch.oop
+loop "$N" 'export x=$i' > launch0.oop
+printf '%-22s %12d\n' "launch/s of true" $(( N*1000000000/$(net launch.oop launch0.oop) ))
+
+loop "$P" 'export x=$i' > pipeline0.oop
+for k in 1 10 100; do
+	loop "$P" "$(stages $k)" > pipeline.oop
+	printf '%-22s %12d\n' "$k stage pipeline us" $(( $(net pipeline.oop pipeline0.oop)/P/1000 ))
+done
+
+echo 'export x=1' > cat0.oop
+echo 'cat < in.dat > out.dat' > cat1.oop
+# the shell's redirects follow the last stage; < feeds the first
+echo 'cat | cat | cat | cat < in.dat > out.dat' > cat4.oop
+for k in 1 4; do
+	rm -f out.dat
+	ns=$(net cat$k.oop cat0.oop)
+	if cmp -s in.dat out.dat; then
+		printf '%-22s %12s\n' "cat x$k GB/s" "$(awk "BEGIN { printf \"%.2f\", $S*1048576/$ns }")"
+	else
+		printf '%-22s %12s\n' "cat x$k GB/s" failed
+	fi
+done
+
+{
+	loop 10 "$TRUE"
+	stages 100
+	echo ' > fds.out'
+	cat cat4.oop
+	echo 'sh rss.sh'
+} > all.oop
+rss=$("$SHELL_BIN" all.oop < /dev/null 2>&1 | awk '/VmHWM/ { print $2 }')
+printf '%-22s %12s\n' "peak RSS KB" "$rss"
+
+# runs <limit>: true if the script runs under ulimit -n limit, and its 100 stage pipeline got its line through
+runs() {
+	rm -f fds.out
+	(ulimit -n "$1" && "$SHELL_BIN" all.oop > /dev/null 2>&1 < /dev/null)
+	[ "$(cat fds.out 2>/dev/null)" = x ]
+}
+lo=3
+hi=4096
+if runs $hi; then
+	while [ $((hi-lo)) -gt 1 ]; do
+		mid=$(( (lo+hi)/2 ))
+		if runs $mid; then hi=$mid; else lo=$mid; fi
+	done
+	printf '%-22s %12d\n' "peak fds" $hi
+else
+	printf '%-22s %12s\n' "peak fds" "> $hi"
+fi
@@ -0,0 +1,56 @@
+#!/bin/sh
+# loop.sh -- per-iteration loop overhead of OopShell scripts, compared with bash and dash.
+#
+# Two loops are timed in each shell:
+#   builtin -- a for loop over N words whose body sets a variable, so no process is started
+#   exec    -- a for loop over M words whose body runs the external command true
+#
+# Usage: bench/loop.sh [path/to/OopShell] [N] [M]
+
+SHELL_BIN=${1:-./OopShell}
+N=${2:-5000}
+M=${3:-1000}
+TRUE=$(command -v true)
+[ -x /bin/true ] && TRUE=/bin/true
+
+SHELL_BIN=$(cd "$(dirname "$SHELL_BIN")" && pwd)/$(basename "$SHELL_BIN")
+TMP=$(mktemp -d /tmp/oopshell-loop-XXXXXX) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+
+words() {
+	i=0
+	while [ $i -lt "$1" ]; do
+		printf ' %d' $i
+		i=$((i+1))
+	done
+}
+WORDS_N=$(words "$N")
+WORDS_M=$(words "$M")
+
+printf 'for i in%s\nexport x=$i\nend\n' "$WORDS_N" > builtin.oop
+printf 'for i in%s\n%s\nend\n' "$WORDS_M" "$TRUE" > exec.oop
+printf 'for i in%s; do\nexport x=$i\ndone\n' "$WORDS_N" > builtin.sh
+printf 'for i in%s; do\n%s\ndone\n' "$WORDS_M" "$TRUE" > exec.sh
+
+now_ns() {
+	date +%s%N
+}
+
+# run <shell...> <script> <iterations>: prints microseconds per iteration
+run() {
+	iters=$1
+	shift
+	start=$(now_ns)
+	"$@" > /dev/null 2>&1 < /dev/null
+	end=$(now_ns)
+	echo $(( (end-start)/1000/iters ))
+}
+
+printf '%-10s %14s %14s\n' shell "builtin us/it" "exec us/it"
+printf '%-10s %14s %14s\n' OopShell "$(run $N "$SHELL_BIN" builtin.oop)" "$(run $M "$SHELL_BIN" exec.oop)"
+for sh in bash dash; do
+	if command -v $sh > /dev/null 2>&1; then
+		printf '%-10s %14s %14s\n' $sh "$(run $N $sh builtin.sh)" "$(run $M $sh exec.sh)"
+	fi
+done
@@ -0,0 +1,48 @@
+#!/bin/sh
+# placement.sh -- throughput of a four stage pipeline run by OopShell with different placements.
+#
+# Each mode pushes S MB through head | cat | cat | wc, R times, and reports MB/s:
+#   off    -- no placement, the scheduler decides
+#   auto   -- set placement auto, adjacent stages packed onto one NUMA node
+#   node0  -- every stage given @node=0
+# On a machine with a single node the modes only differ by the cost of applying the placement.
+#
+# Usage: bench/placement.sh [path/to/OopShell] [S] [R]
+
+SHELL_BIN=${1:-./OopShell}
+S=${2:-1024}
+R=${3:-3}
+
+SHELL_BIN=$(cd "$(dirname "$SHELL_BIN")" && pwd)/$(basename "$SHELL_BIN")
+TMP=$(mktemp -d /tmp/oopshell-placement-XXXXXX) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+
+echo "nodes: $(cat /sys/devices/system/node/online 2>/dev/null || echo none), cpus: $(nproc)"
+
+now_ns() {
+	date +%s%N
+}
+
+# run <mode> <setting> <stage prefix>: prints the mode and MB/s
+run() {
+	{
+		echo "$2"
+		i=0
+		while [ $i -lt "$R" ]; do
+			echo "$3head -c ${S}M /dev/zero | $3cat | $3cat | $3wc -c"
+			i=$((i+1))
+		done
+	} > run.oop
+	start=$(now_ns)
+	"$SHELL_BIN" run.oop > /dev/null 2>&1 < /dev/null
+	end=$(now_ns)
+	ms=$(( (end-start)/1000000 ))
+	[ $ms -le 0 ] && ms=1
+	printf '%-8s %10d\n' "$1" $(( S*R*1000/ms ))
+}
+
+printf '%-8s %10s\n' mode MB/s
+run off "set placement off" ""
+run auto "set placement auto" ""
+run node0 "set placement off" "@node=0 "
@@ -0,0 +1,64 @@
+#!/bin/sh
+# spawn.sh -- launches per second of true from OopShell, forking the shell and through the spawn helper.
+#
+# The shell is first grown by holding a variable of S MB, so fork has that much more to copy.
+# Each run is timed with and without a loop of N launches, and the difference gives the launch rate.
+#
+# Usage: bench/spawn.sh [path/to/OopShell] [N] [S...]
+
+SHELL_BIN=${1:-./OopShell}
+N=${2:-2000}
+[ $# -gt 2 ] && shift 2 && SIZES=$*
+SIZES=${SIZES:-0 32 128}
+TRUE=$(command -v true)
+[ -x /bin/true ] && TRUE=/bin/true
+
+SHELL_BIN=$(cd "$(dirname "$SHELL_BIN")" && pwd)/$(basename "$SHELL_BIN")
+TMP=$(mktemp -d /tmp/oopshell-spawn-XXXXXX) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+
+WORDS=$(i=0; while [ $i -lt "$N" ]; do printf ' %d' $i; i=$((i+1)); done)
+# run by OopShell, so $PPID is the shell
+echo 'grep VmRSS /proc/$PPID/status' > rss.sh
+
+# setup <MB> <spawner on|off>: grows the shell, then reports its RSS
+setup() {
+	# a 1MB word, doubled up to the size, then moved to a variable that is not exported
+	if [ "$1" -gt 0 ]; then
+		printf 'export A=%s\n' "$(head -c 1048576 /dev/zero | tr '\0' x)"
+		mb=1
+		while [ $mb -lt "$1" ]; do
+			echo 'export A=$A$A'
+			mb=$((mb*2))
+		done
+		printf 'for B in $A\nend\nunset A\n'
+	fi
+	echo "sh rss.sh"
+	echo "set spawner $2"
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# rate <MB> <spawner on|off>: prints the shell's RSS and launches per second
+rate() {
+	setup "$1" "$2" > base.oop
+	cp base.oop launch.oop
+	printf 'for i in%s\n%s\nend\n' "$WORDS" "$TRUE" >> launch.oop
+	start=$(now_ns)
+	rss=$("$SHELL_BIN" base.oop < /dev/null 2>&1 | awk '/VmRSS/ { print $2/1024 }')
+	mid=$(now_ns)
+	"$SHELL_BIN" launch.oop > /dev/null 2>&1 < /dev/null
+	end=$(now_ns)
+	ns=$(( (end-mid)-(mid-start) ))
+	[ $ns -le 0 ] && ns=1
+	printf '%-10s %8.0f %10s %12d\n' "$1MB" "$rss" "$2" $(( N*1000000000/ns ))
+}
+
+printf '%-10s %8s %10s %12s\n' grown "RSS MB" spawner launches/s
+for size in $SIZES; do
+	rate "$size" off
+	rate "$size" on
+done
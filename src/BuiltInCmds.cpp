@@ -5,6 +5,8 @@
 #include <vector>
 #include <map>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // for chdir, getcwd
 
 using std::cout;
 using std::endl;
@@ -48,19 +50,16 @@ bool BuiltInI::execute(vector<string>* args) {
  */
 bool Cd::execute(vector<string>* args) {
 	vector<string>* cmdV = args;
+	Runtime* runtime = Runtime::getRuntime();
 	// handle no arg: change cwd to home
 	if ((*cmdV).size()==1) {
-		if (chdir(getenv("HOME"))==0)
+		string home;
+		if ((*runtime).getVar("HOME",&home) && (*runtime).changeDir(&home))
 			finishCd();
 	}
 	// change cwd to inputed path
 	else if ((*cmdV).size()==2) {
-		string path = (*cmdV)[1];
-		int size = path.size();
-		char newPath [size+1];
-		path.copy(newPath,size,0);
-		newPath[size] = '\0';
-		if(chdir(newPath)==0) {
+		if((*runtime).changeDir(&(*cmdV)[1])) {
 			finishCd();
 		}
 		// handle invalid path
@@ -79,23 +78,16 @@ bool Cd::execute(vector<string>* args) {
 
 /**
  * Helper method for Cd::execute.
- * Handles changing to the specified directory.
  * Prints the change in directory.
  */
 void Cd::finishCd() {
-	long size = pathconf(".", _PC_PATH_MAX);
-	char *buf = (char *)malloc((size_t)size);
-	char *ptr = getcwd(buf, (size_t)size);
-	// set PWD = CWD
-	setenv("PWD",ptr,1);
-	cout << "Changed directory to: " << ptr << endl;
-	free(buf);
+	cout << "Changed directory to: " << Runtime::getRuntime()->getCwd() << endl;
 }
 
 /**
  * Handles alias/unalias
  * If command "alias" is specified with no arguments, alias list is displayed.
- * If command "alias" is specified with one argument, alias is set.
+ * If command "alias" is specified with word="val", alias is set; val may hold several words.
  * If command "unalias" is specified with one arguement, alias word is unaliased and taken off alias list.
  * If command "alias" is specified with an invalid argument or more than one arguments, return false and set ERROR_MSG.
  * If command "unalias" is specified with an argument that is not on the alias list, return false and set ERROR_MSG.
@@ -120,16 +112,23 @@ bool Alias::execute(vector<string>* args) {
 			return false;
 		}
 	}
-	// add alias to list
-	else if ((*cmdV).size()==2) {
-		vector<string> v;
-		tokenize(&(*cmdV)[1],"=",&v);
-		if (v.size()!=2) {
+	// add alias to list; the value may have been split into several args
+	else if ((*cmdV)[1].find('=')!=string::npos) {
+		string def = (*cmdV)[1];
+		for (size_t i=2;i<(*cmdV).size();i++)
+			def.append(" "+(*cmdV)[i]);
+		size_t eq = def.find('=');
+		string word = def.substr(0,eq);
+		string val = def.substr(eq+1);
+		removeToken(&val,"\"");
+		if (word.size()==0 || val.size()==0) {
 			ERROR_MSG = "Invalid usage. See help alias for usage.";
 			return false;
 		}
-		removeToken(&v[1],"\"");
-		return (*runtime).addAlias(v[0],v[1]);
+		if (!(*runtime).addAlias(word,val)) {
+			ERROR_MSG = "Alias "+word+" already exists or would create a cycle.";
+			return false;
+		}
 	}
 
 	// handle invalid input
@@ -149,6 +148,14 @@ bool Alias::execute(vector<string>* args) {
  * If command "set path" is specified with one or more arguments, arguments are added to PATH.
  * If command "set path" is specified with no arguments, false is returned and ERROR_MSG is set.
  * If command "set prompt" is specified with one argument, PROMPT is set to the argument.
+ * If command "set journal" is specified with on or off, settings changes are journaled or saved on exit.
+ * If command "set batch" is specified with off, on or parallel, commands exceeding ARG_MAX are refused or split.
+ * If command "set cachesize" is specified with a number of megabytes, the output store is limited to that size.
+ * If command "set spawner" is specified with on or off, the spawn helper is started or stopped.
+ * If command "set placement" is specified with auto or off, pipeline stages are or are not packed onto NUMA nodes.
+ * If command "set cmdtimeout" is specified with a duration or off, every job is or is not stopped after that long.
+ * If command "set killgrace" is specified with a duration, a job that timed out gets that long between SIGTERM and SIGKILL.
+ * If command "set pipestat" is specified with off, on or live, the pipes of every pipeline are or are not relayed and measured.
  *
  * @param args argument vector of the form {cmd}, {cmd, arg0, ... argn}
  * @return true if path and prompt are displayed, directories are added to PATH, or PROMPT is set,
@@ -159,8 +166,22 @@ bool Set::execute(vector<string>* args) {
 	vector<string>* cmdV = args;
 	// display current path
 	if ((*cmdV).size() == 1) {
-		cout << "path: " << getenv("PATH");
-		cout << endl << "prompt: " << (*runtime).prompt << endl;
+		string path;
+		(*runtime).getVar("PATH",&path);
+		cout << "path: " << path;
+		cout << endl << "prompt: " << (*runtime).prompt;
+		const char* modes[] = { "off", "on", "parallel" };
+		cout << endl << "batch: " << modes[(*runtime).batchMode];
+		cout << endl << "journal: " << ((*runtime).isJournalOn() ? "on" : "off");
+		cout << endl << "cachesize: " << ((*runtime).getOutputCache()->limit>>20) << "MB";
+		cout << endl << "spawner: " << ((*runtime).getSpawner()!=NULL ? "on" : "off");
+		cout << endl << "placement: " << ((*runtime).autoPlacement ? "auto" : "off");
+		cout << endl << "cmdtimeout: ";
+		if ((*runtime).cmdTimeout>0) cout << (*runtime).cmdTimeout << "s";
+		else cout << "off";
+		cout << endl << "killgrace: " << (*runtime).killGrace << "s";
+		const char* pipeStats[] = { "off", "on", "live" };
+		cout << endl << "pipestat: " << pipeStats[(*runtime).pipeStat] << endl;
 	}
 	// add to path
 	else if ((*cmdV)[1].compare("path")==0) {
@@ -176,7 +197,79 @@ bool Set::execute(vector<string>* args) {
 	// change prompt
 	else if ((*cmdV)[1].compare("prompt")==0) {
 		if ((*cmdV).size()==3)
-			(*runtime).prompt=(*cmdV)[2];
+			(*runtime).setPrompt((*cmdV)[2]);
+	}
+	// change settings journal mode
+	else if ((*cmdV)[1].compare("journal")==0 && (*cmdV).size()==3
+			&& ((*cmdV)[2].compare("on")==0 || (*cmdV)[2].compare("off")==0)) {
+		if (!(*runtime).setJournal((*cmdV)[2].compare("on")==0)) {
+			ERROR_MSG = "Could not save settings.";
+			return false;
+		}
+	}
+	// change ARG_MAX batching
+	else if ((*cmdV)[1].compare("batch")==0 && (*cmdV).size()==3) {
+		if ((*cmdV)[2].compare("off")==0)
+			(*runtime).batchMode = BATCH_OFF;
+		else if ((*cmdV)[2].compare("on")==0)
+			(*runtime).batchMode = BATCH_SEQUENTIAL;
+		else if ((*cmdV)[2].compare("parallel")==0)
+			(*runtime).batchMode = BATCH_PARALLEL;
+		else {
+			ERROR_MSG =  "Invalid usage. See help set for usage.";
+			return false;
+		}
+	}
+	// start or stop the spawn helper
+	else if ((*cmdV)[1].compare("spawner")==0 && (*cmdV).size()==3
+			&& ((*cmdV)[2].compare("on")==0 || (*cmdV)[2].compare("off")==0)) {
+		if (!(*runtime).setSpawner((*cmdV)[2].compare("on")==0)) {
+			ERROR_MSG = "Could not start the spawn helper.";
+			return false;
+		}
+	}
+	// pack pipeline stages onto NUMA nodes
+	else if ((*cmdV)[1].compare("placement")==0 && (*cmdV).size()==3
+			&& ((*cmdV)[2].compare("auto")==0 || (*cmdV)[2].compare("off")==0)) {
+		(*runtime).autoPlacement = (*cmdV)[2].compare("auto")==0;
+	}
+	// stop every job that runs too long
+	else if ((*cmdV)[1].compare("cmdtimeout")==0 && (*cmdV).size()==3) {
+		double seconds = 0;
+		if ((*cmdV)[2].compare("off")!=0 && !parseDuration((*cmdV)[2],&seconds)) {
+			ERROR_MSG =  "Invalid usage. See help set for usage.";
+			return false;
+		}
+		(*runtime).cmdTimeout = seconds;
+	}
+	else if ((*cmdV)[1].compare("killgrace")==0 && (*cmdV).size()==3) {
+		if (!parseDuration((*cmdV)[2],&(*runtime).killGrace)) {
+			ERROR_MSG =  "Invalid usage. See help set for usage.";
+			return false;
+		}
+	}
+	// measure the pipes of every pipeline
+	else if ((*cmdV)[1].compare("pipestat")==0 && (*cmdV).size()==3) {
+		if ((*cmdV)[2].compare("off")==0)
+			(*runtime).pipeStat = PIPESTAT_OFF;
+		else if ((*cmdV)[2].compare("on")==0)
+			(*runtime).pipeStat = PIPESTAT_SUMMARY;
+		else if ((*cmdV)[2].compare("live")==0)
+			(*runtime).pipeStat = PIPESTAT_LIVE;
+		else {
+			ERROR_MSG =  "Invalid usage. See help set for usage.";
+			return false;
+		}
+	}
+	// change the size limit of the output store
+	else if ((*cmdV)[1].compare("cachesize")==0 && (*cmdV).size()==3) {
+		char* end;
+		unsigned long mb = strtoul((*cmdV)[2].c_str(),&end,10);
+		if ((*cmdV)[2].size()==0 || *end!='\0' || (*cmdV)[2][0]=='-') {
+			ERROR_MSG =  "Invalid usage. See help set for usage.";
+			return false;
+		}
+		(*runtime).getOutputCache()->limit = (unsigned long long)mb<<20;
 	}
 	// handle invalid input
 	else {
@@ -204,18 +297,65 @@ bool Bye::execute(vector<string>* args) {
  * If command "pwd" is specified, previous working directory is displayed.
  *
  * @param args argument vector of the form {cmd}
- * @return true, otherwise return false if insufficient memory for allocating
+ * @return true
  */
 bool Pwd::execute(vector<string>* args) {
-	long size;
-	char *buf;
-	char *ptr;
-	size = pathconf(".", _PC_PATH_MAX);
-	if ((buf = (char *)malloc((size_t)size)) == NULL)
+	cout << Runtime::getRuntime()->getCwd() << endl;
+	return true;
+}
+
+/**
+ * Handles export/unset
+ * If command "export" is specified with no arguments, exported variables are displayed.
+ * If command "export" is specified with word=val, variable word is set to val and exported.
+ * If command "export" is specified with word, the existing variable word is exported.
+ * If command "unset" is specified with one or more arguments, those variables are removed.
+ * If a variable to export or unset does not exist, return false and set ERROR_MSG.
+ *
+ * @param args argument vector of the form {cmd}, {cmd, arg0, ... argn}
+ * @return true if variables are displayed, set, exported or removed, otherwise return false and set ERROR_MSG
+ */
+bool Export::execute(vector<string>* args) {
+	vector<string>* cmdV = args;
+	Runtime* runtime = Runtime::getRuntime();
+	// display exported variables
+	if ((*cmdV).size()==1 && (*cmdV)[0].compare("export")==0) {
+		(*runtime).printVars();
+		return true;
+	}
+	if ((*cmdV).size()==1) {
+		ERROR_MSG = "Invalid usage. See help unset for usage.";
 		return false;
-	ptr = getcwd(buf, (size_t)size);
-	cout << ptr << endl;
-	free(buf);
+	}
+	for (size_t i=1;i<(*cmdV).size();i++) {
+		string word = (*cmdV)[i];
+		// remove variables
+		if ((*cmdV)[0].compare("unset")==0) {
+			if (!(*runtime).unsetVar(word)) {
+				ERROR_MSG = "Variable "+word+" is not set.";
+				return false;
+			}
+			continue;
+		}
+		size_t eq = word.find('=');
+		// export an existing variable
+		if (eq==string::npos) {
+			if (!(*runtime).exportVar(word)) {
+				ERROR_MSG = "Variable "+word+" is not set.";
+				return false;
+			}
+			continue;
+		}
+		// set and export a variable
+		string val = word.substr(eq+1);
+		word.erase(eq);
+		removeToken(&val,"\"");
+		if (word.size()==0) {
+			ERROR_MSG = "Invalid usage. See help export for usage.";
+			return false;
+		}
+		(*runtime).setVar(word,val,true);
+	}
 	return true;
 }
 
@@ -274,6 +414,24 @@ bool Help::execute(vector<string>* args) {
 			"~ -> /path/to/home/currentuser\n"
 			"~word -> /path/to/home/word\n"
 			"~/word -> /path/to/home/currentuser/word\n"
+			"\nOopShell will expand $word and ${word} to the value of variable word (see help export).\n"
+			"\nOopShell will expand arguments containing *, ? or [...] to the sorted list of matching paths;\n"
+			"** matches any number of directories, e.g. data/**/*.parquet\n"
+			"\nOopShell runs blocks of lines (end each with end; $1.. are function arguments, $? the last status):\n"
+			"if cmd / else / end, while cmd / end, for name in [word]* / end, function name / end\n"
+			"\nOopShell places a command given @name=value words before it, e.g. @cpus=0-3 @nice=10 cmd:\n"
+			"@cpus=list, @node=n (its CPUs, and memory from it first), @nice=n, @sched=batch|other,\n"
+			"@ioprio=idle|be[,0-7]|rt[,0-7]\n"
+			"\nOopShell stops a pipeline that runs too long with the prefix timeout [-k grace] duration, e.g. timeout 10m cmd:\n"
+			"its process group gets SIGTERM, then SIGKILL after grace (see help set), and its status is 124.\n"
+			"\nOopShell prints what each stage of a pipeline cost with the prefix time, e.g. time cmd | cmd:\n"
+			"fork to exec and exec to exit times, CPU time, max RSS, page faults and context switches.\n"
+			"\nOopShell measures each pipe of a pipeline with the prefix pipestat [-l], e.g. pipestat cmd | cmd:\n"
+			"bytes, MB/s and the time it was empty (the stage before is slow) or full (the stage after is slow);\n"
+			"-l also writes them to stderr every second. See also help set.\n"
+			"\nOopShell benchmarks a pipeline with the prefix bench [-n runs] [-w warmups] [-k], e.g. bench -n 50 cmd | cmd:\n"
+			"it runs the line warmups times (1), then runs times (10), and prints the min, median, p95, mean and\n"
+			"standard deviation of the wall time, and each stage's mean CPU time. Output goes to /dev/null unless -k.\n"
 			"\nOopShell will expand cmd\\\\ to the best match it can find in the session command history. It will then ask for confirmation before executing.\n"
 			"\nOopShell has the following built in commands:";
 	Runtime* runtime = Runtime::getRuntime();
@@ -296,3 +454,327 @@ bool Help::execute(vector<string>* args) {
 	// all hunky-dory
 	return true;
 }
+
+/**
+ * Factory used by the built-in command table.
+ */
+template<class T> static BuiltInI* createBuiltIn(string name, string usage) {
+	return new T(name, usage);
+}
+
+/**
+ * Help text shared by built-in commands implemented by the same class.
+ */
+static constexpr const char* ALIAS_USAGE =
+	"alias & unalias usage:\n"
+	"alias [noargs]: prints out current aliases in session.\n"
+	"alias word=\"val\": creates alias word for val\n"
+	"unalias word: removes alias associated with word.";
+
+static constexpr const char* EXPORT_USAGE =
+	"export & unset usage:\n"
+	"export [noargs]: prints out the exported variables.\n"
+	"export word=val: sets variable word to val and exports it to executed commands.\n"
+	"export word: exports the existing variable word.\n"
+	"unset word [word]*: removes the specified variables.\n"
+	"Variables are expanded in commands as $word or ${word}.";
+
+static constexpr const char* HISTORY_USAGE =
+	"history & prev usage:\n"
+	"history [noargs]: This command will print the session command history.\n\n"
+	"prev [noargs]: This command will print the previously entered command.";
+
+/**
+ * Handles the plan cache and the output store
+ * If command "cache stats" is specified, the size and hit rate of both caches are displayed.
+ * If command "cache clear" is specified, every cached plan and stored output is dropped.
+ * Any other arguments return false and set ERROR_MSG.
+ *
+ * @param args argument vector of the form {cmd, arg0}
+ * @return true if stats are displayed or the cache is cleared, otherwise return false and set ERROR_MSG
+ */
+bool Cache::execute(vector<string>* args) {
+	vector<string>* cmdV = args;
+	PlanCache* cache = Runtime::getRuntime()->getPlanCache();
+	OutputCache* outputs = Runtime::getRuntime()->getOutputCache();
+	if ((*cmdV).size()==2 && (*cmdV)[1].compare("stats")==0) {
+		(*cache).printStats();
+		(*outputs).printStats();
+		return true;
+	}
+	if ((*cmdV).size()==2 && (*cmdV)[1].compare("clear")==0) {
+		(*cache).clear();
+		(*outputs).clear();
+		return true;
+	}
+	ERROR_MSG = "Invalid usage. See help cache for usage.";
+	return false;
+}
+
+/**
+ * Shows or sets the limits of every job
+ * If command "limit" is specified, the limits and the cgroup support of the shell are displayed.
+ * If command "limit" is specified with options and values, those limits are set; a value of 0 removes one.
+ * Invalid options or values return false and set ERROR_MSG.
+ *
+ * @param args argument vector of the form {cmd, [option, value]*}
+ * @return true if the limits are displayed or set, otherwise return false and set ERROR_MSG
+ */
+bool Limit::execute(vector<string>* args) {
+	vector<string>* cmdV = args;
+	Runtime* runtime = Runtime::getRuntime();
+	if ((*cmdV).size()==1) {
+		(*runtime).jobLimits.print();
+		const string& controllers = JobCgroup::controllers();
+		if (controllers.size()>0)
+			cout << "cgroup: " << controllers << endl;
+		else cout << "cgroup: not delegated; memory is limited per process" << endl;
+		return true;
+	}
+	Limits limits = (*runtime).jobLimits;
+	for (size_t i=1;i<(*cmdV).size();i+=2) {
+		if (i+1==(*cmdV).size()) {
+			ERROR_MSG = "Invalid usage. See help limit for usage.";
+			return false;
+		}
+		if (!limits.parse((*cmdV)[i],(*cmdV)[i+1],&ERROR_MSG))
+			return false;
+	}
+	(*runtime).jobLimits = limits;
+	return true;
+}
+
+/**
+ * Shows, resets or exports the metrics of the session
+ * If command "stats" is specified, counts, cache hit rates, fds in use and latency percentiles are displayed.
+ * If command "stats reset" is specified, every metric is zeroed.
+ * If command "stats export" is specified with a file name or off, the metrics are or are no longer
+ * written to that file in the Prometheus text format.
+ *
+ * @param args argument vector of the form {cmd}, {cmd, reset} or {cmd, export, file|off}
+ * @return true if the metrics are displayed, reset or exported, otherwise return false and set ERROR_MSG
+ */
+bool Stats::execute(vector<string>* args) {
+	vector<string>* cmdV = args;
+	Metrics* metrics = Runtime::getRuntime()->getMetrics();
+	if ((*cmdV).size()==1)
+		(*metrics).print();
+	else if ((*cmdV).size()==2 && (*cmdV)[1].compare("reset")==0)
+		(*metrics).reset();
+	else if ((*cmdV).size()==3 && (*cmdV)[1].compare("export")==0) {
+		string path = (*cmdV)[2].compare("off")==0 ? "" : (*cmdV)[2];
+		if (!(*metrics).setExportFile(path)) {
+			ERROR_MSG = "Could not write metrics to "+path;
+			return false;
+		}
+	}
+	else {
+		ERROR_MSG = "Invalid usage. See help stats for usage.";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Turns tracing of the shell's internals on or off, or writes what was traced to a file
+ * If command "trace" is specified, whether tracing is on and the number of events held are displayed.
+ * If command "trace" is specified with on or off, events are or are not recorded from now on.
+ * If command "trace dump" is specified with a file name, the events are written to it as Chrome trace JSON.
+ *
+ * @param args argument vector of the form {cmd}, {cmd, on|off} or {cmd, dump, file}
+ * @return true if the state is displayed or changed, or the file written, otherwise return false and set ERROR_MSG
+ */
+bool TraceCmd::execute(vector<string>* args) {
+	vector<string>* cmdV = args;
+	if ((*cmdV).size()==1)
+		cout << "trace: " << (Trace::enabled() ? "on" : "off") << ", " << Trace::count() << " events" << endl;
+	else if ((*cmdV).size()==2 && ((*cmdV)[1].compare("on")==0 || (*cmdV)[1].compare("off")==0))
+		Trace::setEnabled((*cmdV)[1].compare("on")==0);
+	else if ((*cmdV).size()==3 && (*cmdV)[1].compare("dump")==0) {
+		if (!Trace::dump((*cmdV)[2],&ERROR_MSG))
+			return false;
+	}
+	else {
+		ERROR_MSG = "Invalid usage. See help trace for usage.";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * The built-in command table.
+ * This is the one declaration list of built-in commands; help lists them in this order.
+ */
+static constexpr BuiltInDecl BUILTINS[] = {
+	{ "alias", createBuiltIn<Alias>, ALIAS_USAGE },
+	{ "bye", createBuiltIn<Bye>,
+		"bye usage:\n"
+		"bye [noargs]: This will exit OopShell cleanly." },
+	{ "cache", createBuiltIn<Cache>,
+		"cache usage:\n"
+		"cache stats: prints the number of cached command plans and stored outputs, and their hit rates.\n"
+		"cache clear: empties the plan cache and the output store.\n"
+		"cache [-e name]* cmd [arg]* [ | cmd [arg]*]* [ < file1] [> file2]: runs a deterministic pipeline once,\n"
+		"  and afterwards replays its output from the store while its commands, args, < file1, the directory\n"
+		"  and the named variables are unchanged. Only runs that exit with 0 are stored; stderr is not.\n"
+		"  Without < file1 it runs uncached unless stdin is /dev/null.\n"
+		"Parsed command lines are cached until an alias, PATH, the directory or a variable changes.\n"
+		"Lines with glob patterns are always parsed again." },
+	{ "cd", createBuiltIn<Cd>,
+		"cd usage:\n"
+		"cd [noargs]: changes directory to current user home.\n"
+		"cd directory_name: changes directory to directory_name if it exists." },
+	{ "clear", createBuiltIn<Clr>,
+		"clear usage:\n"
+		"clear [noargs]: This command will clear the terminal of previous output." },
+	{ "export", createBuiltIn<Export>, EXPORT_USAGE },
+	{ "help", createBuiltIn<Help>,
+		"Are you trying to be funny? Try entering help instead." },
+	{ "history", createBuiltIn<History>, HISTORY_USAGE },
+	{ "limit", createBuiltIn<Limit>,
+		"limit usage:\n"
+		"limit [noargs]: prints the limits of every job, and the cgroup controllers the shell can use.\n"
+		"limit [option value]+: sets the limits of every job; a value of 0 removes a limit.\n"
+		"limit [option value]+ cmd [arg]* [ | cmd [arg]*]* [ < file1] [> file2]: runs a pipeline with these limits.\n"
+		"  -m megabytes: memory of the job, or of each process without a delegated cgroup (RLIMIT_AS)\n"
+		"  -t seconds: CPU time of each process (RLIMIT_CPU)\n"
+		"  -n files: open files of each process (RLIMIT_NOFILE)\n"
+		"  -c cpus: CPU bandwidth of the job, e.g. 0.5 (cgroup cpu.max)\n"
+		"  -i megabytes: read and write bytes per second of the job on the disk of the directory (cgroup io.max)\n"
+		"Each job with -m, -c or -i runs in a cgroup v2 of its own when the shell's cgroup is delegated." },
+	{ "prev", createBuiltIn<History>, HISTORY_USAGE },
+	{ "pwd", createBuiltIn<Pwd>,
+		"pwd usage:\n"
+		"pwd [noargs]: This command will display the current working directory." },
+	{ "set", createBuiltIn<Set>,
+		"set usage:\n"
+		"set [noargs]: prints out the current PATH and prompt variables.\n"
+		"set path [directory_name]+: adds specified directory_name(s) to PATH.\n"
+		"set prompt val: sets shell prompt to val.\n"
+		"set batch off|on|parallel: commands whose arguments exceed ARG_MAX are refused (off), or split\n"
+		"  into several runs like xargs, run one after another (on) or concurrently (parallel).\n"
+		"  Output of the runs is kept in order. Only args produced by glob expansion are split; a command\n"
+		"  without them is refused.\n"
+		"set journal on|off: saves each alias, prompt and path change right away by appending it to\n"
+		"  oopshell_rc.journal, instead of rewriting oopshell_rc on exit.\n"
+		"set cachesize megabytes: limits the outputs stored by the cache prefix to this size (default 256);\n"
+		"  the least recently used outputs are deleted first.\n"
+		"set spawner on|off: launches commands through a small helper process instead of forking the shell,\n"
+		"  which is faster once the shell is large. OOPSHELL_SPAWNER=on starts it with the shell.\n"
+		"set placement auto|off: runs adjacent stages of each pipeline on the CPUs of one NUMA node (auto),\n"
+		"  moving on to the next node once every CPU of a node has a stage. Stages with @cpus or @node keep them.\n"
+		"set cmdtimeout duration|off: stops every job that runs longer than duration, e.g. 30, 2.5, 10m or 1h,\n"
+		"  as if it had the timeout prefix. A timeout prefix overrides it; timeout 0 runs a job without one.\n"
+		"set killgrace duration: time a job that timed out gets to exit after SIGTERM, before SIGKILL (default 5).\n"
+		"set pipestat off|on|live: relays the pipes of every pipeline and prints their throughput when it ends (on),\n"
+		"  or every second on stderr too (live), as if it had the pipestat prefix." },
+	{ "stats", createBuiltIn<Stats>,
+		"stats usage:\n"
+		"stats [noargs]: prints commands and pipelines run and per second, plan and output cache hit rates,\n"
+		"  fds in use, and the mean, p50, p90, p99 and max of parse time, spawn latency and pipeline wall time.\n"
+		"stats reset: zeroes every metric.\n"
+		"stats export file|off: writes the metrics to file in the Prometheus text format, now, after pipelines\n"
+		"  at most once a second, and at exit; e.g. a .prom file in the node_exporter textfile directory.\n"
+		"  OOPSHELL_METRICS=file in the environment starts the export with the shell." },
+	{ "trace", createBuiltIn<TraceCmd>,
+		"trace usage:\n"
+		"trace [noargs]: prints whether tracing is on, and the number of events held.\n"
+		"trace on|off: starts or stops recording how long parsing, alias expansion, building pipes, fork,\n"
+		"  exec and wait take in the shell. Each thread keeps its last 16384 events.\n"
+		"trace dump file: writes the events held to file as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev." },
+	{ "unalias", createBuiltIn<Alias>, ALIAS_USAGE },
+	{ "unset", createBuiltIn<Export>, EXPORT_USAGE },
+};
+
+static constexpr int BUILTIN_COUNT = sizeof(BUILTINS)/sizeof(BUILTINS[0]);
+
+/**
+ * Number of hash slots; a power of two with room to spare, so a collision-free seed is found quickly.
+ */
+static constexpr unsigned BUILTIN_SLOTS = 64;
+static_assert(BUILTIN_SLOTS >= 2*BUILTIN_COUNT, "grow BUILTIN_SLOTS along with the built-in command table");
+
+/**
+ * FNV-1a hash of a command name, seeded so the seed can be searched for a perfect hash.
+ */
+static constexpr unsigned builtInHash(const char* s, size_t len, unsigned seed) {
+	unsigned h = seed;
+	for (size_t i=0;i<len;i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+static constexpr size_t constLength(const char* s) {
+	size_t n = 0;
+	while (s[n]!='\0') n++;
+	return n;
+}
+
+/**
+ * @return true if seed maps every built-in name to its own slot
+ */
+static constexpr bool isPerfectSeed(unsigned seed) {
+	bool used[BUILTIN_SLOTS] = {};
+	for (int i=0;i<BUILTIN_COUNT;i++) {
+		unsigned slot = builtInHash(BUILTINS[i].name,constLength(BUILTINS[i].name),seed) & (BUILTIN_SLOTS-1);
+		if (used[slot]) return false;
+		used[slot] = true;
+	}
+	return true;
+}
+
+static constexpr unsigned findPerfectSeed() {
+	unsigned seed = 2166136261u;
+	while (!isPerfectSeed(seed))
+		seed++;
+	return seed;
+}
+
+static constexpr unsigned BUILTIN_SEED = findPerfectSeed();
+
+/**
+ * Slot -> built-in id map, computed at compile time. Empty slots hold -1.
+ */
+struct BuiltInSlotMap {
+	signed char id[BUILTIN_SLOTS];
+};
+
+static constexpr BuiltInSlotMap buildSlotMap() {
+	BuiltInSlotMap map = {};
+	for (unsigned i=0;i<BUILTIN_SLOTS;i++)
+		map.id[i] = -1;
+	for (int i=0;i<BUILTIN_COUNT;i++)
+		map.id[builtInHash(BUILTINS[i].name,constLength(BUILTINS[i].name),BUILTIN_SEED) & (BUILTIN_SLOTS-1)] = i;
+	return map;
+}
+
+static constexpr BuiltInSlotMap BUILTIN_SLOT_MAP = buildSlotMap();
+
+/**
+ * Finds a built-in command by name: one hash, one probe, one compare.
+ *
+ * @param name -- command name
+ * @param len -- length of name
+ * @return the built-in id, or -1 if name is not a built-in command
+ */
+int findBuiltIn(const char* name, size_t len) {
+	int id = BUILTIN_SLOT_MAP.id[builtInHash(name,len,BUILTIN_SEED) & (BUILTIN_SLOTS-1)];
+	if (id<0 || strncmp(BUILTINS[id].name,name,len)!=0 || BUILTINS[id].name[len]!='\0')
+		return -1;
+	return id;
+}
+
+/**
+ * @param id -- built-in id
+ * @return the table entry for id
+ */
+const BuiltInDecl* getBuiltInDecl(int id) {
+	return &BUILTINS[id];
+}
+
+/**
+ * @return number of built-in commands
+ */
+int builtInCount() {
+	return BUILTIN_COUNT;
+}
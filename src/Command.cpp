@@ -8,6 +8,13 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <unistd.h> // for fork, exec
+#include <string.h> // for memset
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h> // for kill
+#include <sys/syscall.h> // for SYS_pidfd_open
 
 using std::cout;
 using std::endl;
@@ -16,10 +23,54 @@ using std::vector;
 
 pid_t Command::gpid = 0;
 
+/**
+ * Lists the files a command name may refer to, in search order: each PATH directory, then the cwd.
+ *
+ * @param name -- command name, without a '/'
+ * @param files -- receives the candidate paths
+ */
+static void searchPath(const string& name, vector<string>* files) {
+	Runtime* runtime = Runtime::getRuntime();
+	string path;
+	(*runtime).getVar("PATH",&path);
+	path.append(":"+(*runtime).getCwd());
+	size_t start = 0;
+	while (start<=path.size()) {
+		size_t end = path.find(':',start);
+		if (end==string::npos) end = path.size();
+		string file = end>start ? path.substr(start,end-start) : ".";
+		file.append("/"+name);
+		(*files).push_back(file);
+		start = end+1;
+	}
+}
+
+/**
+ * Constructor for Command objects.
+ * Scanner fills in cmd, args and IO types; everything else starts out empty.
+ */
+Command::Command() {
+	builtIn = false;
+	builtInId = -1;
+	function = false;
+	inputType = STDIO;
+	outputType = STDIO;
+	batchFrom = 0;
+	batchTo = 0;
+	fdIn = STDIN_FILENO;
+	fdOut = STDOUT_FILENO;
+	pid = 0;
+	childState = 0;
+	cgroupFd = -1;
+	timed = false;
+	memset(&times,0,sizeof(times));
+	spawnedBy = NULL;
+}
+
 /**
  * Execute Command
  *
- * If the command is built-in, it will execute in the current process and return.
+ * If the command is built-in or a script function, it will execute in the current process and return.
  *
  * If the command is standard, execute will:
  * 1. fork a process, and store pid
@@ -27,28 +78,64 @@ pid_t Command::gpid = 0;
  *    -- otherwise, initialize group id to child pid and set child process group id.
  * 2. open, set, and close file descriptors for input & output.
  * 3. execute the command
+ * When the spawn helper is running, it launches the command instead, and the shell does not fork.
+ * A timed command is not left until it exec'd, so its launch time is known; a close-on-exec pipe tells when.
  *
  * @return 0 if execution is successful, otherwise set ERROR_MSG and return -1.
  */
 int Command::execute() {
+	TRACE_SCOPE_DETAIL("Command::execute",cmd.c_str());
 	Runtime* runtime = Runtime::getRuntime();
+	(*runtime).getMetrics()->add(COUNTER_COMMANDS,1);
 	// execute builtin cmd
 	if (builtIn==true) {
-		BuiltInI* bii = (*runtime).getBuiltIn(&cmd);
+		BuiltInI* bii = (*runtime).getBuiltIn(builtInId);
 		if (!(*bii).execute(&args)) {
+			childState = 1;
 			ERROR_MSG = (*bii).ERROR_MSG;
 			return -1;
 		}
+		childState = 0;
+		return 0;
+	}
+	// run a script function in the shell
+	if (function) {
+		childState = (*runtime).callFunction(&args);
 		return 0;
 	}
 	// execute regular cmd
+	// anything the shell buffered must come out before the child's output
+	flushOutput();
+	MetricScope spawnTimer(HIST_SPAWN);
+	// a batched command needs a runner process of its own, so it is always forked
+	Spawner* spawner = (*runtime).getSpawner();
+	if (timed)
+		clock_gettime(CLOCK_MONOTONIC,&times.forked);
+	if (spawner!=NULL && batchEnds.size()==0)
+		return spawn(spawner);
+	int execPipe[2] = { -1, -1 };
+	if (timed && pipe2(execPipe,O_CLOEXEC)!=0)
+		execPipe[0] = execPipe[1] = -1;
+	uint64_t forkStart = Trace::enabled() ? Trace::now() : 0;
 	pid = fork();
+	if (forkStart!=0 && pid>0)
+		Trace::record("fork",forkStart,Trace::now(),cmd.c_str());
 	// return error if fork fails
 	if (pid == -1) {
+		if (execPipe[0]>=0) {
+			close(execPipe[0]);
+			close(execPipe[1]);
+		}
 		ERROR_MSG = "Failed to fork cmd "+cmd;
 		return -1;
 	}
 	if(pid == 0) {
+		// the child joins the group too, in case it execs before the parent's setpgid runs
+		setpgid(0,gpid>0 ? gpid : 0);
+		// join the job's cgroup first, so all the child uses is charged to the job
+		// failures go to stderr: stdout may be the pipe or > file the command writes its data to
+		if (cgroupFd>=0 && write(cgroupFd,"0",1)<0)
+			std::cerr << "Could not join the cgroup of the job for cmd " << cmd << endl;
 		// Set Input for Pipes & Files
 		if (inputType==PIPE || inputType==FILEIO) {
 			// redirect stdin (0) to fdIn (the read end of a pipe) then close fdIn
@@ -61,8 +148,24 @@ int Command::execute() {
 			dup2(fdOut,STDOUT_FILENO);
 			close(fdOut);
 		}
+		// batches run by a runner inherit its placement and limits
+		string failed;
+		if (placement.isSet() && !placement.apply(&failed))
+			std::cerr << "Could not apply" << failed << " for cmd " << cmd << endl;
+		failed.clear();
+		if (limits.isSet() && !limits.apply(&failed))
+			std::cerr << "Could not apply limit" << failed << " for cmd " << cmd << endl;
+		flushOutput();
+		// a batched command becomes a runner process that launches each batch;
+		// it never execs, so it must drop the other pipe ends itself or readers would never see EOF
+		if (batchEnds.size()>0) {
+			closeFrom(STDERR_FILENO+1);
+			_exit(runBatches());
+		}
+		// exec failed: leave without running atexit handlers, which belong to the shell
 		childState = evalCmd(&args);
-		exit(0);
+		flushOutput();
+		_exit(127);
 	}
 	// Parent cleans up after child exits
 	else {
@@ -76,15 +179,140 @@ int Command::execute() {
 			close(fdOut);
 		//otherwise pipe output to stdout
 		else dup2(fdOut,STDOUT_FILENO);
+		// the read end belongs to the child now; keeping it would stop writers from seeing EPIPE
+		if (inputType==PIPE || inputType==FILEIO)
+			close(fdIn);
+		if (timed) {
+			// the child's copy of the write end closes when it execs, or exits
+			if (execPipe[0]>=0) {
+				close(execPipe[1]);
+				char c;
+				while (read(execPipe[0],&c,1)<0 && errno==EINTR) {}
+				close(execPipe[0]);
+			}
+			clock_gettime(CLOCK_MONOTONIC,&times.execed);
+		}
 	}
 	return 0;
 }
 
 /**
- * This method waits on the forked process associated with member variable pid.
+ * Launches the command through the spawn helper instead of forking the shell.
+ * The helper gets the command's stdin and stdout, puts it in the process group gpid and the job's cgroup,
+ * and applies its placement and limits.
+ *
+ * @param spawner -- the running spawn helper
+ * @return 0 if the command was launched, otherwise set ERROR_MSG and return -1.
+ */
+int Command::spawn(Spawner* spawner) {
+	TRACE_SCOPE_DETAIL("Command::spawn",cmd.c_str());
+	// lines that are not cached were never resolved, and the file a cached line resolved to may have gone since;
+	// then PATH is searched again, as evalCmd does. A name not found is passed as is, and the helper reports it
+	if (execPath.size()==0 || access(execPath.c_str(),X_OK)!=0)
+		resolvePath();
+	const string& path = (args[0].find('/')!=string::npos || execPath.size()==0) ? args[0] : execPath;
+	int fds[4] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cgroupFd };
+	if (inputType==PIPE || inputType==FILEIO)
+		fds[0] = fdIn;
+	if (outputType==PIPE || outputType==FILEIO)
+		fds[1] = fdOut;
+	pid = (*spawner).spawn(path,args,fds,gpid>0 ? gpid : 0,placement,limits,timed ? &times : NULL);
+	if (pid<0) {
+		pid = 0;
+		ERROR_MSG = "Failed to spawn cmd "+cmd;
+		return -1;
+	}
+	spawnedBy = spawner;
+	if (gpid<=0)
+		gpid = pid;
+	// the helper has its own copies of the fds now
+	if (outputType==PIPE || outputType==FILEIO)
+		close(fdOut);
+	if (inputType==PIPE || inputType==FILEIO)
+		close(fdIn);
+	return 0;
+}
+
+/**
+ * This method waits on the forked process associated with member variable pid, and collects its rusage.
  */
 void Command::wait() {
-	if (pid!=0) waitpid(pid,&childState,0);
+	if (spawnedBy==NULL && pid==0) return;
+	TRACE_SCOPE_DETAIL("Command::wait",cmd.c_str());
+	// the helper reports each exit once; waiting again must not block, as waitpid would not
+	if (spawnedBy!=NULL) {
+		childState = (*spawnedBy).wait(pid,&times.usage);
+		spawnedBy = NULL;
+		pid = 0;
+	}
+	else wait4(pid,&childState,0,&times.usage);
+	markExited();
+}
+
+/**
+ * Records the time the child was seen to exit, if the command is timed and it was not recorded yet.
+ */
+void Command::markExited() {
+	if (timed && times.exited.tv_sec==0 && times.exited.tv_nsec==0)
+		clock_gettime(CLOCK_MONOTONIC,&times.exited);
+}
+
+/**
+ * Opens a pidfd for the child, for a wait loop that polls it along with other fds.
+ * It polls readable once the child exits, whether the shell or the spawn helper is its parent.
+ *
+ * @return the pidfd; -1 with errno ESRCH if there is no child, or ENOSYS if the kernel has no pidfds
+ */
+int Command::openPidFd() {
+	if (pid<=0) {
+		errno = ESRCH;
+		return -1;
+	}
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open,pid,0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * Checks whether the child is still running, without reaping it.
+ * A child of the spawn helper is reaped by the helper as soon as it exits, so it is gone once it finished.
+ *
+ * @return true if there is a child and it has not exited
+ */
+bool Command::running() {
+	if (pid<=0)
+		return false;
+	if (spawnedBy!=NULL)
+		return kill(pid,0)==0;
+	siginfo_t info;
+	info.si_pid = 0;
+	return waitid(P_PID,pid,&info,WEXITED|WNOHANG|WNOWAIT)==0 && info.si_pid==0;
+}
+
+/**
+ * Exit status of the command once it finished.
+ * For a built-in it is 0 if it succeeded, otherwise 1; for a function, the status of its last command.
+ *
+ * @return the exit status, or 128+n if the child was killed by signal n
+ */
+int Command::status() {
+	if (builtIn || function)
+		return childState;
+	if (WIFSIGNALED(childState))
+		return 128+WTERMSIG(childState);
+	return WEXITSTATUS(childState);
+}
+
+/**
+ * @return the signal that killed the command, or 0 if it exited, or is a built-in or function
+ */
+int Command::signal() {
+	if (builtIn || function || !WIFSIGNALED(childState))
+		return 0;
+	return WTERMSIG(childState);
 }
 
 /**
@@ -102,36 +330,204 @@ void Command::setFd(int fdIni, int fdOuti) {
  *
  * This will execute the standard command given in the input vector, with associated arguments.
  *
- * IF the command is fully qualified, it will be executed directly.
- * Otherwise, the execution will search the current PATH variable, plus the current working directory
- * for the command.
+ * IF the command contains a '/', it will be executed directly.
+ * If resolvePath found the file for the command, that file is executed directly.
+ * Otherwise, the execution will search the PATH shell variable, plus the current working directory
+ * for the command. The environment is the cached envp snapshot from Runtime, which Executor brought up to date
+ * before the fork.
  *
  * @param v -- vector of command & args in form { cmd, arg0, ... argn }
- * @return 0 if command is successful, else set ERROR_MSG and return execvp failure code.
+ * @return only returns if the command could not be executed; the return value is then -1.
  */
 int Command::evalCmd(vector<string>* v) {
-	// add cwd to path (it will only exist during this child process execution) so it is searched by execvp
-	string path = getenv("PATH");
-	string sep=":";
-	string pwd = getPwd();
-	path.append(sep+pwd);
-	setenv("PATH",path.c_str(),1);
+	Runtime* runtime = Runtime::getRuntime();
+	char** envp = (*runtime).getEnvp();
 	// copy the vector strings into char* array for exec
 	char *args[(*v).size()+1];
 	for (size_t i=0;i<(*v).size();i++)
 		args[i] = const_cast<char *>((*v)[i].c_str());
-	args[(*v).size()] = '\0'; // null termination to keep exec happy
-	int result = execvp(args[0], args);
-	if (result==0)
-		return result;
+	args[(*v).size()] = NULL; // null termination to keep exec happy
+	const string& name = (*v)[0];
+	if (name.find('/')!=string::npos)
+		execFile(name.c_str(), args, envp);
 	else {
-		cout << "Command " << (*v)[0] << " was not found." << endl;
-		return result;
+		// the file may have gone since it was resolved; then search as usual
+		if (execPath.size()>0)
+			execFile(execPath.c_str(), args, envp);
+		vector<string> files;
+		searchPath(name,&files);
+		for (size_t i=0;i<files.size();i++)
+			execFile(files[i].c_str(), args, envp);
 	}
-	// this should never execute
+	cout << "Command " << name << " was not found." << endl;
 	return -1;
 }
 
+/**
+ * Resolve Command Path
+ *
+ * Finds the file evalCmd would execute for cmd: the first executable regular file in the PATH search.
+ * Built-ins and commands containing a '/' are left alone; execPath stays empty if nothing is found.
+ */
+void Command::resolvePath() {
+	execPath.clear();
+	if (builtIn || args.size()==0 || args[0].find('/')!=string::npos)
+		return;
+	vector<string> files;
+	searchPath(args[0],&files);
+	struct stat st;
+	for (size_t i=0;i<files.size();i++) {
+		if (stat(files[i].c_str(),&st)==0 && S_ISREG(st.st_mode) && access(files[i].c_str(),X_OK)==0) {
+			execPath = files[i];
+			return;
+		}
+	}
+}
+
+/**
+ * Helper method for evalCmd: executes a file with execve.
+ * Like execvp, a file that is executable but not a binary is run by /bin/sh.
+ * This only returns if the file could not be executed.
+ *
+ * @param file -- path of the file to execute
+ * @param args -- NULL terminated argument array
+ * @param envp -- NULL terminated environment array
+ */
+void Command::execFile(const char* file, char** args, char** envp) {
+	execve(file, args, envp);
+	if (errno==ENOEXEC) {
+		size_t n = 0;
+		while (args[n]!=NULL) n++;
+		char* shArgs[n+2];
+		shArgs[0] = const_cast<char*>("/bin/sh");
+		shArgs[1] = const_cast<char*>(file);
+		for (size_t i=1;i<=n;i++)
+			shArgs[i+1] = args[i];
+		execve("/bin/sh", shArgs, envp);
+	}
+}
+
+/**
+ * Computes the number of bytes args will take in a new process image:
+ * the strings, their terminators, and the argv pointer array.
+ *
+ * @return size of args in bytes
+ */
+size_t Command::argSize() {
+	size_t size = (args.size()+1)*sizeof(char*);
+	for (size_t i=0;i<args.size();i++)
+		size += args[i].size()+1;
+	return size;
+}
+
+/**
+ * Splits args[batchFrom..batchTo) into runs, like xargs.
+ * Every run repeats the args before batchFrom and after batchTo, and takes as many of the others as fit.
+ * A command with no glob-expanded args has an empty span, and is refused.
+ *
+ * @param limit -- number of bytes each run's args may use
+ * @return true if every run fits, otherwise set ERROR_MSG and return false.
+ */
+bool Command::planBatches(size_t limit) {
+	batchEnds.clear();
+	size_t to = batchTo>args.size() ? args.size() : batchTo;
+	if (batchFrom>=to) {
+		ERROR_MSG = "Argument list too long for cmd "+cmd+", and it cannot be split.";
+		return false;
+	}
+	// bytes repeated in every run
+	size_t fixed = (batchFrom+args.size()-to+1)*sizeof(char*);
+	for (size_t i=0;i<args.size();i++)
+		if (i<batchFrom || i>=to)
+			fixed += args[i].size()+1;
+	size_t used = fixed;
+	size_t count = 0;
+	for (size_t i=batchFrom;i<to;i++) {
+		size_t a = args[i].size()+1+sizeof(char*);
+		if (used+a > limit) {
+			if (count==0) {
+				ERROR_MSG = "Argument "+args[i].substr(0,32)+"... of cmd "+cmd+" is too long to execute.";
+				return false;
+			}
+			batchEnds.push_back(i);
+			used = fixed;
+			count = 0;
+		}
+		used += a;
+		count++;
+	}
+	batchEnds.push_back(to);
+	return true;
+}
+
+/**
+ * Runs the batches planned by planBatches. This is called in the forked child, which becomes the runner.
+ *
+ * In sequential mode each batch writes straight to stdout and the next one starts when it exits.
+ * In parallel mode up to one batch per CPU runs at once; the oldest batch writes straight to stdout,
+ * the others write to temporary files that are copied out in batch order, so output order is preserved.
+ * A batch that can not get a temporary file is not started until the older ones are done.
+ *
+ * @return 0 if every batch succeeded, 127 if the command was not found, otherwise 123 (as xargs does)
+ */
+int Command::runBatches() {
+	bool parallel = Runtime::getRuntime()->batchMode == BATCH_PARALLEL;
+	long window = parallel ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (window<1) window = 1;
+	size_t to = batchTo>args.size() ? args.size() : batchTo;
+	size_t n = batchEnds.size();
+	vector<pid_t> pids(n,0);
+	vector<int> outFds(n,-1);
+	size_t started=0, finished=0;
+	int result = 0;
+	while (finished<n) {
+		// keep the window full
+		while (started<n && started-finished<(size_t)window) {
+			if (started>0 && parallel) {
+				FILE* tmp = tmpfile();
+				if (tmp!=NULL) {
+					outFds[started] = dup(fileno(tmp));
+					fclose(tmp);
+				}
+				// without a file to hold its output the batch writes to stdout itself, after the older ones
+				if (outFds[started]<0 && started>finished)
+					break;
+			}
+			pids[started] = fork();
+			if (pids[started]==0) {
+				if (outFds[started]>=0) {
+					dup2(outFds[started],STDOUT_FILENO);
+					close(outFds[started]);
+				}
+				vector<string> v(args.begin(),args.begin()+batchFrom);
+				size_t first = started==0 ? batchFrom : batchEnds[started-1];
+				v.insert(v.end(),args.begin()+first,args.begin()+batchEnds[started]);
+				v.insert(v.end(),args.begin()+to,args.end());
+				evalCmd(&v);
+				flushOutput();
+				_exit(127);
+			}
+			started++;
+		}
+		// collect the oldest batch, then emit its output
+		int status = 0;
+		if (pids[finished]>0)
+			waitpid(pids[finished],&status,0);
+		if (pids[finished]<0 || !WIFEXITED(status))
+			result = 123;
+		else if (WEXITSTATUS(status)==127)
+			result = 127;
+		else if (WEXITSTATUS(status)!=0 && result==0)
+			result = 123;
+		if (outFds[finished]>=0) {
+			copyFile(outFds[finished],STDOUT_FILENO);
+			close(outFds[finished]);
+		}
+		finished++;
+	}
+	return result;
+}
+
 /**
  * Prints out the internal state of the command as a table.
  *
@@ -153,6 +549,20 @@ void Command::printState(string* header) {
 	cout << endl << "****************************************"<< endl;
 }
 
+/**
+ * Constructor for CommandList. Scanner fills it in.
+ */
+CommandList::CommandList() {
+	memoize = false;
+	timeout = -1;
+	killGrace = -1;
+	timed = false;
+	pipeStat = PIPESTAT_OFF;
+	benchRuns = 0;
+	benchWarmup = 0;
+	benchKeep = false;
+}
+
 /**
  * Convenince method to return the size of the list of commands stored in CommandList.
  *
@@ -2,17 +2,51 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <string.h>
 #include <vector>
 #include <string>
+#include <algorithm> // for sort
+#include <math.h> // for sqrt
 // these are for c file handling
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h> // for killpg
+#include <unistd.h> // for pipe
+#include <stdio.h> // for snprintf
+#include <sys/timerfd.h>
 
 using std::cout;
 using std::endl;
 using std::string;
 using std::vector;
+using std::stringstream;
+
+/**
+ * Adds a number of seconds to a time.
+ */
+static void addSeconds(struct timespec* t, double seconds) {
+	long long ns = (*t).tv_nsec+(long long)((seconds-(long long)seconds)*1e9);
+	(*t).tv_sec += (time_t)seconds+ns/1000000000;
+	(*t).tv_nsec = ns%1000000000;
+}
+
+/**
+ * Seconds from one time to another.
+ */
+static double elapsed(const struct timespec& from, const struct timespec& to) {
+	return (to.tv_sec-from.tv_sec)+(to.tv_nsec-from.tv_nsec)/1e9;
+}
+
+/**
+ * Seconds of a struct timeval, as rusage reports CPU time.
+ */
+static double timevalSeconds(const struct timeval& t) {
+	return t.tv_sec+t.tv_usec/1e6;
+}
 
 /**
  * Constructor for Executor object.
@@ -23,6 +57,17 @@ Executor::Executor(CommandList* sinput) {
 	input = sinput;
 	cvItr = (*input).cmdV.begin();
 	cvEnd = (*input).cmdV.end();
+	exitStatus = 0;
+	timeout = 0;
+	grace = 0;
+	deadline.tv_sec = 0;
+	deadline.tv_nsec = 0;
+	jobPgid = 0;
+	timer = -1;
+	timedOut = false;
+	timing = false;
+	began = 0;
+	shown = sinput;
 }
 
 /**
@@ -45,17 +90,55 @@ bool Executor::hasNext() {
 
 /**
  * This method executes the next Command available on Executor's queue, if one exists.
- * If no command from the queue has been executed yet, it will call buildFds before execution.
+ * If no command from the queue has been executed yet, it will apply the job's limits and call buildFds
+ * before execution, and with set placement auto, place the stages of a pipeline.
+ * With pipestat, the relay between the stages is started once the pipes are built.
+ * The environment is brought up to date before the first fork, so the children only read it.
+ * A job with a timeout starts a process group of its own, and its deadline is counted from here;
+ * it is refused if the timer for the deadline can not be made.
+ * For a job with the time prefix, every Command is marked timed.
  *
  * @return true if execution was successful, otherwise set ERROR_MSG and return false.
  */
 bool Executor::execNext() {
 	if (!hasNext()) return false;
 	if (cvItr == (*input).cmdV.begin()) {
+		began = Trace::now();
+		if (!applyLimits()) return false;
+		if (Runtime::getRuntime()->autoPlacement && (*input).cmdV.size()>1)
+			Placement::autoPlace(&(*input).cmdV);
 		bool bp = buildFds(&(*input).cmdV,(*input).inputFile,(*input).outputFile);
 		if (!bp) return false;
+		Runtime* runtime = Runtime::getRuntime();
+		// rebuild the envp snapshot here if a variable changed, so each forked child does not rebuild it
+		(*runtime).getEnvp();
+		if (!relay.start(pipeStat()==PIPESTAT_LIVE)) {
+			ERROR_MSG = "Could not start the pipe relay";
+			return false;
+		}
+		timeout = (*input).timeout>=0 ? (*input).timeout : (*runtime).cmdTimeout;
+		grace = (*input).killGrace>=0 ? (*input).killGrace : (*runtime).killGrace;
+		if (timeout>0) {
+			timer = timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC);
+			if (timer<0) {
+				ERROR_MSG = "Could not set up the timeout of cmd "+(*input).cmdV[0].cmd;
+				return false;
+			}
+			Command::gpid = 0;
+			clock_gettime(CLOCK_MONOTONIC,&deadline);
+			addSeconds(&deadline,timeout);
+		}
+		timing = (*input).timed;
+		for (size_t i=0;timing && i<(*input).cmdV.size();i++) {
+			Command* c = &(*input).cmdV[i];
+			(*c).timed = true;
+			memset(&(*c).times,0,sizeof((*c).times));
+		}
 	}
+	if (!(*cvItr).builtIn && !checkArgSize(&(*cvItr))) return false;
 	if ((*cvItr).execute() >= 0) {
+		if (timeout>0 && jobPgid==0 && !(*cvItr).builtIn && !(*cvItr).function)
+			jobPgid = Command::gpid;
 		++cvItr;
 	} else {
 		ERROR_MSG = (*cvItr).ERROR_MSG;
@@ -75,15 +158,26 @@ bool Executor::execNext() {
  * @return true if all pipes and files were able to be created and set.
  */
 bool Executor::buildFds(vector<Command>* v, string inFileName, string outFileName) {
+	TRACE_SCOPE("Executor::buildFds");
 	// create & initialize n-1 pipes for n commands
+	// pipes are close-on-exec, so each command only keeps the ends it dup2'ed onto stdin/stdout
 	int pipeNum = (*v).size()-1;
 	int fda[pipeNum][2];
+	// with pipestat each pipe gets a second half, read by the next command; the relay moves the data across
+	int fdb[pipeNum][2];
+	bool relayed = pipeStat()!=PIPESTAT_OFF;
 	int i;
 	for (i=0;i<pipeNum;i++) {
-		if (pipe(fda[i])==-1) {
+		if (pipe2(fda[i],O_CLOEXEC)==-1 || (relayed && pipe2(fdb[i],O_CLOEXEC)==-1)) {
 			ERROR_MSG = "Pipe failed ";
 			return false;
 		}
+		if (relayed) {
+			stringstream name;
+			name << i+1 << " " << (*v)[i].cmd << ">" << (*v)[i+1].cmd;
+			relay.addLink(fda[i][READ],fdb[i][WRITE],name.str());
+			fda[i][READ] = fdb[i][READ];
+		}
 	}
 	// for each command, set input & output file descriptors
 	for (i=0;i<=pipeNum;i++) {
@@ -99,7 +193,7 @@ bool Executor::buildFds(vector<Command>* v, string inFileName, string outFileNam
 				break;
 			case FILEIO:
 				// set FD to file
-				fdIn = open(const_cast<char *>(inFileName.c_str()), (O_RDONLY));
+				fdIn = open(const_cast<char *>(inFileName.c_str()), (O_RDONLY|O_CLOEXEC));
 				if (fdIn<0) {
 					ERROR_MSG = "Could not open input file "+inFileName;
 					return false;
@@ -130,7 +224,7 @@ bool Executor::buildFds(vector<Command>* v, string inFileName, string outFileNam
 				break;
 			case FILEIO:
 				// set FD to input file
-				fdOut = open(const_cast<char *>(outFileName.c_str()),(O_CREAT|O_RDWR|O_TRUNC),0666);
+				fdOut = open(const_cast<char *>(outFileName.c_str()),(O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC),0666);
 				if (fdOut<0) {
 					ERROR_MSG = "Could not open output file "+outFileName;
 					return false;
@@ -157,14 +251,91 @@ bool Executor::buildFds(vector<Command>* v, string inFileName, string outFileNam
 	return true;
 }
 
+/**
+ * The pipestat mode of the job: the one of its prefix, or else the one set for every job.
+ * A single command has no pipes to measure.
+ */
+PipeStatMode Executor::pipeStat() {
+	if ((*input).cmdV.size()<2)
+		return PIPESTAT_OFF;
+	return (*input).pipeStat!=PIPESTAT_OFF ? (*input).pipeStat : Runtime::getRuntime()->pipeStat;
+}
+
+/**
+ * Measures argv+envp of a Command against sysconf(_SC_ARG_MAX) before it is launched,
+ * so an oversized command does not fail in exec with E2BIG.
+ * If Runtime allows batching, the Command is split into several runs, like xargs.
+ *
+ * @param cmd -- Command about to be executed
+ * @return true if cmd can be launched, otherwise set ERROR_MSG and return false.
+ */
+bool Executor::checkArgSize(Command* cmd) {
+	long argMax = sysconf(_SC_ARG_MAX);
+	if (argMax<=0) return true;
+	size_t argBytes = (*cmd).argSize();
+	// counted when the environment snapshot was rebuilt, so this stays cheap for every command
+	size_t envBytes = Runtime::getRuntime()->getEnvBytes();
+	// leave the same headroom as xargs for the exec'd program's own use
+	size_t limit = (size_t)argMax - 2048;
+	if (envBytes >= limit) {
+		ERROR_MSG = "Environment is too large to execute cmd "+(*cmd).cmd;
+		return false;
+	}
+	if (argBytes+envBytes <= limit) return true;
+	if (Runtime::getRuntime()->batchMode == BATCH_OFF) {
+		stringstream ss;
+		ss << "Argument list too long for cmd " << (*cmd).cmd << " (" << argBytes+envBytes
+		   << " bytes, ARG_MAX is " << argMax << "). Use set batch on to split it into several runs.";
+		ERROR_MSG = ss.str();
+		return false;
+	}
+	if (!(*cmd).planBatches(limit-envBytes)) {
+		ERROR_MSG = (*cmd).ERROR_MSG;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Combines the limit prefix of the line with the limits set for every job, and gives them to each Command.
+ * If they need a cgroup leaf, it is created, and each Command joins it before exec.
+ *
+ * @return true if the limits can be enforced, otherwise set ERROR_MSG and return false.
+ */
+bool Executor::applyLimits() {
+	Limits limits = (*input).limits;
+	limits.inherit(Runtime::getRuntime()->jobLimits);
+	if (!limits.isSet())
+		return true;
+	if (!cgroup.create(&limits,&ERROR_MSG))
+		return false;
+	for (size_t i=0;i<(*input).cmdV.size();i++) {
+		(*input).cmdV[i].limits = limits;
+		(*input).cmdV[i].cgroupFd = cgroup.procs();
+	}
+	return true;
+}
+
 /**
  * This method should be called anytime Executor is finished executing, regardless of success.
- * It will clean up children processes and open file descriptors.
+ * It will clean up children processes and open file descriptors, and remove the job's cgroup leaf.
+ * With pipestat, the relay is stopped after the waits, and what went through each pipe printed.
+ * The pipeline's wall time goes to the Runtime's metrics, and its results to the --json-results line.
  */
 void Executor::finish() {
 	// if not all commands executed, we want to only wait on the commands that did
 	if (cvItr != cvEnd)
 		cvEnd = cvItr;
+	// a job with a timeout is watched until it exits or is killed, and a timed one to see when each stage exits;
+	// the waits below then reap it
+	if (jobPgid>0 || timing) {
+		watch();
+		jobPgid = 0;
+	}
+	if (timer>=0) {
+		close(timer);
+		timer = -1;
+	}
 	// restart iterator
 	cvItr = (*input).cmdV.begin();
 	// wait on all children
@@ -172,5 +343,246 @@ void Executor::finish() {
 		(*cvItr).wait();
 		++cvItr;
 	}
+	uint64_t wall = began!=0 ? Trace::now()-began : 0;
+	// the status of a pipeline is the status of its last command
+	if (cvEnd == (*input).cmdV.end() && cvEnd != (*input).cmdV.begin())
+		exitStatus = (*input).cmdV.back().status();
+	else exitStatus = 1;
+	// as timeout(1) does
+	if (timedOut)
+		exitStatus = 124;
+	Runtime* runtime = Runtime::getRuntime();
+	Metrics* metrics = (*runtime).getMetrics();
+	if (began!=0) {
+		(*metrics).record(HIST_PIPELINE,wall);
+		(*metrics).add(COUNTER_PIPELINES,1);
+		(*runtime).getResults()->record(*shown,input,cvEnd-(*input).cmdV.begin(),exitStatus,timedOut,false,wall/1e9);
+		began = 0;
+	}
+	if (timing) {
+		printTimes();
+		timing = false;
+	}
+	// every stage exited, so the relay has nothing left to move
+	if (relay.stop())
+		relay.print();
+	cgroup.release();
+	(*metrics).exportNow(false);
+}
+
+/**
+ * Waits for the started Commands of a job with a timeout or the time prefix, without reaping them.
+ * The timerfd execNext made, armed for the deadline, is polled together with a pidfd per Command, so nothing is woken
+ * until a Command exits or the deadline passes. The job's process group then gets SIGTERM, and SIGKILL
+ * once the grace period passed too. Commands without a pidfd are checked on a short tick instead.
+ * Each Command's exit is recorded as it happens, for the time table.
+ */
+void Executor::watch() {
+	struct itimerspec when = { { 0, 0 }, deadline };
+	if (jobPgid>0)
+		timerfd_settime(timer,TFD_TIMER_ABSTIME,&when,NULL);
+	// a negative fd is skipped by poll
+	vector<struct pollfd> fds;
+	struct pollfd tp = { jobPgid>0 ? timer : -1, POLLIN, 0 };
+	fds.push_back(tp);
+	vector<Command*> polled, ticked;
+	for (vector<Command>::iterator c=(*input).cmdV.begin();c!=cvEnd;++c) {
+		struct pollfd p = { (*c).openPidFd(), POLLIN, 0 };
+		if (p.fd>=0) {
+			fds.push_back(p);
+			polled.push_back(&(*c));
+		}
+		else if (errno!=ESRCH && (*c).running())
+			ticked.push_back(&(*c));
+		else (*c).markExited();
+	}
+	size_t waiting = fds.size()-1;
+	int signals = 0;
+	while ((waiting>0 || ticked.size()>0) && signals<2) {
+		int n = poll(&fds[0],fds.size(),ticked.size()>0 ? 20 : -1);
+		if (n<0 && errno!=EINTR)
+			break;
+		for (size_t i=1;n>0 && i<fds.size();i++) {
+			if (fds[i].fd>=0 && fds[i].revents!=0) {
+				(*polled[i-1]).markExited();
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				waiting--;
+			}
+		}
+		for (size_t i=0;i<ticked.size();) {
+			if (!(*ticked[i]).running()) {
+				(*ticked[i]).markExited();
+				ticked.erase(ticked.begin()+i);
+			}
+			else i++;
+		}
+		if (n<=0 || !(fds[0].revents & POLLIN))
+			continue;
+		uint64_t expirations;
+		if (read(timer,&expirations,sizeof(expirations))<0) {}
+		if (signals==0) {
+			cout << "Timed out after " << timeout << "s: cmd " << (*input).cmdV[0].cmd << endl;
+			flushOutput();
+			timedOut = true;
+			killpg(jobPgid,SIGTERM);
+			clock_gettime(CLOCK_MONOTONIC,&when.it_value);
+			addSeconds(&when.it_value,grace);
+			timerfd_settime(timer,TFD_TIMER_ABSTIME,&when,NULL);
+		}
+		else killpg(jobPgid,SIGKILL);
+		signals++;
+	}
+	for (size_t i=1;i<fds.size();i++)
+		if (fds[i].fd>=0)
+			close(fds[i].fd);
+}
+
+/**
+ * Prints what each stage of a job with the time prefix cost, and the job's totals, as a table.
+ * launch is the time from fork to exec, run from exec to exit; the other columns are the stage's rusage,
+ * which includes the children it waited for.
+ */
+void Executor::printTimes() {
+	char line[256];
+	snprintf(line,sizeof(line),"%-5s %-12s %6s %9s %9s %9s %9s %9s %7s %8s %7s %7s","stage","cmd","status",
+			"launch","run","user","sys","maxrss","majflt","minflt","vcsw","ivcsw");
+	cout << line << endl;
+	struct timespec first = (*input).cmdV[0].times.forked;
+	struct timespec last = first;
+	double user = 0, sys = 0;
+	int stage = 0;
+	for (vector<Command>::iterator c=(*input).cmdV.begin();c!=cvEnd;++c) {
+		const StageTimes& t = (*c).times;
+		stage++;
+		if (elapsed(last,t.exited)>0)
+			last = t.exited;
+		double u = timevalSeconds(t.usage.ru_utime), s = timevalSeconds(t.usage.ru_stime);
+		user += u;
+		sys += s;
+		char rss[32];
+		snprintf(rss,sizeof(rss),"%.1fMB",t.usage.ru_maxrss/1024.0);
+		snprintf(line,sizeof(line),"%-5d %-12.12s %6d %9s %9s %9s %9s %9s %7ld %8ld %7ld %7ld",stage,(*c).cmd.c_str(),
+				(*c).status(),formatSeconds(elapsed(t.forked,t.execed)).c_str(),formatSeconds(elapsed(t.execed,t.exited)).c_str(),
+				formatSeconds(u).c_str(),formatSeconds(s).c_str(),rss,t.usage.ru_majflt,t.usage.ru_minflt,
+				t.usage.ru_nvcsw,t.usage.ru_nivcsw);
+		cout << line << endl;
+	}
+	snprintf(line,sizeof(line),"%-5s %-12s %6d %9s %9s %9s %9s","total","",exitStatus,"",
+			formatSeconds(elapsed(first,last)).c_str(),formatSeconds(user).c_str(),formatSeconds(sys).c_str());
+	cout << line << endl;
+}
+
+/**
+ * Makes the --json-results line of this job show the argv and files of another CommandList.
+ * The cache prefix runs a copy of the line with its output going to the store, which is reported as the line itself.
+ *
+ * @param plan -- the line to show; it must outlive the Executor, and have the same Commands
+ */
+void Executor::reportAs(CommandList* plan) {
+	shown = plan;
+}
+
+/**
+ * Executes every queued Command, then finishes.
+ * If a Command can not be executed, its error is printed and the rest are not executed.
+ * A CommandList with the cache prefix is handed to the Runtime's OutputCache instead,
+ * and one with the bench prefix is run as many times as it asks for.
+ *
+ * @return exit status of the last Command, or 1 if not every Command could be executed.
+ */
+int Executor::run() {
+	if ((*input).benchRuns>0) {
+		exitStatus = bench();
+		return exitStatus;
+	}
+	// a line with the cache prefix may be replayed from the output store instead of running
+	if ((*input).memoize) {
+		exitStatus = Runtime::getRuntime()->getOutputCache()->run(input);
+		return exitStatus;
+	}
+	while (hasNext()) {
+		if (!execNext()) {
+			cout << ERROR_MSG << endl;
+			break;
+		}
+	}
+	finish();
+	return exitStatus;
+}
 
+/**
+ * Runs a job with the bench prefix its warmup runs, then the runs it asked for, and prints the min, median,
+ * p95, mean and standard deviation of their wall times, and the mean CPU time of each stage.
+ * The line was parsed once; every run executes a fresh copy of it, as Commands keep the pids and fds of their run.
+ * Unless -k was given, the output of the last stage goes to /dev/null. A run stopped by SIGINT ends the benchmark.
+ *
+ * @return exit status of the last run
+ */
+int Executor::bench() {
+	CommandList plan = *input;
+	plan.benchRuns = 0;
+	if (!(*input).benchKeep) {
+		plan.outputFile = "/dev/null";
+		plan.cmdV.back().outputType = FILEIO;
+	}
+	size_t stages = plan.cmdV.size();
+	vector<double> walls, user(stages,0), sys(stages,0);
+	int status = 0, failed = 0;
+	for (int run=0;run<(*input).benchWarmup+(*input).benchRuns;run++) {
+		CommandList copy = plan;
+		uint64_t start = Trace::now();
+		{
+			Executor executor(&copy);
+			executor.reportAs(input);
+			status = executor.run();
+		}
+		uint64_t end = Trace::now();
+		if (copy.cmdV.back().signal()==SIGINT)
+			break;
+		if (run<(*input).benchWarmup)
+			continue;
+		walls.push_back((end-start)/1e9);
+		if (status!=0)
+			failed++;
+		for (size_t i=0;i<stages;i++) {
+			user[i] += timevalSeconds(copy.cmdV[i].times.usage.ru_utime);
+			sys[i] += timevalSeconds(copy.cmdV[i].times.usage.ru_stime);
+		}
+	}
+	if (walls.size()==0)
+		return status;
+	size_t n = walls.size();
+	double mean = 0, variance = 0;
+	for (size_t i=0;i<n;i++)
+		mean += walls[i];
+	mean /= n;
+	for (size_t i=0;i<n;i++)
+		variance += (walls[i]-mean)*(walls[i]-mean);
+	// sample standard deviation; a single run has none
+	double stddev = n>1 ? sqrt(variance/(n-1)) : 0;
+	std::sort(walls.begin(),walls.end());
+	// nearest rank
+	size_t p95 = (size_t)ceil(n*0.95);
+	char line[256];
+	snprintf(line,sizeof(line),"bench: %zu run%s after %d warmup%s",n,n==1 ? "" : "s",(*input).benchWarmup,
+			(*input).benchWarmup==1 ? "" : "s");
+	cout << line;
+	if (failed>0)
+		cout << ", " << failed << " failed";
+	cout << endl;
+	snprintf(line,sizeof(line),"%-12s %9s %9s %9s %9s %9s","","min","median","p95","mean","stddev");
+	cout << line << endl;
+	snprintf(line,sizeof(line),"%-12s %9s %9s %9s %9s %9s","wall",formatSeconds(walls[0]).c_str(),
+			formatSeconds(n%2==1 ? walls[n/2] : (walls[n/2-1]+walls[n/2])/2).c_str(),
+			formatSeconds(walls[p95-1]).c_str(),formatSeconds(mean).c_str(),formatSeconds(stddev).c_str());
+	cout << line << endl;
+	snprintf(line,sizeof(line),"%-5s %-12s %9s %9s","stage","cmd","user","sys");
+	cout << line << endl;
+	for (size_t i=0;i<stages;i++) {
+		snprintf(line,sizeof(line),"%-5zu %-12.12s %9s %9s",i+1,plan.cmdV[i].cmd.c_str(),formatSeconds(user[i]/n).c_str(),
+				formatSeconds(sys[i]/n).c_str());
+		cout << line << endl;
+	}
+	return status;
 }
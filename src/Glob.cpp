@@ -0,0 +1,526 @@
+#include "OopShell.h"
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>     // for parallel ** walks
+#include <dirent.h>      // for DT_* constants
+#include <sys/stat.h>
+#include <sys/syscall.h> // for SYS_getdents64
+
+using std::string;
+using std::vector;
+
+/**
+ * Size of the buffer handed to getdents64.
+ * A large buffer lets a directory of 100k entries be read in a handful of system calls.
+ */
+static const size_t DIR_BUF_SIZE = 256*1024;
+
+/**
+ * Upper bound on the number of threads used to walk a ** component.
+ */
+static const long MAX_WALK_THREADS = 8;
+
+/**
+ * Record layout returned by getdents64; glibc does not export it.
+ */
+struct LinuxDirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/**
+ * Convenience wrapper around an open directory and its getdents64 buffer.
+ * The caller owns the buffer, so nested or per-thread scans never share one.
+ */
+class DirScanner {
+public:
+	DirScanner(char* buffer) : buf(buffer), fd(-1), pos(0), len(0) {}
+	~DirScanner() { if (fd>=0) close(fd); }
+	bool open(const string& dir);
+	bool next(LinuxDirent64** ent);
+	bool isDir(LinuxDirent64* ent, bool follow);
+private:
+	char* buf;
+	int fd;
+	long pos, len;
+};
+
+/**
+ * Opens a directory for scanning. An empty name is the current working directory.
+ *
+ * @param dir -- directory to open
+ * @return true if the directory could be opened
+ */
+bool DirScanner::open(const string& dir) {
+	fd = ::open(dir.size()==0 ? "." : dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	return fd>=0;
+}
+
+/**
+ * Returns the next entry of the directory, skipping "." and "..".
+ *
+ * @param ent -- set to the next entry; valid until the next call
+ * @return false when the directory is exhausted or cannot be read
+ */
+bool DirScanner::next(LinuxDirent64** ent) {
+	while (true) {
+		if (pos >= len) {
+			len = syscall(SYS_getdents64, fd, buf, DIR_BUF_SIZE);
+			pos = 0;
+			if (len <= 0) return false;
+		}
+		LinuxDirent64* d = (LinuxDirent64*)(buf+pos);
+		pos += d->d_reclen;
+		const char* n = d->d_name;
+		if (n[0]=='.' && (n[1]=='\0' || (n[1]=='.' && n[2]=='\0')))
+			continue;
+		*ent = d;
+		return true;
+	}
+}
+
+/**
+ * Determines if an entry is a directory.
+ * d_type answers this for most file systems; stat is only used for symlinks and DT_UNKNOWN.
+ *
+ * @param ent -- entry returned by next
+ * @param follow -- true if a symlink to a directory counts as a directory
+ * @return true if the entry is a directory
+ */
+bool DirScanner::isDir(LinuxDirent64* ent, bool follow) {
+	if (ent->d_type == DT_DIR) return true;
+	if (ent->d_type == DT_UNKNOWN || (follow && ent->d_type == DT_LNK)) {
+		struct stat st;
+		if (fstatat(fd, ent->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+			return false;
+		return S_ISDIR(st.st_mode);
+	}
+	return false;
+}
+
+/**
+ * Joins a directory and a file name.
+ *
+ * @param base -- directory; empty for the current working directory
+ * @param name -- file name
+ * @return the joined path
+ */
+static string joinPath(const string& base, const char* name, size_t len) {
+	string path;
+	path.reserve(base.size()+len+1);
+	path.append(base);
+	if (base.size()>0 && base[base.size()-1]!='/')
+		path.append(1,'/');
+	path.append(name,len);
+	return path;
+}
+
+/**
+ * Compiles a single path component pattern.
+ *
+ * @param pattern -- pattern text, without '/'
+ */
+GlobPattern::GlobPattern(string pattern) {
+	dotOk = pattern.size()>0 && pattern[0]=='.';
+	size_t i=0;
+	while (i<pattern.size()) {
+		char c = pattern[i];
+		GlobAtom atom;
+		// * (consecutive stars are one star)
+		if (c=='*') {
+			if (atoms.size()==0 || atoms.back().type!=GlobAtom::STAR) {
+				atom.type = GlobAtom::STAR;
+				atoms.push_back(atom);
+			}
+			i++;
+			continue;
+		}
+		// ?
+		if (c=='?') {
+			atom.type = GlobAtom::ANY;
+			atoms.push_back(atom);
+			i++;
+			continue;
+		}
+		// [...] ; an unterminated [ is a literal character
+		if (c=='[') {
+			size_t j = i+1;
+			bool negate = false;
+			if (j<pattern.size() && (pattern[j]=='!' || pattern[j]=='^')) {
+				negate = true;
+				j++;
+			}
+			memset(atom.set,0,sizeof(atom.set));
+			size_t first = j;
+			while (j<pattern.size() && (pattern[j]!=']' || j==first)) {
+				unsigned char lo = pattern[j], hi = lo;
+				if (j+2<pattern.size() && pattern[j+1]=='-' && pattern[j+2]!=']') {
+					hi = pattern[j+2];
+					j += 2;
+				}
+				for (unsigned int k=lo;k<=hi;k++)
+					atom.set[k>>3] |= (1<<(k&7));
+				j++;
+			}
+			if (j<pattern.size()) {
+				if (negate)
+					for (int k=0;k<32;k++) atom.set[k] = ~atom.set[k];
+				atom.type = GlobAtom::CLASS;
+				atoms.push_back(atom);
+				i = j+1;
+				continue;
+			}
+		}
+		// plain character: extend the current literal run
+		if (atoms.size()==0 || atoms.back().type!=GlobAtom::LITERAL) {
+			atom.type = GlobAtom::LITERAL;
+			atoms.push_back(atom);
+		}
+		atoms.back().text.append(1,c);
+		i++;
+	}
+	// pick the fastest matching strategy for the compiled shape
+	if (pattern.compare("**")==0)
+		kind = MATCH_RECURSIVE;
+	else if (atoms.size()==0) {
+		kind = MATCH_LITERAL;
+	}
+	else if (atoms.size()==1 && atoms[0].type==GlobAtom::STAR)
+		kind = MATCH_ALL;
+	else if (atoms.size()==1 && atoms[0].type==GlobAtom::LITERAL) {
+		kind = MATCH_LITERAL;
+		literal = atoms[0].text;
+	}
+	else if (atoms.size()==2 && atoms[0].type==GlobAtom::STAR && atoms[1].type==GlobAtom::LITERAL) {
+		kind = MATCH_SUFFIX;
+		literal = atoms[1].text;
+	}
+	else kind = MATCH_GENERAL;
+}
+
+/**
+ * Matches a file name against the pattern.
+ * As in sh, names starting with '.' only match patterns that start with '.'.
+ *
+ * @param name -- file name
+ * @param len -- length of name
+ * @return true if name matches
+ */
+bool GlobPattern::match(const char* name, size_t len) const {
+	if (len>0 && name[0]=='.' && !dotOk) return false;
+	switch (kind) {
+		case MATCH_ALL:
+			return true;
+		case MATCH_LITERAL:
+			return len==literal.size() && memcmp(name,literal.data(),len)==0;
+		case MATCH_SUFFIX:
+			return len>=literal.size() && memcmp(name+len-literal.size(),literal.data(),literal.size())==0;
+		case MATCH_RECURSIVE:
+			return true;
+		default:
+			return matchAtoms(name,len);
+	}
+}
+
+/**
+ * General matcher; backtracks only to the most recent star, so it never recurses.
+ */
+bool GlobPattern::matchAtoms(const char* name, size_t len) const {
+	size_t a = 0, s = 0;
+	size_t starA = string::npos, starS = 0;
+	size_t n = atoms.size();
+	while (s<len || a<n) {
+		if (a<n) {
+			const GlobAtom& at = atoms[a];
+			if (at.type==GlobAtom::STAR) {
+				starA = a++;
+				starS = s;
+				continue;
+			}
+			if (s<len) {
+				unsigned char c = name[s];
+				if (at.type==GlobAtom::LITERAL) {
+					size_t tl = at.text.size();
+					if (len-s>=tl && memcmp(name+s,at.text.data(),tl)==0) {
+						s += tl;
+						a++;
+						continue;
+					}
+				}
+				else if (at.type==GlobAtom::ANY || (at.set[c>>3] & (1<<(c&7)))) {
+					s++;
+					a++;
+					continue;
+				}
+			}
+		}
+		// mismatch: let the last star swallow one more character
+		if (starA!=string::npos && starS<len) {
+			a = starA+1;
+			s = ++starS;
+			continue;
+		}
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @return true if the pattern has no magic characters
+ */
+bool GlobPattern::isLiteral() const {
+	return kind==MATCH_LITERAL;
+}
+
+/**
+ * @return true if the pattern is "**"
+ */
+bool GlobPattern::isRecursive() const {
+	return kind==MATCH_RECURSIVE;
+}
+
+/**
+ * @return the literal text of a literal pattern
+ */
+const string& GlobPattern::getLiteral() const {
+	return literal;
+}
+
+/**
+ * Compiles a pathname pattern into one GlobPattern per path component.
+ *
+ * @param pattern -- the word to expand
+ */
+Glob::Glob(string pattern) {
+	absolute = pattern.size()>0 && pattern[0]=='/';
+	dirOnly = pattern.size()>1 && pattern[pattern.size()-1]=='/';
+	vector<string> v;
+	tokenize(&pattern,"/",&v);
+	for (size_t i=0;i<v.size();i++) {
+		// a/**/**/b is the same as a/**/b
+		if (v[i].compare("**")==0 && parts.size()>0 && parts.back().isRecursive())
+			continue;
+		parts.push_back(GlobPattern(v[i]));
+	}
+}
+
+/**
+ * Determines if a word needs pathname expansion.
+ *
+ * @param word -- word to check
+ * @return true if word contains *, ? or [
+ */
+bool Glob::hasMagic(string* word) {
+	return (*word).find_first_of("*?[") != string::npos;
+}
+
+/**
+ * Expands the pattern and appends the matches, in byte order, to results.
+ * Nothing is appended if the pattern matches nothing; the caller keeps the word as typed.
+ *
+ * @param results -- vector receiving the matched paths
+ * @return true if at least one path matched
+ */
+bool Glob::expand(vector<string>* results) {
+	if (parts.size()==0) return false;
+	vector<string> matches;
+	expandFrom(0, absolute ? "/" : "", &matches);
+	if (matches.size()==0) return false;
+	sortStrings(&matches);
+	(*results).reserve((*results).size()+matches.size());
+	for (size_t i=0;i<matches.size();i++) {
+		(*results).push_back(string());
+		(*results).back().swap(matches[i]);
+	}
+	return true;
+}
+
+/**
+ * Matches parts[idx..] below directory base, appending full paths to out.
+ *
+ * @param idx -- index of the first component still to match
+ * @param base -- directory the component is matched in; empty for the cwd
+ * @param out -- vector receiving matched paths
+ */
+void Glob::expandFrom(size_t idx, string base, vector<string>* out) {
+	bool last = (idx == parts.size()-1);
+	const GlobPattern* p = &parts[idx];
+	struct stat st;
+	// literal component: no directory read, only an existence check at the end
+	if ((*p).isLiteral()) {
+		const string& lit = (*p).getLiteral();
+		string path = joinPath(base, lit.data(), lit.size());
+		if (!last)
+			expandFrom(idx+1, path, out);
+		else if (dirOnly ? stat(path.c_str(),&st)==0 && S_ISDIR(st.st_mode) : lstat(path.c_str(),&st)==0)
+			(*out).push_back(dirOnly ? path+"/" : path);
+		return;
+	}
+	// ** component
+	if ((*p).isRecursive()) {
+		// "dir/**": everything below dir
+		if (last && !dirOnly) {
+			GlobPattern all("*");
+			walk(base, &all, out);
+			return;
+		}
+		// "dir/**/pattern": match names during the walk itself
+		if (idx+1 == parts.size()-1 && !dirOnly && !parts[idx+1].isRecursive()) {
+			walk(base, &parts[idx+1], out);
+			return;
+		}
+		// otherwise match the remaining components below every directory
+		vector<string> dirs;
+		walk(base, NULL, &dirs);
+		if (last) {
+			for (size_t i=0;i<dirs.size();i++)
+				(*out).push_back(dirs[i]+"/");
+			return;
+		}
+		expandFrom(idx+1, base, out);
+		for (size_t i=0;i<dirs.size();i++)
+			expandFrom(idx+1, dirs[i], out);
+		return;
+	}
+	// pattern component: read the directory once and match each name
+	if (dirBuf.size()==0)
+		dirBuf.resize(DIR_BUF_SIZE);
+	DirScanner ds(&dirBuf[0]);
+	if (!ds.open(base)) return;
+	vector<string> next;
+	LinuxDirent64* ent;
+	while (ds.next(&ent)) {
+		size_t len = strlen(ent->d_name);
+		if (!(*p).match(ent->d_name, len))
+			continue;
+		// d_type is enough for the last component; directories are only needed to descend
+		if (last && !dirOnly)
+			(*out).push_back(joinPath(base, ent->d_name, len));
+		else if (ds.isDir(ent, true))
+			next.push_back(joinPath(base, ent->d_name, len));
+	}
+	for (size_t i=0;i<next.size();i++) {
+		if (last)
+			(*out).push_back(next[i]+"/");
+		else
+			expandFrom(idx+1, next[i], out);
+	}
+}
+
+/**
+ * Shared state of a parallel ** walk.
+ *
+ * Members:
+ *	 queue -- directories waiting to be read
+ *	 busy -- number of workers currently reading a directory
+ *	 leaf -- pattern to match entries against; NULL to collect directories instead
+ *	 results -- matched paths from all workers
+ */
+struct WalkState {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	vector<string> queue;
+	int busy;
+	const GlobPattern* leaf;
+	vector<string> results;
+};
+
+/**
+ * Reads one directory of a walk. Hidden directories and symlinks are not descended into.
+ */
+static void walkOne(WalkState* ws, const string& dir, char* buf, vector<string>* subdirs, vector<string>* found) {
+	DirScanner ds(buf);
+	if (!ds.open(dir)) return;
+	LinuxDirent64* ent;
+	while (ds.next(&ent)) {
+		size_t len = strlen(ent->d_name);
+		bool hidden = ent->d_name[0]=='.';
+		bool isDir = !hidden && ds.isDir(ent, false);
+		if (isDir)
+			(*subdirs).push_back(joinPath(dir, ent->d_name, len));
+		if (ws->leaf != NULL) {
+			if (ws->leaf->match(ent->d_name, len))
+				(*found).push_back(isDir ? (*subdirs).back() : joinPath(dir, ent->d_name, len));
+		}
+		else if (isDir)
+			(*found).push_back((*subdirs).back());
+	}
+}
+
+/**
+ * Worker loop of a walk: takes directories from the queue until the queue is empty and nobody is busy.
+ */
+static void* walkWorker(void* arg) {
+	WalkState* ws = (WalkState*)arg;
+	vector<char> buf(DIR_BUF_SIZE);
+	vector<string> subdirs, found;
+	pthread_mutex_lock(&ws->lock);
+	while (true) {
+		while (ws->queue.empty() && ws->busy>0)
+			pthread_cond_wait(&ws->cond, &ws->lock);
+		if (ws->queue.empty()) break;
+		string dir;
+		dir.swap(ws->queue.back());
+		ws->queue.pop_back();
+		ws->busy++;
+		pthread_mutex_unlock(&ws->lock);
+		subdirs.clear();
+		walkOne(ws, dir, &buf[0], &subdirs, &found);
+		pthread_mutex_lock(&ws->lock);
+		for (size_t i=0;i<subdirs.size();i++) {
+			ws->queue.push_back(string());
+			ws->queue.back().swap(subdirs[i]);
+		}
+		ws->busy--;
+		pthread_cond_broadcast(&ws->cond);
+	}
+	for (size_t i=0;i<found.size();i++) {
+		ws->results.push_back(string());
+		ws->results.back().swap(found[i]);
+	}
+	pthread_cond_broadcast(&ws->cond);
+	pthread_mutex_unlock(&ws->lock);
+	return NULL;
+}
+
+/**
+ * Walks every directory below base, using one worker per online CPU (bounded by MAX_WALK_THREADS).
+ *
+ * @param base -- directory to start from; empty for the cwd
+ * @param leaf -- if not NULL, entries matching leaf are collected; otherwise directories are collected
+ * @param out -- vector receiving collected paths (unsorted)
+ */
+void Glob::walk(string base, const GlobPattern* leaf, vector<string>* out) {
+	WalkState ws;
+	pthread_mutex_init(&ws.lock, NULL);
+	pthread_cond_init(&ws.cond, NULL);
+	ws.busy = 0;
+	ws.leaf = leaf;
+	ws.queue.push_back(base);
+	long nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nThreads > MAX_WALK_THREADS) nThreads = MAX_WALK_THREADS;
+	vector<pthread_t> threads;
+	for (long i=1;i<nThreads;i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, walkWorker, &ws)==0)
+			threads.push_back(t);
+	}
+	// this thread works too, so a failed pthread_create only costs parallelism
+	walkWorker(&ws);
+	for (size_t i=0;i<threads.size();i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&ws.cond);
+	pthread_mutex_destroy(&ws.lock);
+	(*out).reserve((*out).size()+ws.results.size());
+	for (size_t i=0;i<ws.results.size();i++) {
+		(*out).push_back(string());
+		(*out).back().swap(ws.results[i]);
+	}
+}
@@ -0,0 +1,489 @@
+#include "OopShell.h"
+
+#include <iostream> // for cout, endl
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <math.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h> // for setrlimit
+#include <sys/stat.h>
+#include <sys/sysmacros.h> // for major, minor
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// cpu.max period, in microseconds
+static const long long CPU_PERIOD = 100000;
+
+// the shell's oopshell.<pid> cgroup, once session has set it up
+static string sessionDir;
+static bool sessionTried = false;
+// the shell's own cgroup, and the controllers session enabled in it, which cleanup turns off again
+static string parentDir;
+static string parentEnabled;
+
+/**
+ * Reads the first line of a file, e.g. a cgroup or sysfs attribute.
+ *
+ * @return the line, or an empty string if the file could not be read
+ */
+static string readLine(const string& path) {
+	std::ifstream in(path.c_str());
+	string line;
+	std::getline(in,line);
+	return line;
+}
+
+/**
+ * Writes a value to a cgroup attribute in one write, as the kernel expects.
+ */
+static bool writeFile(const string& path, const string& value) {
+	int fd = open(path.c_str(),O_WRONLY|O_CLOEXEC);
+	if (fd<0)
+		return false;
+	bool ok = write(fd,value.data(),value.size())==(ssize_t)value.size();
+	close(fd);
+	return ok;
+}
+
+/**
+ * @return true if word is one of the space separated words of list
+ */
+static bool hasWord(const string& list, const string& word) {
+	std::istringstream words(list);
+	string w;
+	while (words >> w)
+		if (w==word)
+			return true;
+	return false;
+}
+
+/**
+ * @return the parent pid of a process, from /proc/<pid>/stat; 0 if it is gone
+ */
+static pid_t parentOf(pid_t pid) {
+	std::ifstream in(("/proc/"+std::to_string(pid)+"/stat").c_str());
+	string line;
+	std::getline(in,line);
+	// the command name before it is in parentheses and may hold spaces
+	size_t end = line.rfind(')');
+	if (end==string::npos)
+		return 0;
+	std::istringstream fields(line.substr(end+1));
+	string state;
+	pid_t ppid = 0;
+	fields >> state >> ppid;
+	return ppid;
+}
+
+/**
+ * Moves processes from one cgroup to another, the shell first.
+ *
+ * @param from -- directory of the cgroup they are in
+ * @param to -- directory of the cgroup they go to
+ * @param ownOnly -- only move the shell and its children, e.g. the Spawner's helper and background jobs
+ */
+static void moveProcesses(const string& from, const string& to, bool ownOnly) {
+	pid_t self = getpid();
+	writeFile(to+"/cgroup.procs",std::to_string(self));
+	std::ifstream in((from+"/cgroup.procs").c_str());
+	pid_t pid;
+	while (in >> pid)
+		if (pid!=self && (!ownOnly || parentOf(pid)==self))
+			writeFile(to+"/cgroup.procs",std::to_string(pid));
+}
+
+/**
+ * Reads the number of processes of a cgroup killed for going over memory.max, from its memory.events.
+ */
+static long oomKillCount(const string& dir) {
+	std::ifstream in((dir+"/memory.events").c_str());
+	string name;
+	long count;
+	while (in >> name >> count)
+		if (name=="oom_kill")
+			return count;
+	return 0;
+}
+
+/**
+ * Finds the disk a directory is on, as the MAJ:MIN io.max takes. io.max only takes whole disks,
+ * so for a partition it is the disk holding the partition.
+ *
+ * @return false if the directory is not on a block device, e.g. on tmpfs or overlayfs
+ */
+static bool diskOf(const string& dir, string* dev) {
+	struct stat st;
+	if (stat(dir.c_str(),&st)!=0 || major(st.st_dev)==0)
+		return false;
+	string sys = "/sys/dev/block/"+std::to_string(major(st.st_dev))+":"+std::to_string(minor(st.st_dev));
+	if (access((sys+"/partition").c_str(),F_OK)==0)
+		*dev = readLine(sys+"/../dev");
+	else *dev = readLine(sys+"/dev");
+	return (*dev).size()>0;
+}
+
+/**
+ * Lowers a resource limit of the calling process to value, keeping the hard limit a little above the soft one.
+ * Neither goes above the current hard limit, which only root may raise.
+ */
+static bool lowerLimit(int resource, rlim_t value, rlim_t slack) {
+	struct rlimit rl;
+	if (getrlimit(resource,&rl)!=0)
+		return false;
+	rlim_t hard = value+slack;
+	if (rl.rlim_max!=RLIM_INFINITY && hard>rl.rlim_max)
+		hard = rl.rlim_max;
+	rl.rlim_cur = value<hard ? value : hard;
+	rl.rlim_max = hard;
+	return setrlimit(resource,&rl)==0;
+}
+
+/**
+ * Constructor for Limits. No limit is given.
+ */
+Limits::Limits() {
+	memory = -1;
+	cpuTime = -1;
+	files = -1;
+	cpus = -1;
+	io = -1;
+	memoryRlimit = false;
+}
+
+/**
+ * @return true if word is one of the options of limit
+ */
+bool Limits::isOption(const string& word) {
+	return word=="-m" || word=="-t" || word=="-n" || word=="-c" || word=="-i";
+}
+
+/**
+ * Applies one option of limit:
+ * -m megabytes, -t cpu seconds, -n open files, -c cpus (may be fractional, e.g. 0.5), -i megabytes per second.
+ * A value of 0 removes the limit.
+ *
+ * @param option -- the option
+ * @param value -- its value
+ * @param error -- receives the error if the option or its value is not valid
+ * @return true if the option was valid
+ */
+bool Limits::parse(const string& option, const string& value, string* error) {
+	if (!isOption(option)) {
+		*error = "Unknown option "+option+". See help limit for usage.";
+		return false;
+	}
+	char* rest;
+	double v = strtod(value.c_str(),&rest);
+	// only -c takes fractions
+	bool whole = option=="-c" || v==floor(v);
+	if (value.size()==0 || *rest!='\0' || v<0 || v>1e12 || !whole) {
+		*error = "Invalid value "+value+" for limit "+option+". See help limit for usage.";
+		return false;
+	}
+	long long n = (long long)v;
+	if (option=="-m")
+		memory = n<<20;
+	else if (option=="-t")
+		cpuTime = n;
+	else if (option=="-n")
+		files = n;
+	else if (option=="-c") {
+		cpus = llround(v*1000);
+		// cpu.max can not go below a thousandth of a CPU
+		if (v>0 && cpus==0)
+			cpus = 1;
+	}
+	else io = n<<20;
+	return true;
+}
+
+/**
+ * Takes every limit that was not given from defaults, e.g. the session's limits for a limit prefix.
+ *
+ * @param defaults -- limits to fall back to
+ */
+void Limits::inherit(const Limits& defaults) {
+	if (memory<0) memory = defaults.memory;
+	if (cpuTime<0) cpuTime = defaults.cpuTime;
+	if (files<0) files = defaults.files;
+	if (cpus<0) cpus = defaults.cpus;
+	if (io<0) io = defaults.io;
+}
+
+/**
+ * @return true if any limit is in force
+ */
+bool Limits::isSet() const {
+	return memory>0 || cpuTime>0 || files>0 || cpus>0 || io>0;
+}
+
+/**
+ * @return true if a limit is one a cgroup enforces: memory, CPU bandwidth or I/O bandwidth
+ */
+bool Limits::needsCgroup() const {
+	return memory>0 || cpus>0 || io>0;
+}
+
+/**
+ * Sets the rlimits of the calling process. This runs in the child, just before exec.
+ * Going over the CPU time gives SIGXCPU, and SIGKILL a second later.
+ *
+ * @param failed -- receives the options that could not be applied
+ * @return true if everything was applied
+ */
+bool Limits::apply(string* failed) const {
+	if (cpuTime>0 && !lowerLimit(RLIMIT_CPU,cpuTime,1))
+		(*failed).append(" -t");
+	if (files>0 && !lowerLimit(RLIMIT_NOFILE,files,0))
+		(*failed).append(" -n");
+	if (memoryRlimit && memory>0 && !lowerLimit(RLIMIT_AS,memory,0))
+		(*failed).append(" -m");
+	return (*failed).size()==0;
+}
+
+/**
+ * Prints each limit, and how memory is enforced, to stdout.
+ */
+void Limits::print() const {
+	cout << "memory: ";
+	if (memory>0)
+		cout << (memory>>20) << "MB" << (hasWord(JobCgroup::controllers(),"memory") ? " per job" : " per process (RLIMIT_AS)");
+	else cout << "none";
+	cout << endl << "cputime: ";
+	if (cpuTime>0) cout << cpuTime << "s per process";
+	else cout << "none";
+	cout << endl << "files: ";
+	if (files>0) cout << files << " per process";
+	else cout << "none";
+	cout << endl << "cpus: ";
+	if (cpus>0) cout << cpus/1000.0 << " per job";
+	else cout << "none";
+	cout << endl << "io: ";
+	if (io>0) cout << (io>>20) << "MB/s per job";
+	else cout << "none";
+	cout << endl;
+}
+
+/**
+ * Constructor for JobCgroup. The job has no leaf until create makes one.
+ */
+JobCgroup::JobCgroup() {
+	procsFd = -1;
+	oomKills = 0;
+}
+
+/**
+ * Destructor for JobCgroup. Removes the leaf.
+ */
+JobCgroup::~JobCgroup() {
+	release();
+}
+
+/**
+ * Sets up oopshell.<pid> under the shell's cgroup v2, the parent of every job leaf, on first use.
+ * The memory, cpu and io controllers are enabled for the shell's cgroup's children where that is allowed;
+ * it is not unless the cgroup was delegated to the user, or the shell is in the root cgroup of its namespace.
+ * A cgroup with processes in it can not enable controllers for its children, so the shell and its children
+ * first move into a leaf of their own, oopshell.<pid>/shell. Controllers that still can not be enabled are reported.
+ *
+ * @return the directory, or an empty string if there is no cgroup v2 or it is not writable
+ */
+const string& JobCgroup::session() {
+	if (sessionTried)
+		return sessionDir;
+	sessionTried = true;
+	// the mount point of the cgroup2 filesystem, which may sit beside v1 hierarchies
+	string mount, line;
+	std::ifstream mounts("/proc/self/mountinfo");
+	while (mount.size()==0 && std::getline(mounts,line)) {
+		size_t sep = line.find(" - ");
+		if (sep==string::npos || line.compare(sep+3,8,"cgroup2 ")!=0)
+			continue;
+		std::istringstream fields(line);
+		for (int i=0;i<5;i++)
+			fields >> mount;
+	}
+	string own;
+	std::ifstream groups("/proc/self/cgroup");
+	while (std::getline(groups,line))
+		if (line.compare(0,3,"0::")==0)
+			own = line.substr(3);
+	if (mount.size()==0 || own.size()==0)
+		return sessionDir;
+	string base = mount+(own=="/" ? "" : own);
+	string dir = base+"/oopshell."+std::to_string(getpid());
+	if (mkdir(dir.c_str(),0755)!=0 && errno!=EEXIST)
+		return sessionDir;
+	string enabled = readLine(base+"/cgroup.subtree_control");
+	string available = readLine(base+"/cgroup.controllers");
+	const char* wanted[] = { "memory", "cpu", "io" };
+	vector<string> missing;
+	for (size_t i=0;i<3;i++)
+		if (!hasWord(enabled,wanted[i]) && hasWord(available,wanted[i]))
+			missing.push_back(wanted[i]);
+	if (missing.size()>0) {
+		string leaf = dir+"/shell";
+		if (mkdir(leaf.c_str(),0755)==0 || errno==EEXIST)
+			moveProcesses(base,leaf,true);
+		string failed;
+		for (size_t i=0;i<missing.size();i++) {
+			if (writeFile(base+"/cgroup.subtree_control","+"+missing[i])) {
+				if (parentEnabled.size()>0) parentEnabled.push_back(' ');
+				parentEnabled.append(missing[i]);
+			}
+			else failed.append(" "+missing[i]);
+		}
+		if (failed.size()>0)
+			cout << "Could not enable the" << failed << " controller of cgroup " << base
+					<< "; limits that need it fall back to rlimits or are refused." << endl;
+	}
+	parentDir = base;
+	sessionDir = dir;
+	return sessionDir;
+}
+
+/**
+ * The controllers job leaves get, found once. oopshell.<pid> holds no processes, so it may always enable
+ * for its children whatever it was given itself.
+ *
+ * @return e.g. "memory cpu io"; empty if cgroupfs is not delegated
+ */
+const string& JobCgroup::controllers() {
+	static string list;
+	static bool found = false;
+	if (found)
+		return list;
+	found = true;
+	const string& dir = session();
+	if (dir.size()==0)
+		return list;
+	string available = readLine(dir+"/cgroup.controllers");
+	const char* wanted[] = { "memory", "cpu", "io" };
+	for (size_t i=0;i<3;i++) {
+		if (hasWord(available,wanted[i]) && writeFile(dir+"/cgroup.subtree_control",string("+")+wanted[i])) {
+			if (list.size()>0) list.push_back(' ');
+			list.append(wanted[i]);
+		}
+	}
+	return list;
+}
+
+/**
+ * Makes the leaf for a job whose limits need one, and writes its memory.max, cpu.max and io.max.
+ * Without the memory controller, memory is limited with RLIMIT_AS instead; CPU and I/O bandwidth have
+ * no rlimit, so without their controllers the job is refused rather than run unlimited.
+ *
+ * @param limits -- the job's limits; memoryRlimit is set if memory falls back to RLIMIT_AS
+ * @param error -- receives the error if the limits can not be enforced
+ * @return true if the job can run
+ */
+bool JobCgroup::create(Limits* limits, string* error) {
+	static unsigned long jobs = 0;
+	release();
+	if (!(*limits).needsCgroup())
+		return true;
+	const string& have = controllers();
+	(*limits).memoryRlimit = (*limits).memory>0 && !hasWord(have,"memory");
+	if ((*limits).cpus>0 && !hasWord(have,"cpu")) {
+		*error = "limit -c needs the cpu controller of a delegated cgroup v2. See help limit for usage.";
+		return false;
+	}
+	string disk;
+	if ((*limits).io>0 && !hasWord(have,"io")) {
+		*error = "limit -i needs the io controller of a delegated cgroup v2. See help limit for usage.";
+		return false;
+	}
+	if ((*limits).io>0 && !diskOf(Runtime::getRuntime()->getCwd(),&disk)) {
+		*error = "limit -i needs the directory to be on a disk.";
+		return false;
+	}
+	if ((*limits).memoryRlimit && (*limits).cpus<=0 && (*limits).io<=0)
+		return true;
+	string leaf = session()+"/job."+std::to_string(++jobs);
+	if (mkdir(leaf.c_str(),0755)!=0 && errno!=EEXIST) {
+		*error = "Could not create cgroup "+leaf;
+		return false;
+	}
+	bool ok = true;
+	if ((*limits).memory>0 && !(*limits).memoryRlimit) {
+		ok = writeFile(leaf+"/memory.max",std::to_string((*limits).memory));
+		// without this, a runaway job would fill swap before it is stopped
+		writeFile(leaf+"/memory.swap.max","0");
+	}
+	if (ok && (*limits).cpus>0)
+		ok = writeFile(leaf+"/cpu.max",std::to_string((*limits).cpus*CPU_PERIOD/1000)+" "+std::to_string(CPU_PERIOD));
+	if (ok && (*limits).io>0) {
+		string bps = std::to_string((*limits).io);
+		ok = writeFile(leaf+"/io.max",disk+" rbps="+bps+" wbps="+bps);
+	}
+	if (ok)
+		procsFd = open((leaf+"/cgroup.procs").c_str(),O_WRONLY|O_CLOEXEC);
+	if (!ok || procsFd<0) {
+		rmdir(leaf.c_str());
+		*error = "Could not set the limits of cgroup "+leaf;
+		return false;
+	}
+	path = leaf;
+	oomKills = oomKillCount(path);
+	return true;
+}
+
+/**
+ * @return the fd of the leaf's cgroup.procs, or -1 if the job has no leaf
+ */
+int JobCgroup::procs() {
+	return procsFd;
+}
+
+/**
+ * Reports whether the kernel killed a process of the job for going over memory.max, and removes the leaf.
+ * A leaf that still holds processes, e.g. ones the job left running, can not be removed; cleanup tries again at exit.
+ */
+void JobCgroup::release() {
+	if (path.size()==0)
+		return;
+	close(procsFd);
+	procsFd = -1;
+	if (oomKillCount(path)>oomKills)
+		cout << "A command of the job was killed for going over its memory limit." << endl;
+	rmdir(path.c_str());
+	path.clear();
+}
+
+/**
+ * Removes the job leaves that are left and oopshell.<pid> itself. Called at exit.
+ * If session moved the shell into oopshell.<pid>/shell, the controllers it enabled are turned off again
+ * so that the shell's processes can move back and the leaf can be removed.
+ */
+void JobCgroup::cleanup() {
+	if (sessionDir.size()==0)
+		return;
+	DIR* d = opendir(sessionDir.c_str());
+	if (d!=NULL) {
+		struct dirent* e;
+		while ((e = readdir(d))!=NULL)
+			if (string(e->d_name).compare(0,4,"job.")==0)
+				unlinkat(dirfd(d),e->d_name,AT_REMOVEDIR);
+		closedir(d);
+	}
+	string leaf = sessionDir+"/shell";
+	if (access(leaf.c_str(),F_OK)==0) {
+		std::istringstream ours(controllers()), theirs(parentEnabled);
+		string name;
+		while (ours >> name)
+			writeFile(sessionDir+"/cgroup.subtree_control","-"+name);
+		while (theirs >> name)
+			writeFile(parentDir+"/cgroup.subtree_control","-"+name);
+		moveProcesses(leaf,parentDir,false);
+		rmdir(leaf.c_str());
+	}
+	rmdir(sessionDir.c_str());
+}
@@ -0,0 +1,310 @@
+#include "OopShell.h"
+
+#include <iostream> // for cout, endl
+#include <string>
+#include <stdio.h> // for snprintf
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h> // for getrlimit
+
+using std::cout;
+using std::endl;
+using std::string;
+
+// what each histogram holds, by HistogramId: its name in stats and Prometheus, and its help text
+static const char* HISTOGRAM_NAMES[HIST_COUNT] = { "parse", "spawn", "pipeline" };
+static const char* HISTOGRAM_HELP[HIST_COUNT] = {
+	"Time to parse a command line, plan cache lookups included.",
+	"Time the shell took to launch a command, from fork or the spawn helper's request until it could go on.",
+	"Wall time of a pipeline, from its first launch until every stage was waited for."
+};
+
+/**
+ * Constructor for Histogram. It holds no values.
+ */
+Histogram::Histogram() {
+	reset();
+}
+
+/**
+ * The bucket of a value: values below 8 have a bucket each, and every power of two from 8 up has 8 buckets.
+ */
+int Histogram::bucket(uint64_t value) {
+	if (value<8)
+		return (int)value;
+	int e = 63-__builtin_clzll(value);
+	return (e-2)*8+(int)((value>>(e-3))&7);
+}
+
+/**
+ * The lowest value of a bucket.
+ */
+uint64_t Histogram::lowest(int bucket) {
+	if (bucket<8)
+		return bucket;
+	int e = bucket/8+2;
+	return (uint64_t)(8+bucket%8)<<(e-3);
+}
+
+/**
+ * Adds a value.
+ */
+void Histogram::record(uint64_t value) {
+	buckets[bucket(value)].fetch_add(1,std::memory_order_relaxed);
+	count.fetch_add(1,std::memory_order_relaxed);
+	sum.fetch_add(value,std::memory_order_relaxed);
+	uint64_t seen = max.load(std::memory_order_relaxed);
+	while (value>seen && !max.compare_exchange_weak(seen,value,std::memory_order_relaxed)) {}
+}
+
+/**
+ * @param p -- percentage, e.g. 99
+ * @return the middle of the bucket holding the value p percent of the values are not above; 0 if there are none
+ */
+uint64_t Histogram::percentile(double p) const {
+	uint64_t total = 0;
+	for (int i=0;i<BUCKETS;i++)
+		total += buckets[i].load(std::memory_order_relaxed);
+	if (total==0)
+		return 0;
+	uint64_t rank = (uint64_t)(total*p/100);
+	if (rank<1) rank = 1;
+	uint64_t seen = 0;
+	for (int i=0;i<BUCKETS;i++) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+		if (seen<rank)
+			continue;
+		uint64_t top = getMax();
+		if (i+1==BUCKETS)
+			return top;
+		uint64_t mid = (lowest(i)+lowest(i+1)-1)/2;
+		return mid<top ? mid : top;
+	}
+	return getMax();
+}
+
+/**
+ * @param bound -- a power of two, so it is the lowest value of a bucket
+ * @return the number of values below bound
+ */
+uint64_t Histogram::below(uint64_t bound) const {
+	uint64_t n = 0;
+	int end = bucket(bound);
+	for (int i=0;i<end;i++)
+		n += buckets[i].load(std::memory_order_relaxed);
+	return n;
+}
+
+uint64_t Histogram::getCount() const {
+	return count.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::getSum() const {
+	return sum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::getMax() const {
+	return max.load(std::memory_order_relaxed);
+}
+
+/**
+ * Forgets every value.
+ */
+void Histogram::reset() {
+	for (int i=0;i<BUCKETS;i++)
+		buckets[i].store(0,std::memory_order_relaxed);
+	count.store(0,std::memory_order_relaxed);
+	sum.store(0,std::memory_order_relaxed);
+	max.store(0,std::memory_order_relaxed);
+}
+
+/**
+ * Records the time since the scope began.
+ */
+MetricScope::~MetricScope() {
+	Runtime::getRuntime()->getMetrics()->record(id,Trace::now()-start);
+}
+
+/**
+ * Constructor for Metrics. Counting starts now, and nothing is exported.
+ */
+Metrics::Metrics() {
+	lastExport = 0;
+	reset();
+}
+
+/**
+ * Adds a duration to a histogram.
+ *
+ * @param id -- the histogram
+ * @param ns -- the duration in nanoseconds
+ */
+void Metrics::record(HistogramId id, uint64_t ns) {
+	histograms[id].record(ns);
+}
+
+/**
+ * Adds n to a counter.
+ */
+void Metrics::add(CounterId id, uint64_t n) {
+	counters[id].fetch_add(n,std::memory_order_relaxed);
+}
+
+/**
+ * Zeroes every metric; rates are counted from now.
+ */
+void Metrics::reset() {
+	for (int i=0;i<HIST_COUNT;i++)
+		histograms[i].reset();
+	for (int i=0;i<COUNTER_COUNT;i++)
+		counters[i].store(0,std::memory_order_relaxed);
+	started = Trace::now();
+}
+
+/**
+ * @return the number of fds the shell has open, or -1 if /proc is not mounted
+ */
+int Metrics::openFds() {
+	DIR* d = opendir("/proc/self/fd");
+	if (d==NULL)
+		return -1;
+	int n = 0;
+	struct dirent* e;
+	while ((e = readdir(d))!=NULL)
+		if (e->d_name[0]!='.')
+			n++;
+	closedir(d);
+	// the directory was open too
+	return n-1;
+}
+
+/**
+ * Prints uptime, counts and rates, cache hit rates, fds in use, and the percentiles of each histogram.
+ */
+void Metrics::print() {
+	double uptime = (Trace::now()-started)/1e9;
+	uint64_t commands = counters[COUNTER_COMMANDS].load(std::memory_order_relaxed);
+	char line[256];
+	snprintf(line,sizeof(line),"uptime: %s\ncommands: %llu (%.1f/s), pipelines: %llu",formatSeconds(uptime).c_str(),
+			(unsigned long long)commands,uptime>0 ? commands/uptime : 0,
+			(unsigned long long)counters[COUNTER_PIPELINES].load(std::memory_order_relaxed));
+	cout << line << endl;
+	Runtime* runtime = Runtime::getRuntime();
+	unsigned long hits, misses;
+	const char* caches[] = { "plan cache", "output cache" };
+	for (int i=0;i<2;i++) {
+		if (i==0) (*runtime).getPlanCache()->counts(&hits,&misses);
+		else (*runtime).getOutputCache()->counts(&hits,&misses);
+		cout << caches[i] << ": " << hits << " hits, " << misses << " misses";
+		if (hits+misses>0)
+			cout << " (" << (hits*100+(hits+misses)/2)/(hits+misses) << "% hit rate)";
+		cout << endl;
+	}
+	struct rlimit files;
+	cout << "fds: " << openFds() << " open";
+	if (getrlimit(RLIMIT_NOFILE,&files)==0 && files.rlim_cur!=RLIM_INFINITY)
+		cout << " of " << files.rlim_cur;
+	cout << endl;
+	snprintf(line,sizeof(line),"%-9s %9s %9s %9s %9s %9s %9s","metric","count","mean","p50","p90","p99","max");
+	cout << line << endl;
+	for (int i=0;i<HIST_COUNT;i++) {
+		const Histogram& h = histograms[i];
+		uint64_t n = h.getCount();
+		snprintf(line,sizeof(line),"%-9s %9llu %9s %9s %9s %9s %9s",HISTOGRAM_NAMES[i],(unsigned long long)n,
+				formatSeconds(n>0 ? h.getSum()/1e9/n : 0).c_str(),formatSeconds(h.percentile(50)/1e9).c_str(),
+				formatSeconds(h.percentile(90)/1e9).c_str(),formatSeconds(h.percentile(99)/1e9).c_str(),
+				formatSeconds(h.getMax()/1e9).c_str());
+		cout << line << endl;
+	}
+	if (exportPath.size()>0)
+		cout << "exported to: " << exportPath << endl;
+}
+
+/**
+ * Every metric in the Prometheus text exposition format, labelled with the shell's pid,
+ * so several shells can export to one textfile collector directory.
+ * Histogram buckets are powers of two nanoseconds from about 1us to 69s.
+ */
+string Metrics::prometheus() {
+	char line[256];
+	char pid[32];
+	snprintf(pid,sizeof(pid),"pid=\"%d\"",(int)getpid());
+	string out;
+	for (int i=0;i<HIST_COUNT;i++) {
+		const Histogram& h = histograms[i];
+		string name = string("oopshell_")+HISTOGRAM_NAMES[i]+"_seconds";
+		out += "# HELP "+name+" "+HISTOGRAM_HELP[i]+"\n# TYPE "+name+" histogram\n";
+		for (int k=10;k<=36;k+=2) {
+			snprintf(line,sizeof(line),"%s_bucket{%s,le=\"%.9g\"} %llu\n",name.c_str(),pid,(double)(1ULL<<k)/1e9,
+					(unsigned long long)h.below(1ULL<<k));
+			out += line;
+		}
+		snprintf(line,sizeof(line),"%s_bucket{%s,le=\"+Inf\"} %llu\n%s_sum{%s} %.9f\n%s_count{%s} %llu\n",
+				name.c_str(),pid,(unsigned long long)h.getCount(),name.c_str(),pid,h.getSum()/1e9,
+				name.c_str(),pid,(unsigned long long)h.getCount());
+		out += line;
+	}
+	Runtime* runtime = Runtime::getRuntime();
+	unsigned long planHits, planMisses, outputHits, outputMisses;
+	(*runtime).getPlanCache()->counts(&planHits,&planMisses);
+	(*runtime).getOutputCache()->counts(&outputHits,&outputMisses);
+	struct {
+		const char* name;
+		const char* type;
+		const char* help;
+		double value;
+	} values[] = {
+		{ "oopshell_commands_total", "counter", "Commands executed, built-ins included.",
+				(double)counters[COUNTER_COMMANDS].load(std::memory_order_relaxed) },
+		{ "oopshell_pipelines_total", "counter", "Pipelines executed.",
+				(double)counters[COUNTER_PIPELINES].load(std::memory_order_relaxed) },
+		{ "oopshell_plan_cache_hits_total", "counter", "Command lines found in the plan cache.", (double)planHits },
+		{ "oopshell_plan_cache_misses_total", "counter", "Command lines parsed again.", (double)planMisses },
+		{ "oopshell_output_cache_hits_total", "counter", "Runs of the cache prefix replayed from the store.", (double)outputHits },
+		{ "oopshell_output_cache_misses_total", "counter", "Runs of the cache prefix that had to run.", (double)outputMisses },
+		{ "oopshell_open_fds", "gauge", "File descriptors open in the shell.", (double)openFds() },
+		{ "oopshell_uptime_seconds", "gauge", "Seconds since the metrics were started or reset.", (Trace::now()-started)/1e9 },
+	};
+	for (size_t i=0;i<sizeof(values)/sizeof(values[0]);i++) {
+		snprintf(line,sizeof(line),"# HELP %s %s\n# TYPE %s %s\n%s{%s} %.9g\n",values[i].name,values[i].help,
+				values[i].name,values[i].type,values[i].name,pid,values[i].value);
+		out += line;
+	}
+	return out;
+}
+
+/**
+ * Starts or stops writing the metrics to a file. The file is written right away.
+ *
+ * @param path -- the file, e.g. /var/lib/node_exporter/oopshell.prom; empty to stop
+ * @return false if the file could not be written; the previous file, if any, is then kept
+ */
+bool Metrics::setExportFile(const string& path) {
+	string previous = exportPath;
+	uint64_t previousExport = lastExport;
+	exportPath = path;
+	if (path.size()==0)
+		return true;
+	lastExport = 0;
+	exportNow(true);
+	if (lastExport!=0)
+		return true;
+	exportPath = previous;
+	lastExport = previousExport;
+	return false;
+}
+
+/**
+ * Replaces the export file with the current metrics, atomically, so a scraper never reads half of it.
+ *
+ * @param force -- write it even if it was written less than a second ago, e.g. at exit
+ */
+void Metrics::exportNow(bool force) {
+	if (exportPath.size()==0)
+		return;
+	uint64_t now = Trace::now();
+	if (!force && now-lastExport<1000000000)
+		return;
+	if (writeFileAtomic(exportPath,prometheus()))
+		lastExport = now;
+}
@@ -10,18 +10,14 @@
  * WISH LIST:
  * TODO add hasNext/getNext methods to ScannedInput
  * TODO Move "builtin" core actions to "Runtime" methods
- * TODO Move "builtin" init into "builtin initilizer" class method
  * TODO up/down-arrow history searching
- * TODO report alias insertion failures to user
  * TODO fix alias to accept alias word[ ]*=[ ]*"string"
  * TODO find better way to handle saving paths from one session to next (maybe use env struct?)
  * TODO add the ability to remove paths (other than editing the oopshell_rc file)
- * TODO fix "saving settings..." execution after forked cmd execution. (probably have to check child pid var ==0)
  * TODO better error handling / passing
  * TODO output errno for failed system commands
  * TODO better input validation for input/output file names
  * TODO clean up "dirty" looking methods
- * TODO Test script files: OopShell < testscript
  * TODO check dir validity before adding to path
  * TODO Externalize String Constants
  *
@@ -30,34 +26,110 @@
 #include "OopShell.h"
 
 #include <iostream> // for cout, endl
-#include <stdlib.h> // for atexit
+#include <stdlib.h> // for atexit, getenv, strtol
+#include <limits.h> // for INT_MAX
+#include <string.h> // for strcmp
+#include <fcntl.h> // for open
+#include <unistd.h> // for isatty
 
 using std::cout;
 using std::endl;
 
+static const char* USAGE = "Usage: OopShell [-i] [--json-results fd] [-c cmdline | script]";
+
 /**
  * This is the main shell loop that handles execution and termination of the shell.
+ *
+ * OopShell runs interactively when started without arguments on a terminal, or with -i.
+ * With -c cmdline, a script file argument, or stdin that is not a terminal, it runs non-interactively:
+ * input is read in blocks, no welcome or prompt is printed, output is fully buffered,
+ * and settings are never written.
+ * With --json-results fd, a JSON line describing each pipeline that ran is written to fd.
  */
-int main() {
+int main(int argc, char** argv) {
+	// the spawn helper started by Runtime runs this same binary
+	if (argc==2 && strcmp(argv[1],"--spawn-server")==0)
+		return Spawner::serve();
+	bool forceInteractive = false;
+	const char* cmdLine = NULL;
+	const char* script = NULL;
+	int resultsFd = -1;
+	for (int i=1;i<argc;i++) {
+		if (strcmp(argv[i],"-i")==0)
+			forceInteractive = true;
+		else if (strcmp(argv[i],"--json-results")==0 && i+1<argc && resultsFd<0) {
+			char* end;
+			long fd = strtol(argv[++i],&end,10);
+			// commands must not inherit it, or a reader would wait for them to close it too
+			if (*end!='\0' || end==argv[i] || fd<0 || fd>INT_MAX || fcntl(fd,F_SETFD,FD_CLOEXEC)!=0) {
+				cout << "Not an open fd for --json-results: " << argv[i] << endl;
+				return 2;
+			}
+			resultsFd = fd;
+		}
+		else if (strcmp(argv[i],"-c")==0 && i+1<argc && cmdLine==NULL && script==NULL)
+			cmdLine = argv[++i];
+		else if (argv[i][0]!='-' && cmdLine==NULL && script==NULL)
+			script = argv[i];
+		else {
+			cout << USAGE << endl;
+			return 2;
+		}
+	}
+	LineReader* reader = NULL;
+	if (cmdLine!=NULL)
+		reader = new LineReader(cmdLine);
+	else if (script!=NULL) {
+		int fd = open(script,O_RDONLY|O_CLOEXEC);
+		if (fd<0) {
+			cout << "Could not open script " << script << endl;
+			return 127;
+		}
+		reader = new LineReader(fd);
+	}
+	else if (!forceInteractive && !isatty(STDIN_FILENO))
+		reader = new LineReader(STDIN_FILENO);
+	bool interactive = reader==NULL;
+
 	atexit(exitCleanup);
 	Runtime* runtime = Runtime::getRuntime();
-	cout << "Welcome to OopShell...";
+	(*runtime).interactive = interactive;
+	if (resultsFd>=0)
+		(*runtime).getResults()->open(resultsFd);
+	// long running shells can be scraped without a stats export line in every script
+	const char* metricsFile = getenv("OOPSHELL_METRICS");
+	if (metricsFile!=NULL && metricsFile[0]!='\0' && !(*runtime).getMetrics()->setExportFile(metricsFile))
+		cout << "Could not write metrics to " << metricsFile << endl;
+	if (interactive)
+		cout << "Welcome to OopShell...";
+	else bufferOutput();
+	// script lines are parsed ahead on another thread while earlier lines run
+	ParseAhead* parser = interactive ? NULL : new ParseAhead(reader);
 	while (true) {
-		cout << endl << (*runtime).prompt << " ";
-		Scanner scanner;
-		if (!scanner.readLine()) {
-			if (scanner.readEOF) break;
-			cout << scanner.ERROR_MSG << endl;
-			continue;
+		Scanner local;
+		Scanner* scanner = &local;
+		bool parsed;
+		if (interactive) {
+			cout << endl << (*runtime).prompt << " ";
+			parsed = local.readLine();
 		}
-		Executor executor(scanner.getInput());
-		while (executor.hasNext()) {
-			if (!executor.execNext()) {
-				cout << executor.ERROR_MSG << endl;
-				break;
-			}
+		else parsed = (*parser).next(&scanner);
+		if (!parsed) {
+			if ((*scanner).readEOF) break;
+			cout << (*scanner).ERROR_MSG << endl;
+			(*runtime).lastStatus = 2;
+		}
+		else if ((*scanner).script) {
+			(*runtime).lastStatus = (*(*scanner).script).run();
+		}
+		else {
+			Executor executor((*scanner).getInput());
+			(*runtime).lastStatus = executor.run();
 		}
-		executor.finish();
+		if (parser!=NULL)
+			(*parser).done();
 	}
-	exit(0);
+	delete parser;
+	// like sh, a script exits with the status of its last command
+	exit(interactive ? 0 : (*runtime).lastStatus);
 }
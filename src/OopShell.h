@@ -4,7 +4,29 @@
 
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <deque>
+#include <list>
+#include <memory>
+#include <streambuf>
 #include <string>
+#include <sys/types.h>
+#include <sys/resource.h> // for struct rusage
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <sched.h> // for cpu_set_t
+
+/**
+ * PipeStatMode for CommandList and Runtime
+ * Used to decide whether Executor relays the pipes of a pipeline to measure them, and how it reports
+ */
+enum PipeStatMode {
+	PIPESTAT_OFF,
+	PIPESTAT_SUMMARY,
+	PIPESTAT_LIVE
+};
 
 /**
  * Pipe Read/Write Definitions
@@ -24,6 +46,391 @@ enum IOtype {
 	FILEIO
 };
 
+/**
+ * BatchMode for Runtime
+ * Used to decide what Executor does with a command whose argv+envp exceed ARG_MAX
+ */
+enum BatchMode {
+	BATCH_OFF,
+	BATCH_SEQUENTIAL,
+	BATCH_PARALLEL
+};
+
+/**
+ * Runtime State Generations
+ * Each counter is bumped when that part of the shell state changes; cached plans record them.
+ */
+enum Generation {
+	GEN_ALIAS,
+	GEN_PATH,
+	GEN_CWD,
+	GEN_ENV,
+	GEN_COUNT
+};
+
+class Command;
+class Spawner;
+
+/**
+ * Class Placement
+ * Where and how one pipeline stage runs: its CPUs, NUMA node, nice value, scheduling policy and I/O priority.
+ * It is given per stage with @name=value words before the command, or chosen by set placement auto,
+ * and applied in the child just before exec. It holds no pointers, so the Spawner can send it as bytes.
+ *
+ * Members:
+ *	 hasCpus, cpus -- CPUs the stage may run on, from @cpus=list or the CPUs of @node
+ *	 node -- NUMA node memory is preferably allocated from; -1 for the default policy
+ *	 hasNice, nice -- nice value to run at
+ *	 batch -- true to run under SCHED_BATCH
+ *	 ioprio -- I/O priority in ioprio_set form; -1 to leave it unchanged
+ *
+ * Methods:
+ *	 parse -- applies one @name=value word; returns false and sets error if it is not valid
+ *	 isSet -- true if anything was given
+ *	 apply -- applies the placement to the calling process; returns false and names what failed
+ *	 autoPlace -- packs the stages of a pipeline that have no CPUs of their own onto as few nodes as possible
+ */
+class Placement {
+public:
+	Placement();
+	bool hasCpus;
+	cpu_set_t cpus;
+	int node;
+	bool hasNice;
+	int nice;
+	bool batch;
+	int ioprio;
+	bool parse(const std::string& word, std::string* error);
+	bool isSet() const;
+	bool apply(std::string* failed) const;
+	static void autoPlace(std::vector<Command>* cmds);
+};
+
+/**
+ * Class Limits
+ * Resource limits of a job: a pipeline and every process it starts. They are given with the limit prefix,
+ * or for every job with the limit builtin. Memory, CPU bandwidth and I/O bandwidth are enforced by the job's
+ * JobCgroup; without a delegated memory controller, memory falls back to RLIMIT_AS for each process.
+ * CPU time and open files are always rlimits of each process. It holds no pointers, so the Spawner can send it as bytes.
+ *
+ * Members:
+ *	 memory -- bytes of memory; 0 for no limit, -1 if not given
+ *	 cpuTime -- seconds of CPU time of each process; 0 for no limit, -1 if not given
+ *	 files -- open files of each process; 0 for no limit, -1 if not given
+ *	 cpus -- CPU bandwidth in thousandths of a CPU; 0 for no limit, -1 if not given
+ *	 io -- read and write bytes per second on the disk holding the cwd; 0 for no limit, -1 if not given
+ *	 memoryRlimit -- true if memory is enforced with RLIMIT_AS, because the job has no cgroup for it
+ *
+ * Methods:
+ *	 parse -- applies one option (-m, -t, -n, -c or -i) and its value; returns false and sets error if not valid
+ *	 isOption -- true if a word is a limit option
+ *	 inherit -- takes the limits that were not given from defaults
+ *	 isSet -- true if any limit is in force
+ *	 needsCgroup -- true if a limit is enforced by a cgroup when one is available
+ *	 apply -- sets the rlimits of the calling process; returns false and names what failed
+ *	 print -- prints each limit to stdout
+ */
+class Limits {
+public:
+	Limits();
+	long long memory;
+	long long cpuTime;
+	long long files;
+	long long cpus;
+	long long io;
+	bool memoryRlimit;
+	bool parse(const std::string& option, const std::string& value, std::string* error);
+	static bool isOption(const std::string& word);
+	void inherit(const Limits& defaults);
+	bool isSet() const;
+	bool needsCgroup() const;
+	bool apply(std::string* failed) const;
+	void print() const;
+};
+
+/**
+ * Class JobCgroup
+ * The cgroup v2 leaf a job runs in. The shell's cgroup gets one child, oopshell.<pid>, with a leaf per job,
+ * job.<n>, whose memory.max, cpu.max and io.max are written from the job's Limits. Each process of the job
+ * moves itself into the leaf before exec, so everything it starts is contained too.
+ * The leaf is removed once the job was waited for. The shell itself runs in oopshell.<pid>/shell while it
+ * has the controllers enabled, as a cgroup with processes can not enable them for its children.
+ *
+ * Members:
+ *	 (path) -- directory of the leaf; empty if the job has none
+ *	 (procsFd) -- the leaf's cgroup.procs, open for the job's processes to write themselves into; -1 if none
+ *	 (oomKills) -- oom_kill count of the leaf's memory.events when it was created
+ *
+ * Methods:
+ *	 create -- makes the leaf for a job, if its limits need one; limits a cgroup can not enforce fall back
+ *	   to rlimits, or, if they have no rlimit, make create return false and set error
+ *	 procs -- the fd a child writes "0" to, to join the leaf; -1 if there is no leaf
+ *	 release -- reports a job killed by its memory limit, and removes the leaf
+ *	 controllers -- the controllers job leaves get, e.g. "memory cpu io"; empty if cgroupfs is not delegated
+ *	 cleanup -- removes oopshell.<pid>, at exit
+ *	 (session) -- the directory of oopshell.<pid>, set up on first use; empty if it could not be made
+ */
+class JobCgroup {
+public:
+	JobCgroup();
+	~JobCgroup();
+	bool create(Limits* limits, std::string* error);
+	int procs();
+	void release();
+	static const std::string& controllers();
+	static void cleanup();
+private:
+	std::string path;
+	int procsFd;
+	long oomKills;
+	JobCgroup(const JobCgroup&);
+	JobCgroup& operator=(const JobCgroup&);
+	static const std::string& session();
+};
+
+/**
+ * Struct StageTimes
+ * What one pipeline stage cost, collected for the time prefix.
+ *
+ * Members:
+ *	 forked -- CLOCK_MONOTONIC time the stage was forked, or its launch was sent to the Spawner
+ *	 execed -- time its exec succeeded or failed
+ *	 exited -- time the shell saw it exit
+ *	 usage -- its rusage from wait4, which includes the children it waited for
+ */
+struct StageTimes {
+	struct timespec forked, execed, exited;
+	struct rusage usage;
+};
+
+/**
+ * Class Trace
+ * Records how long the shell's own work takes, e.g. parsing, building pipes, forking and waiting,
+ * and writes it out as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev.
+ * Each thread records complete events into a ring buffer of its own, without taking a lock; once a buffer
+ * is full its oldest events are overwritten. While tracing is off, a TRACE_SCOPE costs one load of a flag.
+ *
+ * Members:
+ *	 (on) -- true while events are recorded
+ *
+ * Methods:
+ *	 enabled -- true while events are recorded
+ *	 setEnabled -- turns recording on or off
+ *	 now -- CLOCK_MONOTONIC time in nanoseconds
+ *	 record -- adds an event to the calling thread's buffer; detail, e.g. a command name, is copied
+ *	 nameThread -- names the calling thread in the trace
+ *	 count -- number of events held in the buffers
+ *	 dump -- writes the events held in every buffer to a file; returns false and sets error if it could not
+ */
+class Trace {
+public:
+	static bool enabled() { return on.load(std::memory_order_relaxed); }
+	static void setEnabled(bool enable);
+	static uint64_t now();
+	static void record(const char* name, uint64_t start, uint64_t end, const char* detail);
+	static void nameThread(const char* name);
+	static size_t count();
+	static bool dump(const std::string& file, std::string* error);
+private:
+	static std::atomic<bool> on;
+};
+
+/**
+ * Class TraceScope
+ * Records the time from its construction to the end of its scope as a trace event, if tracing was on when it began.
+ * Use it through TRACE_SCOPE(name) or TRACE_SCOPE_DETAIL(name, detail); name must be a string literal,
+ * and detail must outlive the scope.
+ */
+class TraceScope {
+public:
+	TraceScope(const char* namei, const char* detaili) : name(namei), detail(detaili), start(Trace::enabled() ? Trace::now() : 0) {}
+	~TraceScope() { if (start!=0) Trace::record(name,start,Trace::now(),detail); }
+private:
+	const char* name;
+	const char* detail;
+	uint64_t start;
+	TraceScope(const TraceScope&);
+	TraceScope& operator=(const TraceScope&);
+};
+
+#define TRACE_CONCAT2(a,b) a##b
+#define TRACE_CONCAT(a,b) TRACE_CONCAT2(a,b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope,__LINE__)(name,NULL)
+#define TRACE_SCOPE_DETAIL(name,detail) TraceScope TRACE_CONCAT(traceScope,__LINE__)(name,detail)
+
+/**
+ * Histograms kept by Metrics
+ */
+enum HistogramId {
+	HIST_PARSE,
+	HIST_SPAWN,
+	HIST_PIPELINE,
+	HIST_COUNT
+};
+
+/**
+ * Counters kept by Metrics
+ */
+enum CounterId {
+	COUNTER_COMMANDS,
+	COUNTER_PIPELINES,
+	COUNTER_COUNT
+};
+
+/**
+ * Class Histogram
+ * Counts durations in nanoseconds in log-linear buckets, as HdrHistogram does: each power of two is split
+ * into 8 buckets, so a percentile is known within 12.5% of its value, from 1ns up, in a fixed array.
+ * Recording is a few relaxed atomic adds, so a thread may record while another reads.
+ *
+ * Members:
+ *	 (buckets) -- count of values in each bucket
+ *	 (count), (sum), (max) -- number of values, their total and the largest one
+ *
+ * Methods:
+ *	 record -- adds a value
+ *	 percentile -- the value below which p percent of the values are, to within its bucket; 0 if there are none
+ *	 below -- number of values below bound, which must be a power of two
+ *	 getCount, getSum, getMax -- as recorded
+ *	 reset -- forgets every value
+ *	 (bucket), (lowest) -- the bucket of a value, and the lowest value of a bucket
+ */
+class Histogram {
+public:
+	Histogram();
+	void record(uint64_t value);
+	uint64_t percentile(double p) const;
+	uint64_t below(uint64_t bound) const;
+	uint64_t getCount() const;
+	uint64_t getSum() const;
+	uint64_t getMax() const;
+	void reset();
+	static const int BUCKETS = 62*8;
+private:
+	std::atomic<uint64_t> buckets[BUCKETS];
+	std::atomic<uint64_t> count, sum, max;
+	static int bucket(uint64_t value);
+	static uint64_t lowest(int bucket);
+	Histogram(const Histogram&);
+	Histogram& operator=(const Histogram&);
+};
+
+/**
+ * Class Metrics
+ * The shell's counters and latency histograms, kept by Runtime: parse time of each line, spawn latency of
+ * each command, wall time of each pipeline, and counts of commands and pipelines. Hit rates of the plan and
+ * output caches and the fds in use are read when they are reported.
+ * They can be written in the Prometheus text format to a file, e.g. for the textfile collector of
+ * node_exporter, which is then rewritten after pipelines, at most once a second, and at exit.
+ *
+ * Members:
+ *	 (histograms), (counters) -- indexed by HistogramId and CounterId
+ *	 (started) -- Trace::now when the counts began
+ *	 (exportPath), (lastExport) -- file the Prometheus text is written to, empty if none, and when it was last written
+ *
+ * Methods:
+ *	 record -- adds a duration in nanoseconds to a histogram
+ *	 add -- adds to a counter
+ *	 print -- prints every metric to stdout
+ *	 prometheus -- every metric in the Prometheus text format
+ *	 setExportFile -- starts writing the Prometheus text to path, or stops if it is empty;
+ *	   returns false, and keeps the previous file, if it could not be written
+ *	 exportNow -- writes the file, if there is one; unless force, only if it was not written in the last second
+ *	 reset -- zeroes every metric
+ *	 (openFds) -- the number of fds the shell has open
+ */
+class Metrics {
+public:
+	Metrics();
+	void record(HistogramId id, uint64_t ns);
+	void add(CounterId id, uint64_t n);
+	void print();
+	std::string prometheus();
+	bool setExportFile(const std::string& path);
+	void exportNow(bool force);
+	void reset();
+private:
+	Histogram histograms[HIST_COUNT];
+	std::atomic<uint64_t> counters[COUNTER_COUNT];
+	uint64_t started;
+	std::string exportPath;
+	uint64_t lastExport;
+	static int openFds();
+};
+
+/**
+ * Class MetricScope
+ * Records the time from its construction to the end of its scope into a histogram of the Runtime's Metrics.
+ */
+class MetricScope {
+public:
+	MetricScope(HistogramId idi) : id(idi), start(Trace::now()) {}
+	~MetricScope();
+private:
+	HistogramId id;
+	uint64_t start;
+	MetricScope(const MetricScope&);
+	MetricScope& operator=(const MetricScope&);
+};
+
+/**
+ * Class PipeRelay
+ * Measures the pipes of a pipeline. Each pipe is cut in two, and a thread of the shell moves the data
+ * from one half to the other with splice, so it is never copied. For each link it counts the bytes, and
+ * the time it waited for the stage before it to write (empty) and for the stage after it to read (full).
+ *
+ * Members:
+ *	 (links) -- one per pipe: its name, the read end of the first half, the write end of the second half,
+ *	   bytes moved and seconds spent empty and full, what of them the last live line showed,
+ *	   its state and when that state began, and when it closed
+ *	 (thread), (running) -- the relay thread, and whether it was started
+ *	 (stopFd) -- eventfd that stops the thread
+ *	 (live) -- true to write the throughput of each link to stderr every second
+ *	 (began), (ended) -- when the relay was started and stopped
+ *
+ * Methods:
+ *	 addLink -- relays in to out under a name; the relay closes both
+ *	 start -- starts the thread; returns false if it could not be started
+ *	 stop -- stops the thread and closes what is still open; returns false if it was not running
+ *	 print -- prints bytes, MB/s and the time each link spent empty and full to stdout
+ *	 (run), (relayLoop) -- the thread: polls the links and splices whatever can move, until it is stopped
+ *	 (move) -- splices one link until it would block, then notes which side it waits for
+ *	 (setState) -- adds the time a link spent in its state to its totals, and changes it
+ *	 (report) -- writes the live line, the throughput of each link since the last one, to stderr
+ */
+class PipeRelay {
+public:
+	PipeRelay();
+	~PipeRelay();
+	void addLink(int in, int out, const std::string& name);
+	bool start(bool live);
+	bool stop();
+	void print();
+private:
+	enum LinkState { LINK_EMPTY, LINK_FULL, LINK_MOVING, LINK_CLOSED };
+	struct Link {
+		std::string name;
+		int in, out;
+		unsigned long long bytes, bytesReported;
+		double empty, full, emptyReported, fullReported;
+		LinkState state;
+		struct timespec since, closed;
+	};
+	std::vector<Link> links;
+	pthread_t thread;
+	bool running;
+	int stopFd;
+	bool live;
+	struct timespec began, ended;
+	PipeRelay(const PipeRelay&);
+	PipeRelay& operator=(const PipeRelay&);
+	static void* run(void* arg);
+	void relayLoop();
+	void move(Link* link, const struct timespec& now);
+	void setState(Link* link, LinkState state, const struct timespec& now);
+	void report(const struct timespec& now, const struct timespec& last);
+};
+
 /**
  * Class Command
  * This encapsulates a command, as identified by scanner
@@ -34,18 +441,41 @@ enum IOtype {
  *	 cmd -- command name to execute by execvp
  *	 args -- arg list for execvp
  *	 builtIn -- true if command is a builtin command
+ *	 builtInId -- index of the command in the built-in command table, found once by Scanner; -1 if not built in
+ *	 function -- true if command is a script function; like a built-in, it runs in the shell process
  *	 inputType, outputType -- used by Executor to identify what kind of input & output File Descriptors to use
+ *	 batchFrom, batchTo -- args[batchFrom..batchTo) may be split across several runs; the others are repeated in each run.
+ *	   The span holds the glob-expanded args, and is empty (both 0) if there are none
+ *	 execPath -- file cmd resolves to through PATH, set by resolvePath; if empty, evalCmd searches PATH itself
+ *	 placement -- CPUs, node and priorities the command runs with
+ *	 limits -- resource limits of the command's job, applied as rlimits
+ *	 cgroupFd -- cgroup.procs of the job's cgroup leaf, which the child joins before exec; -1 if there is none
+ *	 timed -- true to collect times: the launch waits until the child exec'd, and wait collects its rusage
+ *	 times -- launch, exec and exit times and rusage of the child, if timed
  *	 gpid -- reference to the group ID of all child processes spawned by Command
  *	 (fdIn), (fdOut) -- store references to the File Descriptors for Input and Output
  *	 (pid) -- stores the pid for the forked child process executing cmd
  *	 (childState) -- holds exec state for child process pid
+ *	 (batchEnds) -- end index in args of each run planned by planBatches; empty if cmd runs once
+ *	 (spawnedBy) -- the Spawner that launched the child, or NULL if the shell forked it
  *
  * Methods:
  *	 setFd -- used to initialize File Descriptors
  *	 execute -- called to execute cmd using fork & exec
  *	 printState -- convenience method to display internal state of Command to console
  *	 wait - tells command to wait on its child process
+ *	 status -- exit status of the command once it finished: 0 for success, 128+n if killed by signal n
+ *	 signal -- the signal that killed the command, or 0 if it exited
+ *	 argSize -- bytes args will take in the new process image
+ *	 planBatches -- splits args into runs that each fit in a given number of bytes
+ *	 resolvePath -- looks cmd up in PATH once, so execPath can be exec'd directly every time a cached plan runs
+ *	 openPidFd -- opens a pidfd for the child, which polls readable once it exits; -1 with errno ESRCH if there is none
+ *	 running -- true if the child has not exited yet; it is not reaped
+ *	 markExited -- records the time the child was seen to exit, if timed
  *	 (evalCmd) -- helper method for execute
+ *	 (execFile) -- helper method for evalCmd
+ *	 (runBatches) -- runs the planned batches in sequence or in parallel, preserving output order
+ *	 (spawn) -- launches cmd through the Spawner instead of forking
  */
 class Command {
 public:
@@ -53,17 +483,40 @@ public:
 	std::string cmd;
 	std::vector<std::string> args;
 	bool builtIn;
+	int builtInId;
+	bool function;
 	IOtype inputType, outputType;
+	size_t batchFrom, batchTo;
+	std::string execPath;
+	Placement placement;
+	Limits limits;
+	int cgroupFd;
+	bool timed;
+	StageTimes times;
 	static pid_t gpid;
+	Command();
 	void setFd(int fdIn, int fdOut);
 	int execute();
 	void wait();
+	int status();
+	int signal();
 	void printState(std::string* header);
+	size_t argSize();
+	bool planBatches(size_t limit);
+	void resolvePath();
+	int openPidFd();
+	bool running();
+	void markExited();
 private:
 	int fdIn, fdOut;
 	pid_t pid;
 	int childState;
+	std::vector<size_t> batchEnds;
+	Spawner* spawnedBy;
 	int evalCmd(std::vector<std::string>* v);
+	void execFile(const char* file, char** args, char** envp);
+	int runBatches();
+	int spawn(Spawner* spawner);
 };
 
 /**
@@ -72,6 +525,14 @@ private:
  *
  * Members:
  *	 inputFile, outputFile -- these hold the file names associated with file IO. they are blank if no file is used.
+ *	 memoize -- true if the line had the cache prefix; Executor then runs it through the OutputCache
+ *	 memoEnv -- names of the variables given to cache -e, whose values are part of the cache key
+ *	 limits -- resource limits given with the limit prefix
+ *	 timeout, killGrace -- seconds given with the timeout prefix, and with its -k option; -1 if not given
+ *	 timed -- true if the line had the time prefix; Executor then prints what each stage cost
+ *	 pipeStat -- PIPESTAT_SUMMARY or PIPESTAT_LIVE if the line had the pipestat prefix; PIPESTAT_OFF if not,
+ *	   and Executor then follows set pipestat
+ *	 benchRuns, benchWarmup, benchKeep -- runs, warmup runs and -k of the bench prefix; benchRuns is 0 without it
  *	 (cmdV) -- this is the vector of Commands, in order of intended execution.
  *
  * Methods:
@@ -79,7 +540,16 @@ private:
  */
 class CommandList {
 public:
+	CommandList();
 	std::string inputFile, outputFile;
+	bool memoize;
+	std::vector<std::string> memoEnv;
+	Limits limits;
+	double timeout, killGrace;
+	bool timed;
+	PipeStatMode pipeStat;
+	int benchRuns, benchWarmup;
+	bool benchKeep;
 	std::vector<Command> cmdV;
 	int size();
 //	bool hasNext();
@@ -90,6 +560,242 @@ private:
 //	std::vector<Command>::iterator end;
 };
 
+/**
+ * Class ResultLog
+ * Writes a JSON line for each executed CommandList to the fd given with --json-results, for programs driving
+ * the shell. A line holds the argv of each stage, the < and > files, each stage's exit status, signal and
+ * CPU time, the pipeline's status and wall time, and the size of the > file, e.g.
+ *	 {"stages":[{"argv":["ls"],"status":0,"signal":null,"user":0.001,"sys":0.002}],"in":null,"out":"x",...}
+ * Lines are built in a fixed buffer, without allocating, and written once it fills, at exit, and after each
+ * line when the shell is interactive.
+ *
+ * Members:
+ *	 (fd) -- where lines go; -1 if there is no --json-results
+ *	 (buf), (used) -- the buffer, and the bytes in it
+ *
+ * Methods:
+ *	 open -- sends lines to fd from now on
+ *	 isOpen -- true if there is an fd
+ *	 record -- writes the line of a CommandList
+ *	 flush -- writes out the buffer
+ *	 (put), (putString), (putNumber), (putSeconds) -- append raw text, a JSON string, an integer
+ *	   and a number of seconds to the buffer
+ */
+class ResultLog {
+public:
+	ResultLog();
+	void open(int fdi);
+	bool isOpen();
+	void record(const CommandList& shown, CommandList* ran, size_t executed, int status, bool timedOut,
+			bool cached, double wall);
+	void flush();
+private:
+	int fd;
+	char buf[65536];
+	size_t used;
+	void put(const char* s, size_t len);
+	void put(const char* s);
+	void putString(const std::string& s);
+	void putNumber(long long n);
+	void putSeconds(double s);
+};
+
+/**
+ * Class PlanCache
+ * An LRU cache from a normalized command line to its parsed CommandList, with each executable path resolved.
+ * An entry records the Runtime generations it was built under, and is only used while they all still match,
+ * so alias, PATH, cwd and variable changes invalidate it.
+ *
+ * Members:
+ *	 (lru) -- entries, most recently used first
+ *	 (index) -- line -> entry in lru
+ *	 (hits), (misses), (stale), (uncacheable) -- counters reported by printStats; stale lookups also count as misses.
+ *	   They are atomic, as the ParseAhead thread counts while stats and the metrics export read them
+ *
+ * Methods:
+ *	 lookup -- copies the cached plan for line into plan; returns false if there is none, or it is out of date
+ *	 insert -- caches plan for line, evicting the least recently used entry when full
+ *	 noteUncacheable -- counts a line that could not be cached, e.g. because it was glob-expanded
+ *	 clear -- drops every entry
+ *	 printStats -- prints entry count and hit rate to stdout
+ *	 counts -- its hits and misses, for the metrics
+ */
+class PlanCache {
+public:
+	PlanCache();
+	bool lookup(const std::string& line, CommandList* plan);
+	void insert(const std::string& line, const CommandList& plan);
+	void noteUncacheable();
+	void clear();
+	void printStats();
+	void counts(unsigned long* hitCount, unsigned long* missCount);
+private:
+	struct Entry {
+		std::string line;
+		CommandList plan;
+		unsigned long gens[GEN_COUNT];
+	};
+	std::list<Entry> lru;
+	std::unordered_map<std::string,std::list<Entry>::iterator> index;
+	std::atomic<unsigned long> hits, misses, stale, uncacheable;
+};
+
+/**
+ * Class OutputCache
+ * Memoizes the stdout of deterministic pipelines run with the cache prefix, in a content-addressed store.
+ * A run is keyed by a murmur3 128 bit hash of the argv of every stage, the inode, size and mtime of each
+ * executable and of the < input file, the cwd and the variables named with -e. The store holds
+ * objects/<content hash> files and keys/<key hash> symlinks to them, so runs with the same output share
+ * one file. A hit replays the object to the > file or stdout with sendfile, without running anything.
+ * Only runs that exit with 0 are stored; the least recently used objects are evicted past the size limit.
+ *
+ * Members:
+ *	 limit -- most bytes of objects kept in the store
+ *	 (dir) -- the store directory; created on the first store
+ *	 (hits), (misses), (failed), (evicted) -- counters reported by printStats; failed runs are not stored
+ *	 (replayed) -- bytes replayed from the store
+ *
+ * Methods:
+ *	 setStore -- sets the store directory
+ *	 run -- runs a CommandList through the cache, and returns its exit status
+ *	 clear -- deletes every stored output
+ *	 printStats -- prints the store size and hit rate to stdout
+ *	 counts -- its hits and misses, for the metrics
+ *	 (makeKey) -- hashes everything a run's output depends on
+ *	 (replay) -- copies a stored object to the output of a CommandList
+ *	 (store) -- moves a finished run's output into the store under its key
+ *	 (evict) -- deletes the least recently used objects until the store fits in limit
+ */
+class OutputCache {
+public:
+	OutputCache();
+	unsigned long long limit;
+	void setStore(const std::string& dir);
+	int run(CommandList* plan);
+	void clear();
+	void printStats();
+	void counts(unsigned long* hitCount, unsigned long* missCount);
+private:
+	std::string dir;
+	unsigned long hits, misses, failed, evicted;
+	unsigned long long replayed;
+	bool makeKey(CommandList* plan, std::string* key);
+	bool replay(int fd, const CommandList& plan);
+	bool store(int fd, const std::string& tmpPath, const std::string& key);
+	void evict();
+};
+
+/**
+ * Class Spawner
+ * A small helper process that forks and execs commands on the shell's behalf, so a launch does not have to
+ * copy the page tables and fd table of a large shell. The helper is OopShell itself, re-executed with
+ * --spawn-server, so its address space is fresh and minimal. The shell sends each request over a Unix
+ * socketpair: the executable, argv, envp, cwd, process group, placement and limits, with stdin, stdout, stderr
+ * and the job's cgroup.procs passed as SCM_RIGHTS. The helper replies with the pid, and sends the wait status when the command exits.
+ *
+ * Members:
+ *	 (sock) -- the shell's end of the socketpair; -1 if the helper is not running
+ *	 (helper) -- pid of the helper
+ *	 (exited) -- wait statuses and rusage that arrived before the shell waited for them, by pid
+ *
+ * Methods:
+ *	 start -- starts the helper; returns false if it could not be started
+ *	 stop -- closes the socketpair, which makes the helper exit, and reaps it
+ *	 running -- true if the helper is running
+ *	 spawn -- launches a command through the helper, and returns its pid, or -1; with times, the helper
+ *	   replies once the command exec'd, and the time it did is kept in times
+ *	 wait -- waits for a command launched by spawn, and returns its wait status and rusage
+ *	 serve -- the helper's main loop, run by main for --spawn-server
+ *	 (readReply) -- reads one reply from the helper, keeping exit statuses and rusage in exited
+ */
+class Spawner {
+public:
+	Spawner();
+	~Spawner();
+	bool start();
+	void stop();
+	bool running();
+	pid_t spawn(const std::string& path, const std::vector<std::string>& args, const int fds[4], pid_t pgid,
+			const Placement& placement, const Limits& limits, StageTimes* times);
+	int wait(pid_t pid, struct rusage* usage);
+	static int serve();
+private:
+	int sock;
+	pid_t helper;
+	std::map<pid_t,std::pair<int,struct rusage> > exited;
+	bool readReply(int* kind, pid_t* pid, struct timespec* execed);
+};
+
+/**
+ * Class LineReader
+ * This reads lines for the non-interactive modes, from a script file descriptor or from a -c string.
+ * Input is read with read(2) in 64KB blocks, instead of through cin a line at a time.
+ *
+ * Members:
+ *	 (fd) -- the file descriptor read from, or -1 when reading a string
+ *	 (buf), (pos) -- input read but not yet returned, and the start of the next line in it
+ *	 (eof) -- true once fd returned end of file
+ *
+ * Methods:
+ *	 next -- copies the next line, without its newline, into line; returns false at end of input
+ *	 nextCommand -- like next, but skips blank lines and # comments
+ */
+class LineReader {
+public:
+	LineReader(int fd);
+	LineReader(const std::string& text);
+	bool next(std::string* line);
+	bool nextCommand(std::string* line);
+private:
+	int fd;
+	std::string buf;
+	size_t pos;
+	bool eof;
+};
+
+/**
+ * Class BlockOutBuf
+ * A fully buffered stream buffer for cout in the non-interactive modes.
+ * sync is a no-op, so endl and flush do not cost a write each; the buffer is written out
+ * when it fills, by flushOutput before the shell forks, and at exit.
+ *
+ * Members:
+ *	 (fd) -- the file descriptor written to
+ *	 (buf) -- the output buffer
+ *
+ * Methods:
+ *	 flushAll -- writes out everything buffered; returns false on a write error
+ *	 (overflow) -- writes out a full buffer, then stores c
+ *	 (sync) -- does nothing; output is written by flushAll
+ */
+class BlockOutBuf : public std::streambuf {
+public:
+	BlockOutBuf(int fd);
+	bool flushAll();
+protected:
+	int overflow(int c);
+	int sync();
+private:
+	int fd;
+	char buf[1<<16];
+};
+
+/**
+ * Struct ScannedLine
+ * A command line split into redirect file names and the words of each pipeline stage, before any expansion.
+ * Scripts keep their lines in this form, so a loop body is scanned once and only expanded each time it runs.
+ *
+ * Members:
+ *	 inputFile, outputFile -- redirect file names as typed; empty if there is no redirect
+ *	 stages -- the words of each command of the pipeline, as typed
+ */
+struct ScannedLine {
+	std::string inputFile, outputFile;
+	std::vector<std::vector<std::string> > stages;
+};
+
+class Script;
+
 /**
  * Class Scanner
  * This class scans a line of input and parses it into a series of Command objects.
@@ -99,16 +805,34 @@ private:
  *	 FILE_IN_TOKEN,FILE_OUT_TOKEN,PIPE_TOKEN,ARG_SEP -- used for command parsing
  *	 input -- The CommandList class of Commands built from the parsed user input.
  *	 readEOF -- this is set to "true" if readLine encountered an EOF
+ *	 script -- the compiled script, if the input was an if/while/for/function block; input is then empty
+ *	 (uncacheable) -- set if a word was glob-expanded or used $?; such a plan changes from run to run and is not cached
  *
  * Methods:
- *	 readLine -- reads and proccesses a line from cin. It will return false on EOF or parse error.
+ *	 readLine -- reads and proccesses a line from cin, or from a LineReader in the non-interactive modes.
+ *	   It will return false on EOF or parse error. Blank lines and # comments from a LineReader are skipped.
+ *	   A line starting a block is read up to its matching end, and compiled into script.
  *	 getInput -- returns reference to the CommandList class holding parsed user input
- *	 (parse) -- parses the input read in from the shell prompt and builds a CommandList class
+ *	 startsBlock -- true if a line starts an if, while, for or function block
+ *	 scanLine -- validates a line and splits it into redirects and words, without expanding anything
+ *	 expandLine -- builds the CommandList class from a scanned line: expands ~, variables, globs and aliases
+ *	 (parse) -- parses the input read in from the shell prompt, through the plan cache
+ *	 (buildCommands) -- builds the CommandList class for a line the plan cache did not have
+ *	 (scanPrefixes) -- reads prefixes such as cache off the first command, into the CommandList
+ *	 (readBlock) -- reads the rest of a block from cin or a LineReader, and compiles it
  *	 (verifyInput) -- validates user input structure
  *	 (expandTilde) -- expands ~ character
+ *	 (expandVars) -- expands $VAR and ${VAR}
  *	 (verifyNotFirstOrLast) -- helper method for verify input
+ *
+ * ParseAhead calls parse directly, so it can order the parse of a line against commands still running.
+ * Script uses the expansion methods for the word lists of for loops.
+ * MicroBench (bench/MicroBench.cpp) times parse, buildCommands and verifyInput directly.
  */
 class Scanner {
+	friend class ParseAhead;
+	friend class Script;
+	friend class MicroBench;
 public:
 	Scanner();
 	std::string ERROR_MSG;
@@ -119,11 +843,21 @@ public:
 	CommandList input;
 	bool readEOF;
 	bool readLine();
+	bool readLine(LineReader* reader);
 	CommandList* getInput();
+	std::shared_ptr<Script> script;
+	static bool startsBlock(const std::string& line);
+	bool scanLine(std::string rawInput, ScannedLine* line);
+	bool expandLine(const ScannedLine& line);
 private:
+	bool uncacheable;
 	bool parse(std::string input);
+	bool buildCommands(std::string input);
+	bool scanPrefixes(const std::vector<std::string>& words, size_t* skip);
+	bool readBlock(std::string first, LineReader* reader);
 	bool verifyInput(std::string* input);
 	void expandTilde(std::string* val);
+	void expandVars(std::string* val);
 	bool verifyNotFirstOrLast(std::string* in, std::string token);
 };
 
@@ -136,12 +870,33 @@ private:
  *	 (input) -- pointer to CommandList received during initialization.
  *	 (cvItr) -- iterator over CommandList's cmd list data structure.
  *	 (cvEnd) -- convenience pointer to the end of CommandList's cmd list data structure.
+ *	 (exitStatus) -- exit status of the last Command, set by finish; 1 if not every Command could be executed.
+ *	 (cgroup) -- the cgroup leaf of the job, if its limits need one.
+ *	 (timeout), (grace) -- seconds the job may run, 0 for no limit, and seconds between its SIGTERM and SIGKILL.
+ *	 (deadline) -- CLOCK_MONOTONIC time the job is stopped at, if it has a timeout.
+ *	 (jobPgid) -- process group of a job with a timeout, which is signalled when it expires; 0 if there is none.
+ *	 (timer) -- timerfd for the deadline of a job with a timeout, made before its first Command runs; -1 if none.
+ *	 (timedOut) -- true if the job was stopped at its deadline.
+ *	 (timing) -- true if the job has the time prefix and its times were not printed yet.
+ *	 (relay) -- moves and measures the data between the stages of a job with pipestat.
+ *	 (began) -- Trace::now when the first Command was executed, for the pipeline metrics; 0 once recorded.
+ *	 (shown) -- the CommandList the --json-results line describes; input, unless reportAs gave another.
  *
  * Methods:
  *	 hasNext -- true if there are still Commands to be executed.
  *	 execNext -- process and execute the next Command.
  *	 finish -- clean up any loose "threads" (so to speak) left "hanging" (if you will) after all Commands are executed.
+ *	 run -- executes every Command, prints any error, finishes, and returns the exit status.
+ *	 reportAs -- makes the --json-results line show the argv and files of another CommandList, e.g. the line
+ *	   a cache run was made from.
  *	 (buildFds) -- Builds & sets pipe & file File Descriptors for Command objects before execution.
+ *	 (checkArgSize) -- Checks a Command against ARG_MAX and plans batches for it if Runtime allows it.
+ *	 (applyLimits) -- Gives each Command the job's limits, and its cgroup leaf if it has one.
+ *	 (watch) -- Waits for the Commands of a job with a timeout or the time prefix, stopping them if the timeout
+ *	   expires and recording when each exits.
+ *	 (printTimes) -- Prints what each stage of a job with the time prefix cost.
+ *	 (pipeStat) -- Whether the pipes of the job are relayed, from its pipestat prefix or set pipestat.
+ *	 (bench) -- Runs a job with the bench prefix the times it asks for, and prints statistics of the runs.
  *
  */
 class Executor {
@@ -152,11 +907,149 @@ public:
 	bool hasNext();
 	bool execNext();
 	void finish();
+	int run();
+	void reportAs(CommandList* plan);
 private:
 	CommandList* input;
+	int exitStatus;
 	std::vector<Command>::iterator cvItr;
 	std::vector<Command>::iterator cvEnd;
+	JobCgroup cgroup;
+	double timeout, grace;
+	struct timespec deadline;
+	pid_t jobPgid;
+	int timer;
+	bool timedOut;
+	bool timing;
+	PipeRelay relay;
+	uint64_t began;
+	CommandList* shown;
 	bool buildFds(std::vector<Command>* v, std::string inFileName, std::string outFileName);
+	bool checkArgSize(Command* cmd);
+	bool applyLimits();
+	void watch();
+	void printTimes();
+	PipeStatMode pipeStat();
+	int bench();
+};
+
+/**
+ * Class Script
+ * A block of if/while/for/function lines, compiled to bytecode and run by a small VM.
+ *
+ * compile scans each line of the block once into a ScannedLine, builds an AST of the block,
+ * and flattens it into instructions. The VM runs them: command lines are expanded and handed to an Executor
+ * each time they run, and jumps implement the control flow, so loop bodies are never scanned again.
+ *
+ * Syntax (each keyword starts a line):
+ *	 if cmdline / [else] / end -- runs the first part if cmdline exits 0, otherwise the else part
+ *	 while cmdline / end -- repeats while cmdline exits 0
+ *	 for name in [word]* / end -- runs once for each word, with variable name set to it; words are expanded first
+ *	 function name / end -- defines a function; it is called like a command, with arguments $1, $2...
+ *
+ * Members:
+ *	 (code) -- the instructions
+ *	 (lines) -- scanned command lines, used by OP_RUN
+ *	 (loops) -- variable name and scanned words of each for loop, used by OP_FOR_START and OP_FOR_NEXT
+ *	 (functions) -- name and entry point of each function, used by OP_DEFINE
+ *
+ * Methods:
+ *	 compile -- builds a Script from the lines of a block; returns NULL and sets error if the block is malformed
+ *	 run -- runs the script; returns the exit status of its last command
+ *	 call -- runs a function body from its entry point up to its OP_RET
+ *	 (parseNodes) -- parses lines into AST nodes, up to an else or end line
+ *	 (scanInto) -- scans a command line and stores it in lines
+ *	 (emit) -- compiles an AST node into instructions
+ *	 (exec) -- the VM loop
+ *	 (runLine) -- expands a scanned line and runs it with an Executor
+ */
+class Script : public std::enable_shared_from_this<Script> {
+public:
+	static std::shared_ptr<Script> compile(const std::vector<std::string>& lines, std::string* error);
+	int run();
+	int call(size_t entry);
+private:
+	enum OpCode {
+		OP_RUN,			// run lines[arg], setting the status
+		OP_JUMP,		// continue at target
+		OP_JUMP_FAIL,	// continue at target if the status is not 0
+		OP_FOR_START,	// expand the words of loops[arg] and start iterating over them
+		OP_FOR_NEXT,	// set the variable of loops[arg] to the next word, or finish the loop and continue at target
+		OP_DEFINE,		// define functions[arg]
+		OP_RET			// return from a function
+	};
+	struct Instr {
+		OpCode op;
+		unsigned int arg;
+		unsigned int target;
+	};
+	struct ForLoop {
+		std::string var;
+		std::vector<std::string> words;
+	};
+	struct FunctionDef {
+		std::string name;
+		unsigned int entry;
+	};
+	struct Node;
+	std::vector<Instr> code;
+	std::vector<ScannedLine> lines;
+	std::vector<ForLoop> loops;
+	std::vector<FunctionDef> functions;
+	Script() {}
+	bool parseNodes(const std::vector<std::string>& src, size_t* pos, std::vector<Node>* out,
+			std::string* terminator, std::string* error);
+	bool scanInto(const std::string& text, size_t lineNo, unsigned int* ref, std::string* error);
+	void emit(const Node& node);
+	int exec(size_t pc);
+	int runLine(const ScannedLine& line);
+};
+
+/**
+ * Class ParseAhead
+ * This parses script lines on a separate thread, keeping a bounded queue of parsed lines ahead of the Executor,
+ * so parsing is off the critical path of non-interactive runs.
+ *
+ * Parsing depends on state that earlier lines may change, so two kinds of lines wait for the Executor
+ * to finish every line handed out so far (to go quiescent):
+ *	 - the line after a line that runs a builtin or function, or a block, since alias, cd, export, set...
+ *	   change how lines parse
+ *	 - a line containing glob characters, since earlier commands may create or remove the files it matches,
+ *	   or ?, since $? is the status of the previous line
+ *
+ * Members:
+ *	 (reader) -- source of script lines
+ *	 (queue) -- parsed lines, with their parse result, waiting for the Executor
+ *	 (current) -- the line handed out by next, freed by done
+ *	 (pushed), (completed) -- number of lines queued by the parser, and finished by the Executor
+ *	 (lock), (cond) -- guard the queue and the counters
+ *	 (thread), (threaded) -- the parser thread, and whether it could be started
+ *
+ * Methods:
+ *	 next -- waits for the next parsed line; returns the parse result, and the Scanner in scanner.
+ *	   At end of input the Scanner has readEOF set.
+ *	 done -- must be called when the line returned by next has finished executing
+ *	 (run), (parseLoop) -- parser thread body
+ *	 (waitQuiescent) -- parser side: waits until every queued line has finished executing
+ */
+class ParseAhead {
+public:
+	ParseAhead(LineReader* reader);
+	~ParseAhead();
+	bool next(Scanner** scanner);
+	void done();
+private:
+	LineReader* reader;
+	std::deque<std::pair<Scanner*,bool> > queue;
+	Scanner* current;
+	size_t pushed, completed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool threaded;
+	static void* run(void* arg);
+	void parseLoop();
+	void waitQuiescent();
 };
 
 /**
@@ -264,6 +1157,118 @@ private:
 	std::string help;
 };
 
+/**
+ * Class Cache
+ */
+class Cache: public BuiltInI {
+public:
+	Cache(std::string name, std::string usage) : BuiltInI(name, usage) {}
+	bool execute(std::vector<std::string>* args);
+};
+
+/**
+ * Class Limit
+ * Encapsulates limit cmd
+ */
+class Limit: public BuiltInI {
+public:
+	Limit(std::string name, std::string usage) : BuiltInI(name, usage) {}
+	bool execute(std::vector<std::string>* args);
+};
+
+/**
+ * Class TraceCmd
+ * Encapsulates trace cmd
+ */
+class TraceCmd: public BuiltInI {
+public:
+	TraceCmd(std::string name, std::string usage) : BuiltInI(name, usage) {}
+	bool execute(std::vector<std::string>* args);
+};
+
+/**
+ * Class Stats
+ * Encapsulates stats cmd
+ */
+class Stats: public BuiltInI {
+public:
+	Stats(std::string name, std::string usage) : BuiltInI(name, usage) {}
+	bool execute(std::vector<std::string>* args);
+};
+
+/**
+ * Class Export
+ * Encapsulates export and unset cmds
+ */
+class Export: public BuiltInI {
+public:
+	Export(std::string name, std::string usage) : BuiltInI(name, usage) {}
+	bool execute(std::vector<std::string>* args);
+};
+
+/**
+ * Struct BuiltInDecl
+ * One entry of the built-in command table in BuiltInCmds.cpp.
+ * Adding a built-in command means adding its class and one entry to that table.
+ *
+ * Members:
+ *	 name -- referenced command name
+ *	 create -- factory for the class implementing the command
+ *	 usage -- help text for the command
+ */
+struct BuiltInDecl {
+	const char* name;
+	BuiltInI* (*create)(std::string name, std::string usage);
+	const char* usage;
+};
+
+/**
+ * Built-in command table lookups
+ *	 findBuiltIn -- returns the id of a built-in command name, or -1; a compile-time perfect hash makes this one probe
+ *	 getBuiltInDecl -- returns the table entry for a built-in id
+ *	 builtInCount -- returns the number of built-in commands
+ */
+int findBuiltIn(const char* name, size_t len);
+const BuiltInDecl* getBuiltInDecl(int id);
+int builtInCount();
+
+/**
+ * Struct ShellVar
+ * A shell variable held by Runtime.
+ *
+ * Members:
+ *	 value -- the value of the variable
+ *	 exported -- true if the variable is passed in the environment of executed commands
+ */
+struct ShellVar {
+	std::string value;
+	bool exported;
+};
+
+/**
+ * Struct PasswdEntry
+ * A cached passwd lookup held by Runtime.
+ *
+ * Members:
+ *	 found -- false if the user does not exist; misses are cached too
+ *	 dir -- the user's home directory
+ *	 expires -- CLOCK_MONOTONIC second after which the lookup is repeated
+ */
+struct PasswdEntry {
+	bool found;
+	std::string dir;
+	time_t expires;
+};
+
+/**
+ * Struct ShellFunction
+ * A function defined by a script: the compiled script holding its body, and where the body starts.
+ */
+struct ShellFunction {
+	std::shared_ptr<Script> script;
+	size_t entry;
+};
+
 /**
  * Class Runtime
  * This class holds system-wide settings such as aliases, built in commands, the prompt, etc.
@@ -271,26 +1276,84 @@ private:
  * It is implemented as a singleton.
  *
  * Methods:
- *	 getBuiltIn -- returns a pointer to the class associated with a given command
+ *	 getBuiltIn -- returns a pointer to the class associated with a given command name or built-in id
  *	 getInstance -- returns a pointer to the singleton Runtime instance
  *	 getHistory -- returns a reference to the command history vector
- *	 expandAlias -- expands aliases recursively
+ *	 expandAlias -- replaces an aliased cmd word with its pre-resolved words
  *	 isBuiltIn -- checks if a command is registered as a builtin command
  *	 printBuiltIn -- prints a list of built-in commands to stdout
  *	 printAlias -- prints a list of aliases to stdout
- *	 addAlias -- adds alias to map
+ *	 addAlias -- adds alias to map, refusing any alias that would create a cycle
  *	 removeAlias -- removes specified alias from map
  *	 getHistory -- gets a vector of session command history
- *	 (initBuiltIn) -- initializes & registers all built-in commands
+ *	 getVar -- looks up a shell variable, or an argument of the running function for a number
+ *	 setVar -- sets a shell variable, and optionally exports it
+ *	 exportVar -- marks an existing shell variable for export
+ *	 unsetVar -- removes a shell variable
+ *	 printVars -- prints exported variables to stdout
+ *	 getEnvp -- returns the environment array handed to execve; it is rebuilt only after an exported variable changed
+ *	 getEnvBytes -- bytes the environment array takes up in execve, strings and pointers included
+ *	 getCwd -- returns the current working directory, kept in memory
+ *	 changeDir -- changes the working directory, and updates the in-memory cwd and PWD
+ *	 setPrompt -- changes the prompt
+ *	 setJournal -- turns the append-only settings journal on or off
+ *	 isJournalOn -- true if settings changes are appended to the journal
+ *	 generation -- current value of a state generation counter (aliases, PATH, cwd, variables)
+ *	 getPlanCache -- returns the parsed-plan cache
+ *	 getOutputCache -- returns the store of memoized pipeline outputs
+ *	 getSpawner -- returns the spawn helper if it is running, otherwise NULL
+ *	 getMetrics -- returns the counters and latency histograms of the session
+ *	 getResults -- returns the writer of --json-results lines
+ *	 setSpawner -- starts or stops the spawn helper
+ *	 getUserHome -- home directory of a user (or of the current user, for an empty name), through a passwd cache
+ *	 defineFunction -- defines or replaces a script function
+ *	 isFunction -- true if a command name is a script function
+ *	 callFunction -- runs a script function with arguments $1, $2...; returns its exit status
+ *	 (markSettingsChanged) -- records a settings change in the journal, or marks the settings file dirty
+ *	 (journalSetting) -- appends a record to the settings journal
+ *	 (compactJournal) -- folds the journal into the settings file
+ *	 (resolveAlias) -- follows an alias chain to its final words, detecting cycles
+ *	 (rebuildAliases) -- re-resolves every alias after the alias definitions changed
+ *	 (importEnv) -- loads the process environment into the variable store on first use
+ *	 (varChanged) -- bumps the generations a variable change affects
+ *	 (lookupPasswd) -- looks a user up with getpwnam_r (getpwuid_r for an empty name), uncached
  *
  * Members:
- *	 prompt -- the shell prompt string
- *	 (aliases) -- map of aliases & aliased commands
- *	 (builtInCmds) -- map of built-in cmd names and associated class instances
+ *	 prompt -- the shell prompt string; change it with setPrompt so the change is saved
+ *	 batchMode -- what to do with commands exceeding ARG_MAX: refuse, or run them in batches in sequence or in parallel
+ *	 autoPlacement -- true to pack the stages of each pipeline onto one NUMA node (set placement auto)
+ *	 jobLimits -- resource limits of every job, set with the limit builtin; the limit prefix overrides them
+ *	 cmdTimeout -- seconds every job may run (set cmdtimeout); 0 for no limit. The timeout prefix overrides it
+ *	 killGrace -- seconds between SIGTERM and SIGKILL of a job that timed out (set killgrace)
+ *	 pipeStat -- whether the pipes of every pipeline are relayed and measured (set pipestat); the pipestat prefix overrides it
+ *	 interactive -- false for -c and script input; settings changes are then never written out
+ *	 lastStatus -- exit status of the last command, expanded for $?
+ *	 (aliasDefs) -- map of aliases & aliased commands, as defined by the user
+ *	 (aliases) -- hash table of aliases & their fully resolved, pre-tokenized words
+ *	 (builtInCmds) -- built-in class instances, indexed by built-in id and created on first use
  *	 (runtime) -- self-reference to singleton instance
  *	 (cmdHistory) -- this holds all previous commands entered in the session
  *	 (newPaths) -- new paths added to default PATH this session
  *	 (shellHomeDir) -- the original default working directory of the shell on startup
+ *	 (vars) -- map of shell variable names & values
+ *	 (envStrings), (envp) -- "NAME=value" strings of exported variables, and the NULL terminated array pointing into them
+ *	 (envDirty) -- true if envStrings and envp no longer match vars
+ *	 (envBytes) -- size of envp for getEnvBytes, counted when it is rebuilt
+ *	 (varsLoaded) -- true once the process environment has been imported into vars
+ *	 (cwd) -- the current working directory
+ *	 (settingsDirty) -- true if aliases, prompt or paths changed since the settings file was written
+ *	 (loadingSettings) -- true while settings are being loaded, so loading does not count as a change
+ *	 (journalOn) -- true if settings changes are appended to the journal instead of rewriting the settings file
+ *	 (generations) -- state generation counters, indexed by Generation
+ *	 (planCache) -- parsed-plan cache used by Scanner
+ *	 (outputCache) -- store of pipeline outputs memoized with the cache prefix
+ *	 (spawner) -- helper process that launches commands, when it is turned on
+ *	 (metrics) -- counters and latency histograms of the session, shown by the stats builtin
+ *	 (results) -- writes a JSON line per executed pipeline, with --json-results
+ *	 (passwdCache) -- user name -> home directory lookups, with an expiry time; guarded by passwdLock
+ *	 (homeDir), (homeGen) -- the current user's home directory, and the GEN_ENV generation it was found under
+ *	 (functions) -- script functions by name
+ *	 (positional), (callDepth) -- arguments of the running function, and how many function calls are running
  *
  */
 class Runtime {
@@ -299,9 +1362,18 @@ public:
 	void loadSettingsFile();
 	bool writeSettingsFile();
 	BuiltInI* getBuiltIn(std::string* cmd);
+	BuiltInI* getBuiltIn(int id);
 	std::string prompt;
+	BatchMode batchMode;
+	bool autoPlacement;
+	Limits jobLimits;
+	double cmdTimeout;
+	double killGrace;
+	PipeStatMode pipeStat;
+	bool interactive;
+	int lastStatus;
 	static Runtime* getRuntime();
-	void expandAlias(std::string* cmd);
+	void expandAlias(std::vector<std::string>* args);
 	bool isBuiltIn(std::string* cmd);
 	void printBuiltIn();
 	void printAlias();
@@ -311,17 +1383,152 @@ public:
 	void addToHistory(std::string cmd);
 	bool completeCommand(std::string* cmd);
 	bool addToPath(std::string path);
+	bool getVar(const std::string& name, std::string* value);
+	void setVar(const std::string& name, const std::string& value, bool exported);
+	bool exportVar(const std::string& name);
+	bool unsetVar(const std::string& name);
+	void printVars();
+	char** getEnvp();
+	size_t getEnvBytes();
+	const std::string& getCwd();
+	bool changeDir(std::string* dir);
+	void setPrompt(std::string val);
+	bool setJournal(bool on);
+	bool isJournalOn();
+	unsigned long generation(Generation gen);
+	PlanCache* getPlanCache();
+	OutputCache* getOutputCache();
+	Spawner* getSpawner();
+	bool setSpawner(bool on);
+	Metrics* getMetrics();
+	ResultLog* getResults();
+	bool getUserHome(const std::string& user, std::string* home);
+	void defineFunction(const std::string& name, const ShellFunction& fn);
+	bool isFunction(const std::string& name);
+	int callFunction(std::vector<std::string>* args);
 private:
 	Runtime();
 	static Runtime* runtime;
+	std::map<std::string,ShellVar> vars;
+	std::vector<std::string> envStrings;
+	std::vector<char*> envp;
+	bool envDirty;
+	size_t envBytes;
+	bool varsLoaded;
+	std::string cwd;
+	bool settingsDirty;
+	bool loadingSettings;
+	bool journalOn;
+	void importEnv();
+	void varChanged(const std::string& name);
+	unsigned long generations[GEN_COUNT];
+	PlanCache planCache;
+	OutputCache outputCache;
+	Spawner spawner;
+	Metrics metrics;
+	ResultLog results;
+	std::unordered_map<std::string,PasswdEntry> passwdCache;
+	pthread_mutex_t passwdLock;
+	std::string homeDir;
+	unsigned long homeGen;
+	std::unordered_map<std::string,ShellFunction> functions;
+	std::vector<std::string> positional;
+	int callDepth;
+	bool lookupPasswd(const std::string& user, std::string* home);
+	void markSettingsChanged(std::string record);
+	bool journalSetting(std::string record);
+	bool compactJournal();
 	std::vector<std::string> cmdHistory;
 	std::vector<std::string> newPaths;
-	void initBuiltIn();
-	std::map<std::string,std::string> aliases;
-	std::map<std::string,BuiltInI*> builtInCmds;
+	std::map<std::string,std::string> aliasDefs;
+	std::unordered_map<std::string,std::vector<std::string> > aliases;
+	bool resolveAlias(const std::string& word, std::vector<std::string>* words);
+	void rebuildAliases();
+	std::vector<BuiltInI*> builtInCmds;
 	std::string shellHomeDir;
 };
 
+/**
+ * Struct GlobAtom
+ * One compiled element of a GlobPattern.
+ *
+ * Members:
+ *	 type -- LITERAL (a run of plain characters), ANY (?), STAR (*) or CLASS ([...])
+ *	 text -- the characters of a LITERAL atom
+ *	 set -- 256 bit membership map of a CLASS atom
+ */
+struct GlobAtom {
+	enum AtomType { LITERAL, ANY, STAR, CLASS };
+	AtomType type;
+	std::string text;
+	unsigned char set[32];
+};
+
+/**
+ * Class GlobPattern
+ * This holds a single path component of a glob pattern (no '/'), compiled once into GlobAtoms.
+ * Common shapes (*, literal, *.ext) are recognized at compile time and matched without walking the atoms.
+ *
+ * Members:
+ *	 (atoms) -- compiled pattern
+ *	 (kind) -- the shape of the pattern, used to pick a fast matching path
+ *	 (literal) -- the literal text (MATCH_LITERAL) or suffix (MATCH_SUFFIX) of the pattern
+ *	 (dotOk) -- true if the pattern itself starts with '.', so hidden names may match
+ *
+ * Methods:
+ *	 match -- true if a file name matches the pattern
+ *	 isLiteral -- true if the pattern has no magic characters
+ *	 isRecursive -- true if the pattern is "**"
+ *	 getLiteral -- the literal text of a literal pattern
+ */
+class GlobPattern {
+public:
+	GlobPattern(std::string pattern);
+	bool match(const char* name, size_t len) const;
+	bool isLiteral() const;
+	bool isRecursive() const;
+	const std::string& getLiteral() const;
+private:
+	enum MatchKind { MATCH_ALL, MATCH_LITERAL, MATCH_SUFFIX, MATCH_RECURSIVE, MATCH_GENERAL };
+	std::vector<GlobAtom> atoms;
+	MatchKind kind;
+	std::string literal;
+	bool dotOk;
+	bool matchAtoms(const char* name, size_t len) const;
+};
+
+/**
+ * Class Glob
+ * This expands a pathname pattern containing *, ?, [...] and ** into the sorted list of matching paths.
+ * Directories are read with large getdents64 buffers and d_type is used to avoid stat calls;
+ * a ** component is walked by a pool of threads.
+ *
+ * Members:
+ *	 (absolute) -- true if the pattern starts with '/'
+ *	 (dirOnly) -- true if the pattern ends with '/', so only directories match
+ *	 (parts) -- compiled pattern for each path component
+ *	 (dirBuf) -- getdents64 buffer used while matching the non-recursive components
+ *
+ * Methods:
+ *	 hasMagic -- true if a word contains glob characters and should be expanded
+ *	 expand -- appends the sorted matches to results; returns false if nothing matched
+ *	 (expandFrom) -- matches parts[idx..] below the directory base
+ *	 (walk) -- recursive, parallel directory walk used for **
+ */
+class Glob {
+public:
+	Glob(std::string pattern);
+	static bool hasMagic(std::string* word);
+	bool expand(std::vector<std::string>* results);
+private:
+	bool absolute;
+	bool dirOnly;
+	std::vector<GlobPattern> parts;
+	std::vector<char> dirBuf;
+	void expandFrom(size_t idx, std::string base, std::vector<std::string>* out);
+	void walk(std::string base, const GlobPattern* leaf, std::vector<std::string>* out);
+};
+
 /**
  * Utility Methods
  */
@@ -338,5 +1545,14 @@ std::string getPwd();
 void escapeString(std::string* str, std::string token);
 bool chDir(std::string* newdir);
 void exitCleanup();
+bool parseDuration(const std::string& str, double* seconds);
+std::string formatSeconds(double s);
+void sortStrings(std::vector<std::string>* v);
+void closeFrom(int lowfd);
+bool writeFileAtomic(const std::string& path, const std::string& data);
+bool copyFile(int in, int out);
+void murmur3(const void* data, size_t len, uint64_t out[2]);
+void bufferOutput();
+void flushOutput();
 
 #endif /* OOPSHELL_H_ */
@@ -0,0 +1,361 @@
+#include "OopShell.h"
+
+#include <algorithm>
+#include <iostream> // for cout, endl
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// default size limit of the store
+static const unsigned long long OUTPUT_CACHE_LIMIT = 256ULL<<20;
+
+/**
+ * Formats a 128 bit hash as 32 hex digits, the name of its file in the store.
+ */
+static string hashName(const uint64_t hash[2]) {
+	char buf[33];
+	snprintf(buf,sizeof(buf),"%016llx%016llx",(unsigned long long)hash[0],(unsigned long long)hash[1]);
+	return buf;
+}
+
+/**
+ * Appends the identity of a file to key material: device, inode, size and modification time.
+ * Rewriting the file, or replacing it with another, changes one of them.
+ */
+static void appendFileId(const struct stat& st, string* material) {
+	uint64_t id[5] = { (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+			(uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec };
+	(*material).append((const char*)id,sizeof(id));
+}
+
+/**
+ * @return true if the shell's stdin is /dev/null, which a pipeline without < can be keyed without;
+ * a terminal is not, the first stage may read what is typed into it
+ */
+static bool stdinIsFixed() {
+	struct stat in, null;
+	return fstat(STDIN_FILENO,&in)==0 && stat("/dev/null",&null)==0 && S_ISCHR(in.st_mode)
+			&& in.st_rdev==null.st_rdev;
+}
+
+/**
+ * Creates a directory if it does not exist yet.
+ */
+static bool makeDir(const string& path) {
+	return mkdir(path.c_str(),0755)==0 || errno==EEXIST;
+}
+
+/**
+ * Constructor for OutputCache.
+ */
+OutputCache::OutputCache() {
+	limit = OUTPUT_CACHE_LIMIT;
+	hits = 0;
+	misses = 0;
+	failed = 0;
+	evicted = 0;
+	replayed = 0;
+}
+
+/**
+ * Sets the directory holding the store. It is only created once an output is stored.
+ *
+ * @param diri -- store directory
+ */
+void OutputCache::setStore(const string& diri) {
+	dir = diri;
+}
+
+/**
+ * Runs a CommandList through the cache.
+ * On a hit the stored output is replayed and nothing runs. On a miss the pipeline runs with its last
+ * stage writing to a file in the store, which is then replayed and, if the run succeeded, kept.
+ * A pipeline that can not be keyed, e.g. because a command or the input file is missing, runs uncached.
+ * A hit writes its --json-results line here, since no Executor runs.
+ *
+ * @param plan -- the parsed line; its memoize flag is set
+ * @return exit status of the pipeline; 0 for a hit
+ */
+int OutputCache::run(CommandList* plan) {
+	uint64_t start = Trace::now();
+	CommandList uncached = *plan;
+	uncached.memoize = false;
+	string key;
+	if (!makeKey(plan,&key)) {
+		Executor executor(&uncached);
+		return executor.run();
+	}
+	string keyPath = dir+"/keys/"+key;
+	int fd = open(keyPath.c_str(),O_RDONLY|O_CLOEXEC);
+	if (fd>=0) {
+		// mark the object used, for eviction
+		futimens(fd,NULL);
+		bool ok = replay(fd,*plan);
+		close(fd);
+		if (!ok)
+			return 1;
+		hits++;
+		Runtime::getRuntime()->getResults()->record(*plan,plan,0,0,false,true,(Trace::now()-start)/1e9);
+		return 0;
+	}
+	// the link of an evicted object
+	if (errno==ENOENT)
+		unlink(keyPath.c_str());
+	misses++;
+	string tmpPath = dir+"/tmp.XXXXXX";
+	vector<char> tmpName(tmpPath.begin(),tmpPath.end());
+	tmpName.push_back('\0');
+	if (!makeDir(dir) || !makeDir(dir+"/keys") || !makeDir(dir+"/objects")
+			|| (fd = mkostemp(&tmpName[0],O_CLOEXEC))<0) {
+		Executor executor(&uncached);
+		return executor.run();
+	}
+	tmpPath = &tmpName[0];
+	// the last stage writes to the store; this fd keeps the output readable once it is renamed
+	uncached.outputFile = tmpPath;
+	uncached.cmdV.back().outputType = FILEIO;
+	int status;
+	{
+		Executor executor(&uncached);
+		executor.reportAs(plan);
+		status = executor.run();
+	}
+	if (!replay(fd,*plan))
+		status = 1;
+	if (status!=0 || !store(fd,tmpPath,key)) {
+		failed++;
+		unlink(tmpPath.c_str());
+	}
+	close(fd);
+	return status;
+}
+
+/**
+ * Hashes everything the output of a pipeline depends on: the cwd, the argv and executable of every stage,
+ * the < input file and the variables named with cache -e.
+ * Without <, the first stage reads the shell's stdin, which can not be hashed: such a line is only keyed
+ * if stdin is /dev/null, and not when it is a terminal or e.g. a pipe into a script.
+ *
+ * @param plan -- the parsed line; executable paths not resolved yet are resolved
+ * @param key -- receives the hash, as the name of its link in the store
+ * @return false if an executable or the input file was not found, or the line reads a stdin that may change
+ */
+bool OutputCache::makeKey(CommandList* plan, string* key) {
+	if ((*plan).inputFile.size()==0 && !stdinIsFixed())
+		return false;
+	Runtime* runtime = Runtime::getRuntime();
+	string material = (*runtime).getCwd();
+	material.push_back('\0');
+	struct stat st;
+	for (size_t i=0;i<(*plan).cmdV.size();i++) {
+		Command* cmd = &(*plan).cmdV[i];
+		if ((*cmd).args[0].find('/')==string::npos && (*cmd).execPath.size()==0)
+			(*cmd).resolvePath();
+		const string& path = (*cmd).args[0].find('/')!=string::npos ? (*cmd).args[0] : (*cmd).execPath;
+		if (path.size()==0 || stat(path.c_str(),&st)!=0)
+			return false;
+		appendFileId(st,&material);
+		for (size_t a=0;a<(*cmd).args.size();a++) {
+			material.append((*cmd).args[a]);
+			material.push_back('\0');
+		}
+		material.push_back('|');
+	}
+	if ((*plan).inputFile.size()>0) {
+		if (stat((*plan).inputFile.c_str(),&st)!=0)
+			return false;
+		material.push_back('<');
+		appendFileId(st,&material);
+	}
+	for (size_t i=0;i<(*plan).memoEnv.size();i++) {
+		string value;
+		material.append((*plan).memoEnv[i]);
+		// an unset variable differs from an empty one
+		if ((*runtime).getVar((*plan).memoEnv[i],&value))
+			material.append("="+value);
+		material.push_back('\0');
+	}
+	uint64_t hash[2];
+	murmur3(material.data(),material.size(),hash);
+	*key = hashName(hash);
+	return true;
+}
+
+/**
+ * Copies an output to where the pipeline would have written it: its > file, or stdout.
+ *
+ * @param fd -- the stored output
+ * @param plan -- the parsed line
+ * @return false if the > file could not be opened or written
+ */
+bool OutputCache::replay(int fd, const CommandList& plan) {
+	int out = STDOUT_FILENO;
+	if (plan.outputFile.size()>0) {
+		out = open(plan.outputFile.c_str(),O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC,0666);
+		if (out<0) {
+			cout << "Could not open output file " << plan.outputFile << endl;
+			return false;
+		}
+	}
+	// anything the shell buffered comes first
+	else flushOutput();
+	struct stat st;
+	bool ok = fstat(fd,&st)==0 && copyFile(fd,out);
+	if (ok)
+		replayed += st.st_size;
+	if (out!=STDOUT_FILENO)
+		close(out);
+	return ok;
+}
+
+/**
+ * Moves the output of a successful run into the store: the file is named by the hash of its contents,
+ * and the key is linked to it. Outputs larger than the whole store are not kept.
+ * An object whose key could not be linked stays in the store until it is evicted, as another key may link to it.
+ *
+ * @param fd -- the output file, open for reading
+ * @param tmpPath -- its name in the store directory
+ * @param key -- the run's key
+ * @return true if the output was stored
+ */
+bool OutputCache::store(int fd, const string& tmpPath, const string& key) {
+	struct stat st;
+	if (fstat(fd,&st)!=0 || (unsigned long long)st.st_size>limit)
+		return false;
+	uint64_t hash[2];
+	if (st.st_size>0) {
+		void* data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (data==MAP_FAILED)
+			return false;
+		murmur3(data,st.st_size,hash);
+		munmap(data,st.st_size);
+	}
+	else murmur3("",0,hash);
+	string object = hashName(hash);
+	if (rename(tmpPath.c_str(),(dir+"/objects/"+object).c_str())!=0)
+		return false;
+	// replace the link atomically, so a shell running beside this one never sees it missing
+	string linkTmp = dir+"/keys/."+key+"."+std::to_string(getpid());
+	unlink(linkTmp.c_str());
+	if (symlink(("../objects/"+object).c_str(),linkTmp.c_str())!=0
+			|| rename(linkTmp.c_str(),(dir+"/keys/"+key).c_str())!=0) {
+		unlink(linkTmp.c_str());
+		return false;
+	}
+	evict();
+	return true;
+}
+
+/**
+ * Deletes the least recently replayed or stored objects until the store fits in limit.
+ * Links to deleted objects are removed too.
+ */
+void OutputCache::evict() {
+	struct Object {
+		time_t used;
+		off_t size;
+		string name;
+		bool operator<(const Object& o) const { return used<o.used; }
+	};
+	string objects = dir+"/objects";
+	DIR* d = opendir(objects.c_str());
+	if (d==NULL)
+		return;
+	vector<Object> all;
+	unsigned long long total = 0;
+	struct dirent* e;
+	struct stat st;
+	while ((e = readdir(d))!=NULL) {
+		if (e->d_name[0]=='.' || fstatat(dirfd(d),e->d_name,&st,0)!=0)
+			continue;
+		Object o = { st.st_mtime, st.st_size, e->d_name };
+		all.push_back(o);
+		total += st.st_size;
+	}
+	if (total<=limit) {
+		closedir(d);
+		return;
+	}
+	std::sort(all.begin(),all.end());
+	for (size_t i=0;i<all.size() && total>limit;i++) {
+		if (unlinkat(dirfd(d),all[i].name.c_str(),0)==0) {
+			total -= all[i].size;
+			evicted++;
+		}
+	}
+	closedir(d);
+	// drop the links that now point nowhere
+	string keys = dir+"/keys";
+	d = opendir(keys.c_str());
+	if (d==NULL)
+		return;
+	while ((e = readdir(d))!=NULL)
+		if (e->d_name[0]!='.' && fstatat(dirfd(d),e->d_name,&st,0)!=0 && errno==ENOENT)
+			unlinkat(dirfd(d),e->d_name,0);
+	closedir(d);
+}
+
+/**
+ * Deletes every stored output and its link. The counters are kept.
+ */
+void OutputCache::clear() {
+	const char* subdirs[] = { "/keys", "/objects" };
+	for (size_t i=0;i<2;i++) {
+		DIR* d = opendir((dir+subdirs[i]).c_str());
+		if (d==NULL)
+			continue;
+		struct dirent* e;
+		while ((e = readdir(d))!=NULL)
+			if (strcmp(e->d_name,".")!=0 && strcmp(e->d_name,"..")!=0)
+				unlinkat(dirfd(d),e->d_name,0);
+		closedir(d);
+	}
+}
+
+/**
+ * Prints the number and size of stored outputs, and the hit rate, to stdout.
+ */
+void OutputCache::printStats() {
+	unsigned long objects = 0;
+	unsigned long long bytes = 0;
+	DIR* d = opendir((dir+"/objects").c_str());
+	if (d!=NULL) {
+		struct dirent* e;
+		struct stat st;
+		while ((e = readdir(d))!=NULL) {
+			if (e->d_name[0]!='.' && fstatat(dirfd(d),e->d_name,&st,0)==0) {
+				objects++;
+				bytes += st.st_size;
+			}
+		}
+		closedir(d);
+	}
+	unsigned long lookups = hits+misses;
+	cout << "outputs: " << objects << " stored, " << (bytes+1023)/1024 << "KB of " << (limit>>20) << "MB";
+	cout << endl << "output hits: " << hits << ", misses: " << misses;
+	if (lookups>0)
+		cout << " (" << (hits*100+lookups/2)/lookups << "% hit rate)";
+	cout << endl << "replayed: " << (replayed+1023)/1024 << "KB, not stored: " << failed
+		 << ", evicted: " << evicted << endl;
+}
+
+/**
+ * @param hitCount -- receives the number of runs replayed from the store
+ * @param missCount -- receives the number of runs that had to run
+ */
+void OutputCache::counts(unsigned long* hitCount, unsigned long* missCount) {
+	*hitCount = hits;
+	*missCount = misses;
+}
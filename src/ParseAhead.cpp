@@ -0,0 +1,139 @@
+#include "OopShell.h"
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+using std::string;
+using std::vector;
+
+// the parser thread stays at most this many lines ahead of the Executor
+static const size_t PARSE_AHEAD_LINES = 64;
+
+/**
+ * Constructor for ParseAhead. Starts the parser thread.
+ *
+ * @param readeri -- source of script lines; only the parser thread reads it
+ */
+ParseAhead::ParseAhead(LineReader* readeri) {
+	reader = readeri;
+	current = NULL;
+	pushed = 0;
+	completed = 0;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	// the variable store is imported lazily; do it now, before two threads can reach it
+	Runtime::getRuntime()->getEnvp();
+	// without a thread, next parses each line on the calling thread when it is asked for
+	threaded = pthread_create(&thread, NULL, run, this)==0;
+}
+
+/**
+ * Destructor for ParseAhead. Waits for the parser thread, which stops after queuing end of input.
+ */
+ParseAhead::~ParseAhead() {
+	if (threaded)
+		pthread_join(thread, NULL);
+	delete current;
+	for (size_t i=0;i<queue.size();i++)
+		delete queue[i].first;
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void* ParseAhead::run(void* arg) {
+	((ParseAhead*)arg)->parseLoop();
+	return NULL;
+}
+
+/**
+ * Waits for the next parsed line.
+ *
+ * @param scanner -- receives the Scanner holding the line; it belongs to ParseAhead
+ * @return true if the line parsed; otherwise the Scanner holds ERROR_MSG, or readEOF at end of input
+ */
+bool ParseAhead::next(Scanner** scanner) {
+	if (!threaded) {
+		current = new Scanner();
+		*scanner = current;
+		return (*current).readLine(reader);
+	}
+	pthread_mutex_lock(&lock);
+	while (queue.empty())
+		pthread_cond_wait(&cond, &lock);
+	current = queue.front().first;
+	bool parsed = queue.front().second;
+	queue.pop_front();
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	*scanner = current;
+	return parsed;
+}
+
+/**
+ * Marks the line returned by next as finished, and frees it.
+ * A parser waiting for the Executor to go quiescent may continue.
+ */
+void ParseAhead::done() {
+	delete current;
+	current = NULL;
+	if (!threaded)
+		return;
+	pthread_mutex_lock(&lock);
+	completed++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Waits until every line queued so far has finished executing.
+ */
+void ParseAhead::waitQuiescent() {
+	pthread_mutex_lock(&lock);
+	while (completed<pushed)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Parser thread: reads and parses lines until end of input, queuing each with its parse result.
+ * End of input is queued as a Scanner with readEOF set.
+ */
+void ParseAhead::parseLoop() {
+	Trace::nameThread("parser");
+	string line;
+	bool eof = false;
+	while (!eof) {
+		Scanner* scanner = new Scanner();
+		bool parsed = false;
+		bool barrier = false;
+		eof = !(*reader).nextCommand(&line);
+		if (eof)
+			(*scanner).readEOF = true;
+		else {
+			// glob results depend on files earlier commands may still be creating, and $? on their status
+			if (line.find_first_of("*?[")!=string::npos)
+				waitQuiescent();
+			// a block is only scanned here; it is expanded as it runs, and may change anything
+			if (Scanner::startsBlock(line)) {
+				parsed = (*scanner).readBlock(line,reader);
+				barrier = true;
+			}
+			else parsed = (*scanner).parse(line);
+			// a builtin or function may change aliases, variables or the cwd, which the next line's parse depends on
+			vector<Command>& cmdV = (*scanner).input.cmdV;
+			for (size_t i=0;parsed && i<cmdV.size();i++)
+				if (cmdV[i].builtIn || cmdV[i].function)
+					barrier = true;
+		}
+		pthread_mutex_lock(&lock);
+		while (queue.size()>=PARSE_AHEAD_LINES)
+			pthread_cond_wait(&cond, &lock);
+		queue.push_back(std::make_pair(scanner,parsed));
+		pushed++;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		if (barrier)
+			waitQuiescent();
+	}
+}
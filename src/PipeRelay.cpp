@@ -0,0 +1,305 @@
+#include "OopShell.h"
+
+#include <iostream> // for cout, endl
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h> // for splice
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h> // for snprintf
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h> // for FIONREAD
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// most a single splice asks for; a pipe holds far less, so this just means "all there is"
+static const size_t SPLICE_CHUNK = 1<<20;
+
+/**
+ * Seconds from one time to another.
+ */
+static double elapsed(const struct timespec& from, const struct timespec& to) {
+	return (to.tv_sec-from.tv_sec)+(to.tv_nsec-from.tv_nsec)/1e9;
+}
+
+/**
+ * Percentage of part in whole, 0 if whole is empty.
+ */
+static double percent(double part, double whole) {
+	return whole>0 ? 100*part/whole : 0;
+}
+
+/**
+ * Constructor for PipeRelay. It has no links and no thread until addLink and start.
+ */
+PipeRelay::PipeRelay() {
+	running = false;
+	stopFd = -1;
+	live = false;
+	began.tv_sec = 0;
+	began.tv_nsec = 0;
+	ended = began;
+}
+
+/**
+ * Destructor for PipeRelay. Stops the thread, and closes links that were never relayed.
+ */
+PipeRelay::~PipeRelay() {
+	stop();
+	for (size_t i=0;i<links.size();i++) {
+		if (links[i].in>=0) close(links[i].in);
+		if (links[i].out>=0) close(links[i].out);
+	}
+	if (stopFd>=0)
+		close(stopFd);
+}
+
+/**
+ * Adds a link to relay. Both fds are made non-blocking; they belong to the relay from now on.
+ *
+ * @param in -- read end of the pipe the stage before writes to
+ * @param out -- write end of the pipe the stage after reads from
+ * @param name -- shown for the link in the reports
+ */
+void PipeRelay::addLink(int in, int out, const string& name) {
+	Link link;
+	link.name = name;
+	link.in = in;
+	link.out = out;
+	link.bytes = 0;
+	link.bytesReported = 0;
+	link.empty = 0;
+	link.full = 0;
+	link.emptyReported = 0;
+	link.fullReported = 0;
+	link.state = LINK_EMPTY;
+	link.since = began;
+	link.closed = began;
+	fcntl(in,F_SETFL,fcntl(in,F_GETFL)|O_NONBLOCK);
+	fcntl(out,F_SETFL,fcntl(out,F_GETFL)|O_NONBLOCK);
+	links.push_back(link);
+}
+
+/**
+ * Starts relaying the links. Every link starts out empty, waiting for the stage before it.
+ *
+ * @param livei -- true to write a line with the throughput of each link to stderr every second
+ * @return true if the thread was started, or there is nothing to relay
+ */
+bool PipeRelay::start(bool livei) {
+	if (links.size()==0)
+		return true;
+	live = livei;
+	clock_gettime(CLOCK_MONOTONIC,&began);
+	for (size_t i=0;i<links.size();i++)
+		links[i].since = began;
+	if (stopFd<0)
+		stopFd = eventfd(0,EFD_CLOEXEC);
+	if (stopFd<0)
+		return false;
+	running = pthread_create(&thread,NULL,run,this)==0;
+	return running;
+}
+
+/**
+ * Stops the thread, and closes the links it did not close yet.
+ * Once every stage exited there is nothing left to move, so this does not lose data.
+ *
+ * @return true if the relay was running
+ */
+bool PipeRelay::stop() {
+	if (!running)
+		return false;
+	uint64_t one = 1;
+	if (write(stopFd,&one,sizeof(one))<0) {}
+	pthread_join(thread,NULL);
+	running = false;
+	clock_gettime(CLOCK_MONOTONIC,&ended);
+	for (size_t i=0;i<links.size();i++) {
+		Link* link = &links[i];
+		if ((*link).state==LINK_CLOSED)
+			continue;
+		setState(link,LINK_CLOSED,ended);
+		close((*link).in);
+		close((*link).out);
+		(*link).in = -1;
+		(*link).out = -1;
+	}
+	return true;
+}
+
+/**
+ * Prints what went through each link, its throughput over the time it was open,
+ * and the share of that time it was empty, waiting for the stage before it to write,
+ * or full, waiting for the stage after it to read.
+ */
+void PipeRelay::print() {
+	char line[256];
+	snprintf(line,sizeof(line),"%-24s %14s %9s %6s %6s","link","bytes","MB/s","empty","full");
+	cout << line << endl;
+	for (size_t i=0;i<links.size();i++) {
+		const Link& link = links[i];
+		double open = elapsed(began,link.closed);
+		snprintf(line,sizeof(line),"%-24.24s %14llu %9.1f %5.1f%% %5.1f%%",link.name.c_str(),link.bytes,
+				open>0 ? link.bytes/1048576.0/open : 0,percent(link.empty,open),percent(link.full,open));
+		cout << line << endl;
+	}
+}
+
+void* PipeRelay::run(void* arg) {
+	((PipeRelay*)arg)->relayLoop();
+	return NULL;
+}
+
+/**
+ * The relay thread. Signals are left to the main thread; a splice to a pipe whose reader is gone
+ * then fails with EPIPE instead of raising SIGPIPE.
+ * An empty link waits for its input to become readable, a full one for its output to become writable.
+ * The output of an empty link is polled too, for the error poll reports once the stage after it exited;
+ * the input of a full link is not, since it would report a hang up over and over once the stage before it exited.
+ * The thread ends when every link is closed, or it is stopped.
+ */
+void PipeRelay::relayLoop() {
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK,&all,NULL);
+	vector<struct pollfd> fds(1+2*links.size());
+	struct timespec now, last = began;
+	for (;;) {
+		fds[0].fd = stopFd;
+		fds[0].events = POLLIN;
+		size_t open = 0;
+		for (size_t i=0;i<links.size();i++) {
+			struct pollfd* in = &fds[1+2*i];
+			struct pollfd* out = &fds[2+2*i];
+			const Link& link = links[i];
+			// a negative fd is skipped by poll
+			(*in).fd = link.state==LINK_EMPTY ? link.in : -1;
+			(*in).events = POLLIN;
+			(*out).fd = link.state==LINK_CLOSED ? -1 : link.out;
+			(*out).events = link.state==LINK_FULL ? POLLOUT : 0;
+			if (link.state!=LINK_CLOSED)
+				open++;
+		}
+		if (open==0)
+			break;
+		int wait = -1;
+		if (live) {
+			clock_gettime(CLOCK_MONOTONIC,&now);
+			wait = (int)((1-elapsed(last,now))*1000);
+			if (wait<0) wait = 0;
+		}
+		int n = poll(&fds[0],fds.size(),wait);
+		if (n<0 && errno!=EINTR)
+			break;
+		if (n>0 && fds[0].revents!=0)
+			break;
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		for (size_t i=0;n>0 && i<links.size();i++) {
+			short inEvents = fds[1+2*i].fd>=0 ? fds[1+2*i].revents : 0;
+			short outEvents = fds[2+2*i].fd>=0 ? fds[2+2*i].revents : 0;
+			Link* link = &links[i];
+			if (outEvents & POLLERR) {
+				// the stage after exited: closing the input gives the stage before EPIPE, as a plain pipe would
+				setState(link,LINK_CLOSED,now);
+				close((*link).in);
+				close((*link).out);
+				(*link).in = -1;
+				(*link).out = -1;
+			}
+			else if (inEvents!=0 || outEvents!=0)
+				move(link,now);
+		}
+		if (live && elapsed(last,now)>=1) {
+			report(now,last);
+			last = now;
+		}
+	}
+}
+
+/**
+ * Splices a link until it would block, and notes what it waits for then:
+ * data left in its input means the stage after it does not read, none means the stage before it does not write.
+ * End of input, or a stage after it that exited, closes the link.
+ *
+ * @param link -- the link to move
+ * @param now -- when the poll woke up; the time until then is counted to the state the link was in
+ */
+void PipeRelay::move(Link* link, const struct timespec& now) {
+	setState(link,LINK_MOVING,now);
+	ssize_t n;
+	for (;;) {
+		n = splice((*link).in,NULL,(*link).out,NULL,SPLICE_CHUNK,SPLICE_F_NONBLOCK|SPLICE_F_MOVE);
+		if (n>0)
+			(*link).bytes += n;
+		else if (n<0 && errno!=EINTR)
+			break;
+		else if (n==0)
+			break;
+	}
+	struct timespec moved;
+	clock_gettime(CLOCK_MONOTONIC,&moved);
+	if (n<0 && errno==EAGAIN) {
+		int queued = 0;
+		if (ioctl((*link).in,FIONREAD,&queued)<0)
+			queued = 0;
+		setState(link,queued>0 ? LINK_FULL : LINK_EMPTY,moved);
+		return;
+	}
+	// closing the output sends end of file on to the stage after
+	setState(link,LINK_CLOSED,moved);
+	close((*link).in);
+	close((*link).out);
+	(*link).in = -1;
+	(*link).out = -1;
+}
+
+/**
+ * Counts the time since a link's state began to its totals, and starts the next state.
+ * Setting the same state again brings the totals up to date.
+ */
+void PipeRelay::setState(Link* link, LinkState state, const struct timespec& now) {
+	double d = elapsed((*link).since,now);
+	if ((*link).state==LINK_EMPTY)
+		(*link).empty += d;
+	else if ((*link).state==LINK_FULL)
+		(*link).full += d;
+	if ((*link).state!=LINK_CLOSED)
+		(*link).since = now;
+	if (state==LINK_CLOSED && (*link).state!=LINK_CLOSED)
+		(*link).closed = now;
+	(*link).state = state;
+}
+
+/**
+ * Writes one line to stderr with each link's throughput since the last line, and the share of that time
+ * it was empty and full. It is written with a single write, so it does not mix with the shell's output buffer.
+ */
+void PipeRelay::report(const struct timespec& now, const struct timespec& last) {
+	double span = elapsed(last,now);
+	string out = "pipestat:";
+	char part[128];
+	for (size_t i=0;i<links.size();i++) {
+		Link* link = &links[i];
+		if ((*link).state==LINK_CLOSED && (*link).bytesReported==(*link).bytes) {
+			snprintf(part,sizeof(part)," %s%s done",i>0 ? "| " : "",(*link).name.c_str());
+			out += part;
+			continue;
+		}
+		setState(link,(*link).state,now);
+		snprintf(part,sizeof(part)," %s%s %.1fMB/s empty %.0f%% full %.0f%%",i>0 ? "| " : "",(*link).name.c_str(),
+				((*link).bytes-(*link).bytesReported)/1048576.0/span,percent((*link).empty-(*link).emptyReported,span),
+				percent((*link).full-(*link).fullReported,span));
+		out += part;
+		(*link).bytesReported = (*link).bytes;
+		(*link).emptyReported = (*link).empty;
+		(*link).fullReported = (*link).full;
+	}
+	out += "\n";
+	if (write(STDERR_FILENO,out.data(),out.size())<0) {}
+}
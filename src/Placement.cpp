@@ -0,0 +1,256 @@
+#include "OopShell.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h> // for setpriority
+#include <sys/syscall.h>  // for SYS_set_mempolicy, SYS_ioprio_set
+#include <linux/mempolicy.h>
+
+using std::string;
+using std::vector;
+
+// ioprio_set arguments, from linux/ioprio.h
+static const int IOPRIO_WHO_PROCESS = 1;
+static const int IOPRIO_CLASS_SHIFT = 13;
+enum { IOPRIO_CLASS_RT=1, IOPRIO_CLASS_BE=2, IOPRIO_CLASS_IDLE=3 };
+
+/**
+ * A NUMA node with CPUs.
+ */
+struct NumaNode {
+	int id;
+	cpu_set_t cpus;
+};
+
+/**
+ * Parses a kernel CPU or node list such as 0-3,8,10-11 into a set.
+ *
+ * @return false if the list is malformed or names a CPU past CPU_SETSIZE
+ */
+static bool parseList(const string& list, cpu_set_t* set) {
+	CPU_ZERO(set);
+	size_t pos = 0;
+	while (pos<list.size()) {
+		size_t end = list.find(',',pos);
+		if (end==string::npos) end = list.size();
+		string item = list.substr(pos,end-pos);
+		char* rest;
+		long from = strtol(item.c_str(),&rest,10);
+		long to = from;
+		if (rest==item.c_str() || from<0)
+			return false;
+		if (*rest=='-') {
+			const char* hi = rest+1;
+			to = strtol(hi,&rest,10);
+			if (rest==hi || to<from)
+				return false;
+		}
+		if (*rest!='\0' || to>=CPU_SETSIZE)
+			return false;
+		for (long c=from;c<=to;c++)
+			CPU_SET(c,set);
+		pos = end+1;
+	}
+	return CPU_COUNT(set)>0;
+}
+
+/**
+ * The NUMA nodes of the machine that have CPUs, read once from sysfs.
+ * Without NUMA information, the CPUs the shell may use count as node 0.
+ */
+static const vector<NumaNode>& numaNodes() {
+	static vector<NumaNode> nodes;
+	static bool loaded = false;
+	if (loaded)
+		return nodes;
+	loaded = true;
+	string online;
+	std::ifstream in("/sys/devices/system/node/online");
+	cpu_set_t ids;
+	if (std::getline(in,online) && parseList(online,&ids)) {
+		for (int id=0;id<CPU_SETSIZE;id++) {
+			if (!CPU_ISSET(id,&ids))
+				continue;
+			std::ifstream cpuIn("/sys/devices/system/node/node"+std::to_string(id)+"/cpulist");
+			string list;
+			NumaNode node;
+			node.id = id;
+			if (std::getline(cpuIn,list) && parseList(list,&node.cpus))
+				nodes.push_back(node);
+		}
+	}
+	if (nodes.size()==0) {
+		NumaNode node;
+		node.id = 0;
+		if (sched_getaffinity(0,sizeof(node.cpus),&node.cpus)==0)
+			nodes.push_back(node);
+	}
+	return nodes;
+}
+
+/**
+ * Parses a whole number within [lo,hi].
+ */
+static bool parseInt(const string& s, int lo, int hi, int* value) {
+	char* rest;
+	long v = strtol(s.c_str(),&rest,10);
+	if (s.size()==0 || *rest!='\0' || v<lo || v>hi)
+		return false;
+	*value = v;
+	return true;
+}
+
+/**
+ * Constructor for Placement. Nothing is set, so the command runs as the shell does.
+ */
+Placement::Placement() {
+	hasCpus = false;
+	CPU_ZERO(&cpus);
+	node = -1;
+	hasNice = false;
+	nice = 0;
+	batch = false;
+	ioprio = -1;
+}
+
+/**
+ * Applies one placement word:
+ * @cpus=list, @node=n, @nice=n, @sched=batch|other, @ioprio=idle|be[,level]|rt[,level]|level
+ * @node also limits the CPUs to those of the node, unless @cpus is given.
+ *
+ * @param word -- the word, starting with @
+ * @param error -- receives the error if the word is not valid
+ * @return true if the word was valid
+ */
+bool Placement::parse(const string& word, string* error) {
+	size_t eq = word.find('=');
+	string name = word.substr(1,eq==string::npos ? string::npos : eq-1);
+	string value = eq==string::npos ? "" : word.substr(eq+1);
+	bool ok = true;
+	if (name=="cpus") {
+		ok = parseList(value,&cpus);
+		hasCpus = ok;
+	}
+	else if (name=="node") {
+		const vector<NumaNode>& nodes = numaNodes();
+		ok = false;
+		int id;
+		for (size_t i=0;i<nodes.size() && parseInt(value,0,CPU_SETSIZE-1,&id);i++) {
+			if (nodes[i].id!=id)
+				continue;
+			node = id;
+			if (!hasCpus) {
+				cpus = nodes[i].cpus;
+				hasCpus = true;
+			}
+			ok = true;
+			break;
+		}
+		if (!ok) {
+			*error = "No NUMA node "+value+" with CPUs.";
+			return false;
+		}
+	}
+	else if (name=="nice") {
+		ok = parseInt(value,-20,19,&nice);
+		hasNice = ok;
+	}
+	else if (name=="sched") {
+		ok = value=="batch" || value=="other";
+		batch = value=="batch";
+	}
+	else if (name=="ioprio") {
+		string cls = value.substr(0,value.find(','));
+		string level = cls.size()<value.size() ? value.substr(cls.size()+1) : "4";
+		int c = cls=="rt" ? IOPRIO_CLASS_RT : cls=="be" ? IOPRIO_CLASS_BE : cls=="idle" ? IOPRIO_CLASS_IDLE : 0;
+		int l = 0;
+		// a bare number is a best-effort level
+		if (c==0 && parseInt(value,0,7,&l))
+			c = IOPRIO_CLASS_BE;
+		else if (c==IOPRIO_CLASS_IDLE)
+			l = 0;
+		else ok = c!=0 && parseInt(level,0,7,&l);
+		if (ok)
+			ioprio = (c<<IOPRIO_CLASS_SHIFT)|l;
+	}
+	else {
+		*error = "Unknown placement "+word+". See help for usage.";
+		return false;
+	}
+	if (!ok)
+		*error = "Invalid placement "+word+". See help for usage.";
+	return ok;
+}
+
+/**
+ * @return true if any placement was given
+ */
+bool Placement::isSet() const {
+	return hasCpus || node>=0 || hasNice || batch || ioprio>=0;
+}
+
+/**
+ * Applies the placement to the calling process. This runs in the child, just before exec.
+ * Every setting is tried, even if one fails.
+ *
+ * @param failed -- receives the names of the settings that could not be applied
+ * @return true if everything was applied
+ */
+bool Placement::apply(string* failed) const {
+	if (hasCpus && sched_setaffinity(0,sizeof(cpus),&cpus)!=0)
+		(*failed).append(" @cpus");
+	if (node>=0) {
+		// memory comes from the node while it has free pages, and from the others after that
+		unsigned long mask[CPU_SETSIZE/(8*sizeof(unsigned long))] = { 0 };
+		mask[node/(8*sizeof(unsigned long))] |= 1UL<<(node%(8*sizeof(unsigned long)));
+		if (syscall(SYS_set_mempolicy,MPOL_PREFERRED,mask,(unsigned long)CPU_SETSIZE)!=0)
+			(*failed).append(" @node");
+	}
+	if (hasNice && setpriority(PRIO_PROCESS,0,nice)!=0)
+		(*failed).append(" @nice");
+	if (batch) {
+		struct sched_param param = { 0 };
+		if (sched_setscheduler(0,SCHED_BATCH,&param)!=0)
+			(*failed).append(" @sched");
+	}
+	if (ioprio>=0 && syscall(SYS_ioprio_set,IOPRIO_WHO_PROCESS,0,ioprio)!=0)
+		(*failed).append(" @ioprio");
+	return (*failed).size()==0;
+}
+
+/**
+ * Places the stages of a pipeline that have no CPUs of their own, for set placement auto.
+ * Adjacent stages go to the same node, so the data in the pipes between them stays on one socket;
+ * a node takes as many stages as it has CPUs before the next node is used.
+ * Each pipeline starts on the node after the one the previous pipeline started on.
+ * A stage only gets a memory node if there are several: with one, or only the CPUs standing in for node 0,
+ * there is nothing to prefer, and set_mempolicy may not even be allowed.
+ *
+ * @param cmds -- the commands of the pipeline
+ */
+void Placement::autoPlace(vector<Command>* cmds) {
+	static size_t nextStart = 0;
+	const vector<NumaNode>& nodes = numaNodes();
+	if (nodes.size()==0)
+		return;
+	size_t n = nextStart++ % nodes.size();
+	int used = 0;
+	for (size_t i=0;i<(*cmds).size();i++) {
+		Placement* p = &(*cmds)[i].placement;
+		if ((*cmds)[i].builtIn || (*cmds)[i].function || (*p).hasCpus)
+			continue;
+		if (used>=CPU_COUNT(&nodes[n].cpus)) {
+			n = (n+1) % nodes.size();
+			used = 0;
+		}
+		(*p).cpus = nodes[n].cpus;
+		(*p).hasCpus = true;
+		if (nodes.size()>1)
+			(*p).node = nodes[n].id;
+		used++;
+	}
+}
@@ -0,0 +1,121 @@
+#include "OopShell.h"
+
+#include <iostream> // for cout, endl
+#include <list>
+#include <string>
+
+using std::cout;
+using std::endl;
+using std::string;
+
+// most plans a cache holds before evicting the least recently used
+static const size_t PLAN_CACHE_ENTRIES = 256;
+
+/**
+ * Constructor for PlanCache.
+ */
+PlanCache::PlanCache() {
+	hits.store(0,std::memory_order_relaxed);
+	misses.store(0,std::memory_order_relaxed);
+	stale.store(0,std::memory_order_relaxed);
+	uncacheable.store(0,std::memory_order_relaxed);
+}
+
+/**
+ * Looks up the plan for a normalized command line.
+ * An entry built under different alias, PATH, cwd or variable generations is dropped.
+ *
+ * @param line -- command line with tabs collapsed and surrounding spaces trimmed
+ * @param plan -- receives a copy of the cached CommandList
+ * @return true if an up-to-date plan was found
+ */
+bool PlanCache::lookup(const string& line, CommandList* plan) {
+	std::unordered_map<string,std::list<Entry>::iterator>::iterator itr = index.find(line);
+	if (itr == index.end()) {
+		misses.fetch_add(1,std::memory_order_relaxed);
+		return false;
+	}
+	Runtime* runtime = Runtime::getRuntime();
+	std::list<Entry>::iterator entry = itr->second;
+	for (int g=0;g<GEN_COUNT;g++) {
+		if ((*entry).gens[g] != (*runtime).generation((Generation)g)) {
+			lru.erase(entry);
+			index.erase(itr);
+			stale.fetch_add(1,std::memory_order_relaxed);
+			misses.fetch_add(1,std::memory_order_relaxed);
+			return false;
+		}
+	}
+	// move to the front of the LRU list
+	lru.splice(lru.begin(),lru,entry);
+	*plan = (*entry).plan;
+	hits.fetch_add(1,std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * Caches the plan for a normalized command line, under the current generations.
+ *
+ * @param line -- command line with tabs collapsed and surrounding spaces trimmed
+ * @param plan -- parsed CommandList, with executable paths resolved
+ */
+void PlanCache::insert(const string& line, const CommandList& plan) {
+	std::unordered_map<string,std::list<Entry>::iterator>::iterator itr = index.find(line);
+	if (itr != index.end()) {
+		lru.erase(itr->second);
+		index.erase(itr);
+	}
+	if (lru.size()>=PLAN_CACHE_ENTRIES) {
+		index.erase(lru.back().line);
+		lru.pop_back();
+	}
+	Runtime* runtime = Runtime::getRuntime();
+	lru.push_front(Entry());
+	Entry& entry = lru.front();
+	entry.line = line;
+	entry.plan = plan;
+	for (int g=0;g<GEN_COUNT;g++)
+		entry.gens[g] = (*runtime).generation((Generation)g);
+	index[line] = lru.begin();
+}
+
+/**
+ * Counts a line that was parsed but could not be cached.
+ */
+void PlanCache::noteUncacheable() {
+	uncacheable.fetch_add(1,std::memory_order_relaxed);
+}
+
+/**
+ * Drops every cached plan. The counters are kept.
+ */
+void PlanCache::clear() {
+	lru.clear();
+	index.clear();
+}
+
+/**
+ * Prints the number of cached plans and the hit rate to stdout.
+ */
+void PlanCache::printStats() {
+	unsigned long hitCount, missCount;
+	counts(&hitCount,&missCount);
+	unsigned long lookups = hitCount+missCount;
+	cout << "plans: " << lru.size() << "/" << PLAN_CACHE_ENTRIES << " cached";
+	cout << endl << "hits: " << hitCount << ", misses: " << missCount;
+	if (lookups>0)
+		cout << " (" << (hitCount*100+lookups/2)/lookups << "% hit rate)";
+	cout << endl << "stale: " << stale.load(std::memory_order_relaxed) << ", uncacheable: "
+			<< uncacheable.load(std::memory_order_relaxed) << endl;
+}
+
+/**
+ * Safe to call from any thread; the parser thread updates the counters while the shell reads them.
+ *
+ * @param hitCount -- receives the number of lookups that found a plan
+ * @param missCount -- receives the number that did not, stale ones included
+ */
+void PlanCache::counts(unsigned long* hitCount, unsigned long* missCount) {
+	*hitCount = hits.load(std::memory_order_relaxed);
+	*missCount = misses.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,175 @@
+#include "OopShell.h"
+
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <stdio.h> // for snprintf
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+
+/**
+ * Seconds of a struct timeval, as rusage reports CPU time.
+ */
+static double timevalSeconds(const struct timeval& t) {
+	return t.tv_sec+t.tv_usec/1e6;
+}
+
+/**
+ * Constructor for ResultLog. Nothing is written until open.
+ */
+ResultLog::ResultLog() {
+	fd = -1;
+	used = 0;
+}
+
+/**
+ * Sends lines to an fd from now on.
+ *
+ * @param fdi -- an open fd; it should be close-on-exec, so commands do not inherit it
+ */
+void ResultLog::open(int fdi) {
+	fd = fdi;
+}
+
+bool ResultLog::isOpen() {
+	return fd>=0;
+}
+
+/**
+ * Writes out the buffer. A reader that went away only loses the lines.
+ */
+void ResultLog::flush() {
+	size_t done = 0;
+	while (fd>=0 && done<used) {
+		ssize_t n = write(fd,buf+done,used-done);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) break;
+		done += n;
+	}
+	used = 0;
+}
+
+void ResultLog::put(const char* s, size_t len) {
+	while (len>0) {
+		if (used==sizeof(buf))
+			flush();
+		size_t n = len<sizeof(buf)-used ? len : sizeof(buf)-used;
+		memcpy(buf+used,s,n);
+		used += n;
+		s += n;
+		len -= n;
+	}
+}
+
+void ResultLog::put(const char* s) {
+	put(s,strlen(s));
+}
+
+/**
+ * Appends s as a JSON string, quoted and escaped.
+ */
+void ResultLog::putString(const string& s) {
+	put("\"",1);
+	size_t start = 0;
+	for (size_t i=0;i<s.size();i++) {
+		unsigned char c = s[i];
+		if (c!='"' && c!='\\' && c>=0x20)
+			continue;
+		put(s.data()+start,i-start);
+		char esc[8];
+		if (c=='"' || c=='\\')
+			snprintf(esc,sizeof(esc),"\\%c",c);
+		else snprintf(esc,sizeof(esc),"\\u%04x",c);
+		put(esc);
+		start = i+1;
+	}
+	put(s.data()+start,s.size()-start);
+	put("\"",1);
+}
+
+void ResultLog::putNumber(long long n) {
+	char num[32];
+	put(num,snprintf(num,sizeof(num),"%lld",n));
+}
+
+void ResultLog::putSeconds(double s) {
+	char num[32];
+	put(num,snprintf(num,sizeof(num),"%.6f",s));
+}
+
+/**
+ * Writes the line of a CommandList. Stages that were not executed have null status, signal and CPU times,
+ * and out_bytes is null if there is no > file.
+ *
+ * @param shown -- the line as it was typed: argv of each stage, and its < and > files
+ * @param ran -- the Commands that ran, and the file their output went to; the same as shown, unless the
+ *	 cache prefix sent the output to its store
+ * @param executed -- how many of its Commands were executed; 0 if the output was replayed from the cache
+ * @param status -- exit status of the pipeline
+ * @param timedOut -- true if it was stopped by its timeout
+ * @param cached -- true if its output was replayed by the cache prefix, and nothing ran
+ * @param wall -- seconds from its first launch until every stage was waited for
+ */
+void ResultLog::record(const CommandList& shown, CommandList* ran, size_t executed, int status, bool timedOut,
+		bool cached, double wall) {
+	if (fd<0)
+		return;
+	double user = 0, sys = 0;
+	put("{\"stages\":[");
+	for (size_t i=0;i<shown.cmdV.size();i++) {
+		put(i==0 ? "{\"argv\":[" : ",{\"argv\":[");
+		const vector<string>& args = shown.cmdV[i].args;
+		for (size_t a=0;a<args.size();a++) {
+			if (a>0) put(",",1);
+			putString(args[a]);
+		}
+		put("]");
+		if (i>=executed || i>=(*ran).cmdV.size()) {
+			put(",\"status\":null,\"signal\":null,\"user\":null,\"sys\":null}");
+			continue;
+		}
+		Command* c = &(*ran).cmdV[i];
+		put(",\"status\":");
+		putNumber((*c).status());
+		put(",\"signal\":");
+		if ((*c).signal()>0) putNumber((*c).signal());
+		else put("null");
+		double u = timevalSeconds((*c).times.usage.ru_utime), s = timevalSeconds((*c).times.usage.ru_stime);
+		user += u;
+		sys += s;
+		put(",\"user\":");
+		putSeconds(u);
+		put(",\"sys\":");
+		putSeconds(s);
+		put("}");
+	}
+	put("],\"in\":");
+	if (shown.inputFile.size()>0) putString(shown.inputFile);
+	else put("null");
+	put(",\"out\":");
+	if (shown.outputFile.size()>0) putString(shown.outputFile);
+	else put("null");
+	put(",\"status\":");
+	putNumber(status);
+	put(timedOut ? ",\"timed_out\":true" : ",\"timed_out\":false");
+	put(cached ? ",\"cached\":true" : ",\"cached\":false");
+	put(",\"wall\":");
+	putSeconds(wall);
+	put(",\"user\":");
+	putSeconds(user);
+	put(",\"sys\":");
+	putSeconds(sys);
+	put(",\"out_bytes\":");
+	struct stat st;
+	const string& written = shown.outputFile.size()>0 ? (*ran).outputFile : shown.outputFile;
+	if (written.size()>0 && stat(written.c_str(),&st)==0)
+		putNumber(st.st_size);
+	else put("null");
+	put("}\n");
+	if (Runtime::getRuntime()->interactive)
+		flush();
+}
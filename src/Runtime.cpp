@@ -8,10 +8,19 @@
 #include <fstream>   // file I/O
 #include <stdio.h>
 #include <iomanip>   // I/O format manipulation
+#include <unistd.h>  // for chdir, environ
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h> // for flock
+#include <pwd.h>      // for getpwnam_r
+#include <errno.h>
+#include <time.h>
 
 using std::string;
 using std::vector;
 using std::map;
+using std::unordered_map;
 using std::pair;
 using std::cout;
 using std::endl;
@@ -21,15 +30,57 @@ using std::ios;
 
 Runtime* Runtime::runtime = NULL;
 
+/**
+ * Settings file names, relative to shellHomeDir.
+ */
+static const char* SETTINGS_FILE = "oopshell_rc";
+static const char* JOURNAL_FILE = "oopshell_rc.journal";
+static const char* SNAPSHOT_FILE = "oopshell_rc.snap";
+// directory of the output store used by the cache prefix, relative to shellHomeDir
+static const char* OUTPUT_CACHE_DIR = "oopshell_cache";
+// seconds a passwd lookup is cached, for users found and for unknown users
+static const time_t PASSWD_TTL = 300;
+static const time_t PASSWD_MISS_TTL = 30;
+// deepest nesting of function calls, so runaway recursion fails instead of overflowing the stack
+static const int MAX_CALL_DEPTH = 200;
+
+/**
+ * Journal size above which writeSettingsFile folds the journal into the settings file.
+ */
+static const off_t JOURNAL_COMPACT_SIZE = 64*1024;
+
 /**
  * Runtime Constructor
- * This initializes shellHomeDir, prompt,
+ * This initializes the variable store, cwd, shellHomeDir, prompt,
  * built-in commands, and loads settings from a file.
  */
 Runtime::Runtime() {
 	prompt = "OopShell$ ";
-	initBuiltIn();
-	shellHomeDir = getPwd();
+	batchMode = BATCH_OFF;
+	autoPlacement = false;
+	cmdTimeout = 0;
+	killGrace = 5;
+	pipeStat = PIPESTAT_OFF;
+	interactive = true;
+	lastStatus = 0;
+	callDepth = 0;
+	settingsDirty = false;
+	loadingSettings = false;
+	journalOn = false;
+	varsLoaded = false;
+	envBytes = 0;
+	for (int i=0;i<GEN_COUNT;i++)
+		generations[i] = 0;
+	pthread_mutex_init(&passwdLock, NULL);
+	homeGen = (unsigned long)-1;
+	cwd = getPwd();
+	builtInCmds.resize(builtInCount(),NULL);
+	shellHomeDir = cwd;
+	outputCache.setStore(shellHomeDir+"/"+OUTPUT_CACHE_DIR);
+	// started now, the helper is forked before the shell has grown
+	const char* spawn = getenv("OOPSHELL_SPAWNER");
+	if (spawn!=NULL && strcmp(spawn,"on")==0)
+		spawner.start();
 	loadSettingsFile();
 }
 
@@ -43,13 +94,8 @@ Runtime::~Runtime() {
 	// write prompt to user settings file
 	writeSettingsFile();
 	// remove builtins
-	map<string,BuiltInI*>::iterator bicItr = builtInCmds.begin();
-	while (bicItr != builtInCmds.end()) {
-		delete (*bicItr).second;
-		++bicItr;
-	}
-//	// delete singleton instance
-	delete runtime;
+	for (size_t i=0;i<builtInCmds.size();i++)
+		delete builtInCmds[i];
 }
 
 /**
@@ -64,124 +110,547 @@ Runtime* Runtime::getRuntime() {
 	return runtime;
 }
 
+/**
+ * Struct Settings
+ * The persistent part of Runtime, as read from or written to the settings file and journal.
+ */
+struct Settings {
+	map<string,string> aliases;
+	string prompt;
+	bool hasPrompt;
+	vector<string> paths;
+	bool journal;
+	vector<pair<string,vector<string> > > resolved;
+	Settings() : hasPrompt(false), journal(false) {}
+};
+
+/**
+ * Struct SnapshotKey
+ * Identifies the settings file and journal a snapshot was built from.
+ * A snapshot is only used if the files still have the same identity, size and mtime.
+ */
+struct SnapshotKey {
+	uint64_t rcDev, rcIno, rcSize, rcMtime;
+	uint64_t journalSize, journalMtime;
+};
+
+static const char SNAPSHOT_MAGIC[8] = { 'O','O','P','S','N','A','P','1' };
+
+/**
+ * Builds the key of the current settings file and journal.
+ *
+ * @return false if there is neither a settings file nor a journal
+ */
+static bool snapshotKey(const string& rc, const string& journal, SnapshotKey* key) {
+	struct stat st;
+	memset(key,0,sizeof(*key));
+	bool found = false;
+	if (stat(rc.c_str(),&st)==0) {
+		key->rcDev = st.st_dev;
+		key->rcIno = st.st_ino;
+		key->rcSize = st.st_size;
+		key->rcMtime = (uint64_t)st.st_mtim.tv_sec*1000000000ULL+st.st_mtim.tv_nsec;
+		found = true;
+	}
+	if (stat(journal.c_str(),&st)==0) {
+		key->journalSize = st.st_size;
+		key->journalMtime = (uint64_t)st.st_mtim.tv_sec*1000000000ULL+st.st_mtim.tv_nsec;
+		found = true;
+	}
+	return found;
+}
+
+static void putU32(string* out, uint32_t v) {
+	(*out).append((const char*)&v,sizeof(v));
+}
+
+static void putString(string* out, const string& s) {
+	putU32(out,s.size());
+	(*out).append(s);
+}
+
+/**
+ * Bounds-checked reader over the bytes of a snapshot.
+ */
+struct SnapshotReader {
+	const char* pos;
+	const char* end;
+	bool getU32(uint32_t* v) {
+		if (end-pos<(long)sizeof(*v)) return false;
+		memcpy(v,pos,sizeof(*v));
+		pos += sizeof(*v);
+		return true;
+	}
+	bool getString(string* s) {
+		uint32_t len;
+		if (!getU32(&len) || (uint32_t)(end-pos)<len) return false;
+		(*s).assign(pos,len);
+		pos += len;
+		return true;
+	}
+};
+
+/**
+ * Writes the binary settings snapshot: the settings plus the resolved alias table,
+ * keyed by the settings file they came from. It is replaced atomically like the settings file.
+ */
+static void writeSnapshot(const string& file, const SnapshotKey& key, const Settings& s) {
+	string out(SNAPSHOT_MAGIC,sizeof(SNAPSHOT_MAGIC));
+	out.append((const char*)&key,sizeof(key));
+	putU32(&out,s.aliases.size());
+	map<string,string>::const_iterator aItr = s.aliases.begin();
+	while (aItr != s.aliases.end()) {
+		putString(&out,aItr->first);
+		putString(&out,aItr->second);
+		++aItr;
+	}
+	putU32(&out,s.resolved.size());
+	for (size_t i=0;i<s.resolved.size();i++) {
+		putString(&out,s.resolved[i].first);
+		putU32(&out,s.resolved[i].second.size());
+		for (size_t j=0;j<s.resolved[i].second.size();j++)
+			putString(&out,s.resolved[i].second[j]);
+	}
+	putU32(&out,s.hasPrompt);
+	putString(&out,s.prompt);
+	putU32(&out,s.paths.size());
+	for (size_t i=0;i<s.paths.size();i++)
+		putString(&out,s.paths[i]);
+	putU32(&out,s.journal);
+	writeFileAtomic(file,out);
+}
+
+/**
+ * Reads the binary settings snapshot with a single read, if it matches key.
+ *
+ * @return false if there is no snapshot, it is stale, or it is damaged
+ */
+static bool readSnapshot(const string& file, const SnapshotKey& key, Settings* s) {
+	int fd = open(file.c_str(),O_RDONLY|O_CLOEXEC);
+	if (fd<0) return false;
+	struct stat st;
+	string buf;
+	bool ok = fstat(fd,&st)==0 && st.st_size>(off_t)(sizeof(SNAPSHOT_MAGIC)+sizeof(key));
+	if (ok) {
+		buf.resize(st.st_size);
+		ok = read(fd,&buf[0],buf.size())==(ssize_t)buf.size();
+	}
+	close(fd);
+	if (!ok || memcmp(buf.data(),SNAPSHOT_MAGIC,sizeof(SNAPSHOT_MAGIC))!=0
+			|| memcmp(buf.data()+sizeof(SNAPSHOT_MAGIC),&key,sizeof(key))!=0)
+		return false;
+	SnapshotReader r;
+	r.pos = buf.data()+sizeof(SNAPSHOT_MAGIC)+sizeof(key);
+	r.end = buf.data()+buf.size();
+	uint32_t n, m, flag;
+	if (!r.getU32(&n)) return false;
+	for (uint32_t i=0;i<n;i++) {
+		string word, val;
+		if (!r.getString(&word) || !r.getString(&val)) return false;
+		s->aliases[word] = val;
+	}
+	if (!r.getU32(&n)) return false;
+	s->resolved.resize(n);
+	for (uint32_t i=0;i<n;i++) {
+		if (!r.getString(&s->resolved[i].first) || !r.getU32(&m)) return false;
+		s->resolved[i].second.resize(m);
+		for (uint32_t j=0;j<m;j++)
+			if (!r.getString(&s->resolved[i].second[j])) return false;
+	}
+	if (!r.getU32(&flag) || !r.getString(&s->prompt)) return false;
+	s->hasPrompt = flag!=0;
+	if (!r.getU32(&n)) return false;
+	s->paths.resize(n);
+	for (uint32_t i=0;i<n;i++)
+		if (!r.getString(&s->paths[i])) return false;
+	if (!r.getU32(&flag)) return false;
+	s->journal = flag!=0;
+	return true;
+}
+
+/**
+ * Applies one settings record to a Settings object.
+ * Records are "alias word val", "unalias word", "prompt val", "path dir" and "journal on|off".
+ * Values are the rest of the line, so they may contain spaces.
+ *
+ * @param s -- settings to update
+ * @param line -- one line of the settings file or journal
+ */
+static void applySettingsLine(Settings* s, const string& line) {
+	size_t sp = line.find(' ');
+	if (sp==string::npos) return;
+	string key = line.substr(0,sp);
+	string val = line.substr(sp+1);
+	if (key.compare("prompt")==0) {
+		s->prompt = val;
+		s->hasPrompt = true;
+		return;
+	}
+	if (key.compare("journal")==0) {
+		s->journal = val.compare("on")==0;
+		return;
+	}
+	trimString(&val);
+	if (val.size()==0) return;
+	if (key.compare("path")==0) {
+		for (size_t i=0;i<s->paths.size();i++)
+			if (s->paths[i]==val) return;
+		s->paths.push_back(val);
+	}
+	else if (key.compare("unalias")==0)
+		s->aliases.erase(val);
+	else if (key.compare("alias")==0) {
+		size_t wsp = val.find(' ');
+		if (wsp==string::npos) return;
+		string word = val.substr(0,wsp);
+		string cmd = val.substr(wsp+1);
+		trimString(&cmd);
+		s->aliases[word] = cmd;
+	}
+}
+
+/**
+ * Reads a settings file or journal into a Settings object.
+ *
+ * @param file -- file to read
+ * @param s -- settings to update
+ * @return false if the file could not be opened
+ */
+static bool readSettings(const string& file, Settings* s) {
+	ifstream fp_in;
+	fp_in.open(file.c_str(), ifstream::in);
+	if (!fp_in.is_open()) return false;
+	string line;
+	while (getline(fp_in,line)) {
+		// ignore null lines
+		if (line.size()==0) continue;
+		applySettingsLine(s,line);
+	}
+	fp_in.close();
+	return true;
+}
+
+/**
+ * Formats a Settings object as the contents of a settings file.
+ */
+static string formatSettings(const Settings& s) {
+	string out;
+	map<string,string>::const_iterator aItr = s.aliases.begin();
+	while (aItr != s.aliases.end()) {
+		out.append("alias "+aItr->first+" "+aItr->second+"\n");
+		++aItr;
+	}
+	if (s.hasPrompt)
+		out.append("prompt "+s.prompt+"\n");
+	for (size_t i=0;i<s.paths.size();i++)
+		out.append("path "+s.paths[i]+"\n");
+	if (s.journal)
+		out.append("journal on\n");
+	return out;
+}
+
 /**
  * Handles the loading of the state of alias, prompt, and path.
- * The method searches the current working directory of OopShell for the settings file.
+ * The settings file is read from the working directory of OopShell at launch,
+ * then records appended to the journal since the last compaction are replayed on top of it.
+ *
+ * The result, including the resolved alias table, is kept in a binary snapshot next to the settings file.
+ * While the settings file and journal keep the size and mtime recorded in the snapshot,
+ * startup reads the snapshot with one read instead of parsing text and resolving aliases.
  */
 void Runtime::loadSettingsFile() {
-	string filename = "oopshell_rc";
-	vector<string> v;
-	string line;
-	ifstream fp_in;
-	fp_in.open(filename.c_str(), ifstream::in);
+	string rc = shellHomeDir+"/"+SETTINGS_FILE;
+	string journal = shellHomeDir+"/"+JOURNAL_FILE;
+	string snapshot = shellHomeDir+"/"+SNAPSHOT_FILE;
+	SnapshotKey key;
 	// exit if settings file does not exist
-	if ( !fp_in.is_open()) return;
-	// process each line of settings file
-	while (!fp_in.eof()) {
-		v.clear();
-		getline(fp_in,line);
-		// ignore null lines & null settings values
-		if (line.size()==0) continue;
-		tokenize(&line," ",&v);
-		if (v.size()<2) continue;
-		// set prompt
-		if (v[0].compare("prompt")==0 && v.size()==2)
-			prompt = v[1];
-		// set alias
-		if (v[0].compare("alias")==0 && v.size()==3)
-			addAlias(v[1],v[2]);
-		// set path
-		if (v[0].compare("path")==0 && v.size()>1) {
-			addToPath(v[1]);
+	if (!snapshotKey(rc,journal,&key))
+		return;
+	Settings s;
+	bool fromSnapshot = readSnapshot(snapshot,key,&s);
+	if (!fromSnapshot) {
+		readSettings(rc,&s);
+		readSettings(journal,&s);
+	}
+	// loading must not mark settings dirty or write journal records
+	loadingSettings = true;
+	if (s.hasPrompt)
+		setPrompt(s.prompt);
+	if (fromSnapshot) {
+		aliasDefs.swap(s.aliases);
+		for (size_t i=0;i<s.resolved.size();i++)
+			aliases[s.resolved[i].first].swap(s.resolved[i].second);
+	}
+	else {
+		map<string,string>::iterator aItr = s.aliases.begin();
+		while (aItr != s.aliases.end()) {
+			addAlias(aItr->first,aItr->second);
+			++aItr;
 		}
+		rebuildAliases();
+	}
+	for (size_t i=0;i<s.paths.size();i++)
+		addToPath(s.paths[i]);
+	journalOn = s.journal;
+	loadingSettings = false;
+	settingsDirty = false;
+	if (!fromSnapshot) {
+		s.aliases = aliasDefs;
+		unordered_map<string,vector<string> >::iterator itr = aliases.begin();
+		while (itr != aliases.end()) {
+			s.resolved.push_back(*itr);
+			++itr;
+		}
+		writeSnapshot(snapshot,key,s);
 	}
-	fp_in.close();
 }
 
 /**
  * Handles saving of alias, prompt, and path.
  * The settings file will be saved in the original working directory for OopShell at launch.
  *
+ * Nothing is written unless a setting changed since it was last saved. The file is replaced atomically
+ * (write to a temporary file, fsync, rename), so concurrent shells never see a partial file.
+ * In journal mode every change was already appended to the journal, so this only compacts a large journal.
+ * Non-interactive shells never write settings.
+ *
  * @return false if output could not be written, otherwise return true
  */
 bool Runtime::writeSettingsFile() {
-	// be sure to save dir in shell's default working directory
-	if (!chDir(&shellHomeDir))
+	if (!interactive)
+		return true;
+	if (journalOn) {
+		struct stat st;
+		string journal = shellHomeDir+"/"+JOURNAL_FILE;
+		if (stat(journal.c_str(),&st)==0 && st.st_size>JOURNAL_COMPACT_SIZE)
+			return compactJournal();
+		return true;
+	}
+	if (!settingsDirty)
+		return true;
+	Settings s;
+	s.aliases = aliasDefs;
+	s.prompt = prompt;
+	s.hasPrompt = true;
+	s.paths = newPaths;
+	if (!writeFileAtomic(shellHomeDir+"/"+SETTINGS_FILE,formatSettings(s)))
 		return false;
-	// open settings file
-	ofstream fp_out;
-	fp_out.open("oopshell_rc",ofstream::trunc);
-	// write to settings file
-	if (fp_out.is_open()) {
-		//write aliases
-		map<string,string>::iterator aItr = aliases.begin();
-		map<string,string>::iterator aEnd = aliases.end();
-		while (aItr != aEnd) {
-			fp_out << "alias " << aItr->first << " " << aItr->second << endl;
-			++aItr;
-		}
-		// write prompt
-		fp_out <<"prompt "<< prompt <<endl;
-		// write new paths
-		vector<string>::iterator pItr = newPaths.begin();
-		vector<string>::iterator pEnd = newPaths.end();
-		while (pItr != pEnd) {
-			// escape '/' chars
-			escapeString(&(*pItr),"/");
-			fp_out <<"path "<< *pItr << endl;
-			++pItr;
-		}
+	settingsDirty = false;
+	return true;
+}
+
+/**
+ * Appends one record to the settings journal, if journal mode is on.
+ * Each record is a single O_APPEND write, so records from concurrent shells never interleave.
+ *
+ * @param record -- settings line, without the newline
+ * @return true if the change is saved in the journal, false if it still has to be written to the settings file
+ */
+bool Runtime::journalSetting(string record) {
+	// a script's settings changes last only as long as the script
+	if (loadingSettings || !interactive)
+		return true;
+	if (!journalOn)
+		return false;
+	string journal = shellHomeDir+"/"+JOURNAL_FILE;
+	int fd = open(journal.c_str(),O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,0644);
+	if (fd<0)
+		return false;
+	record.append("\n");
+	// a shared lock lets shells append together, but not while one of them compacts
+	flock(fd,LOCK_SH);
+	bool ok = write(fd,record.data(),record.size())==(ssize_t)record.size();
+	flock(fd,LOCK_UN);
+	close(fd);
+	return ok;
+}
+
+/**
+ * Folds the journal into the settings file.
+ * Under an exclusive lock on the journal, the settings file and journal are read again (other shells may
+ * have appended records), written out as a new settings file, and the journal is emptied.
+ *
+ * @return false if the settings file could not be written
+ */
+bool Runtime::compactJournal() {
+	string journal = shellHomeDir+"/"+JOURNAL_FILE;
+	int fd = open(journal.c_str(),O_RDWR|O_CREAT|O_CLOEXEC,0644);
+	if (fd<0)
+		return false;
+	flock(fd,LOCK_EX);
+	Settings s;
+	readSettings(shellHomeDir+"/"+SETTINGS_FILE,&s);
+	readSettings(journal,&s);
+	bool ok = writeFileAtomic(shellHomeDir+"/"+SETTINGS_FILE,formatSettings(s));
+	if (ok)
+		ok = ftruncate(fd,0)==0;
+	flock(fd,LOCK_UN);
+	close(fd);
+	if (ok)
+		settingsDirty = false;
+	return ok;
+}
+
+/**
+ * Turns the settings journal on or off.
+ * While it is on, each change is appended to the journal instead of rewriting the settings file on exit.
+ * Turning it off folds the journal back into the settings file.
+ *
+ * @param on -- true to turn journal mode on
+ * @return false if the settings could not be saved
+ */
+bool Runtime::setJournal(bool on) {
+	if (on==journalOn || !interactive) {
+		journalOn = on;
+		return true;
 	}
-	// if output could not be written, return false
-	else return false;
-	// otherwise return true
+	if (on) {
+		// the journal starts from everything this shell has not saved yet
+		if (!writeSettingsFile())
+			return false;
+		journalOn = true;
+		return journalSetting("journal on");
+	}
+	journalSetting("journal off");
+	journalOn = false;
+	if (!compactJournal())
+		return false;
+	unlink((shellHomeDir+"/"+JOURNAL_FILE).c_str());
 	return true;
 }
 
+/**
+ * @return true if journal mode is on
+ */
+bool Runtime::isJournalOn() {
+	return journalOn;
+}
+
+/**
+ * Changes the shell prompt.
+ *
+ * @param val -- new prompt
+ */
+void Runtime::setPrompt(string val) {
+	if (val==prompt)
+		return;
+	prompt = val;
+	markSettingsChanged("prompt "+val);
+}
+
+/**
+ * Records a change to the persistent settings: appended to the journal in journal mode,
+ * otherwise the settings file is marked dirty so it is rewritten on exit.
+ *
+ * @param record -- settings line describing the change
+ */
+void Runtime::markSettingsChanged(string record) {
+	if (!journalSetting(record))
+		settingsDirty = true;
+}
+
 /**
  * Creates a mapping between alias name and target.
- * This method will refuse to add an alias name/target pair that results in a cycle.
+ * This method will refuse to add an alias name/target pair that results in a cycle,
+ * e.g. A->B, B->C, C->A.
+ * The alias table is resolved again on insertion, so expandAlias never has to follow a chain.
  *
  * @param word -- alias name to be added.
- * @param val -- alias value desired for association with name.
+ * @param val -- alias value desired for association with name; it may hold several words, e.g. "ls -la".
  * @return true if alias was inserted, otherwise return false
  */
 bool Runtime::addAlias(string word, string val) {
-	// check for cycles before inserting
-	// cycle example: A->B, B->C, C->A
-	string tmp = val;
-	expandAlias(&tmp);
-	if (word == tmp)
+	trimString(&val);
+	if (word.size()==0 || val.size()==0)
+		return false;
+	if (!aliasDefs.insert(pair<string,string>(word,val)).second)
+		return false;
+	// any new cycle has to pass through word, so resolving word finds it
+	vector<string> words;
+	if (!resolveAlias(word,&words)) {
+		aliasDefs.erase(word);
 		return false;
-	return ( aliases.insert(pair<string,string>(word,val)) ).second;
+	}
+	// loadSettingsFile resolves the whole table once, after the last alias
+	if (!loadingSettings)
+		rebuildAliases();
+	markSettingsChanged("alias "+word+" "+val);
+	return true;
 }
 
 /**
- * This replaces cmd with a targeted command.
+ * Follows an alias chain to the words it finally stands for.
+ * Only the cmd word is aliased, so each link replaces the first word and keeps the rest:
+ *  e.g., if ll->"ls -l" and ls->"ls --color", ll resolves to {ls, --color, -l}.
  *
- * This will expand aliases of aliases;
- *  e.g., if A->B, and B->C, expandAlias(cmd) will replace A with C.
- *
- * @param cmd -- string pointer to the cmd name intended for expansion.
+ * @param word -- alias name to resolve
+ * @param words -- set to the resolved words
+ * @return false if the chain runs into a cycle
+ */
+bool Runtime::resolveAlias(const string& word, vector<string>* words) {
+	vector<string> seen;
+	(*words).clear();
+	(*words).push_back(word);
+	map<string,string>::iterator itr = aliasDefs.find(word);
+	while (itr != aliasDefs.end()) {
+		for (size_t i=0;i<seen.size();i++)
+			if (seen[i]==itr->first)
+				return false;
+		seen.push_back(itr->first);
+		vector<string> link;
+		tokenize(&itr->second," ",&link);
+		if (link.size()==0)
+			return false;
+		(*words).erase((*words).begin());
+		(*words).insert((*words).begin(),link.begin(),link.end());
+		// a link to its own name (ls->"ls -F") ends the chain instead of looping
+		if ((*words)[0]==itr->first)
+			break;
+		itr = aliasDefs.find((*words)[0]);
+	}
+	return true;
+}
+
+/**
+ * Rebuilds the hash table of resolved aliases from the alias definitions.
  */
-void Runtime::expandAlias(string* cmd) {
-	// This loop will check to see if the aliased command is also an alias, until no more alias links can be found
-	// this loop has a problem for mutually recursive aliases: e.g. if ls -> dir, then dir -> ls, this loop will never exit
-	map<string,string>::iterator itr = aliases.find(*cmd);
-	map<string,string>::iterator end = aliases.end();
-	while (itr != end) {
-		*cmd = itr->second;
-		itr = aliases.find(*cmd);
+void Runtime::rebuildAliases() {
+	generations[GEN_ALIAS]++;
+	aliases.clear();
+	map<string,string>::iterator itr = aliasDefs.begin();
+	while (itr != aliasDefs.end()) {
+		vector<string> words;
+		if (resolveAlias(itr->first,&words))
+			aliases[itr->first].swap(words);
+		++itr;
 	}
 }
 
+/**
+ * This replaces an aliased cmd with the words it stands for.
+ * Chains of aliases (A->B, B->C) were resolved when they were defined,
+ * so this is a single hash lookup and a splice into args.
+ *
+ * @param args -- pointer to the arg vector of a Command, in the form { cmd, arg0, ... argn }
+ */
+void Runtime::expandAlias(vector<string>* args) {
+	if ((*args).size()==0 || aliases.size()==0) return;
+	TRACE_SCOPE("Runtime::expandAlias");
+	unordered_map<string,vector<string> >::iterator itr = aliases.find((*args)[0]);
+	if (itr == aliases.end()) return;
+	const vector<string>& words = itr->second;
+	(*args)[0] = words[0];
+	if (words.size()>1)
+		(*args).insert((*args).begin()+1,words.begin()+1,words.end());
+}
+
 /**
  * Iterates through list of aliases on map and prints them to the screen.
  */
 void Runtime::printAlias() {
 	map<string,string>::iterator itr;
-	itr = aliases.begin();
-	while (itr != aliases.end()) {
+	itr = aliasDefs.begin();
+	while (itr != aliasDefs.end()) {
 		cout << "Alias: " << itr->first << "	Command: " << itr->second << endl;
 		++itr;
 	}
@@ -194,131 +663,58 @@ void Runtime::printAlias() {
  * @return true if alias was found and removed, else return false
  */
 bool Runtime::removeAlias(string* word) {
-	map<string,string>::iterator itr = aliases.find(*word);
-	if (itr != aliases.end()) {
-		aliases.erase(itr);
+	map<string,string>::iterator itr = aliasDefs.find(*word);
+	if (itr != aliasDefs.end()) {
+		aliasDefs.erase(itr);
+		rebuildAliases();
+		markSettingsChanged("unalias "+*word);
 		return true;
 	} else return false;
 }
 
 /**
- * Finds and retrieves built-in command from builtInCmds map.
+ * Finds and retrieves built-in command by name.
  *
  * @param cmd -- string pointer to the command name intended for retrieval.
- * @return built-in command object pointer
+ * @return built-in command object pointer, or NULL if cmd is not a built-in command
  */
 BuiltInI* Runtime::getBuiltIn(string* cmd) {
-	map<string,BuiltInI*>::iterator bicItr = builtInCmds.find(*cmd);
-	if (bicItr != builtInCmds.end() )
-		return bicItr->second;
-	else return NULL;
+	return getBuiltIn(findBuiltIn((*cmd).data(),(*cmd).size()));
 }
 
+/**
+ * Retrieves built-in command by the id Scanner stored on the Command.
+ * Built-in command objects are created on first use, so startup does not pay for them.
+ *
+ * @param id -- index of the command in the built-in command table
+ * @return built-in command object pointer, or NULL if id is not valid
+ */
+BuiltInI* Runtime::getBuiltIn(int id) {
+	if (id<0 || id>=(int)builtInCmds.size())
+		return NULL;
+	if (builtInCmds[id]==NULL) {
+		const BuiltInDecl* decl = getBuiltInDecl(id);
+		builtInCmds[id] = (*decl->create)(decl->name,decl->usage);
+	}
+	return builtInCmds[id];
+}
 
 /**
  * Determines if specified command is a built-in command or not.
  *
  * @param cmd
- * @return true if built-in command is found on builtInCmds map,
- * 		   otherwise return false if end of map is reached.
+ * @return true if cmd is in the built-in command table
  */
 bool Runtime::isBuiltIn(string* cmd) {
-	map<string,BuiltInI*>::iterator itr;
-	itr = builtInCmds.find(*cmd);
-	return (itr != builtInCmds.end() ? true : false);
+	return findBuiltIn((*cmd).data(),(*cmd).size()) >= 0;
 }
 
 /**
- * Prints all built-in commands on builtInCmds map.
+ * Prints all built-in commands in the built-in command table.
  */
 void Runtime::printBuiltIn() {
-	map<string,BuiltInI*>::iterator itr = builtInCmds.begin();
-	while (itr != builtInCmds.end()) {
-		cout << (*itr).first << " ";
-		++itr;
-	}
-}
-
-/**
- * Initializes built-in commands.
- */
-void Runtime::initBuiltIn() {
-	// set pwd to cwd
-	long size = pathconf(".", _PC_PATH_MAX);
-	char *buf;
-	char *ptr;
-	if ((buf = (char *)malloc((size_t)size)) == NULL) return;
-	ptr = getcwd(buf, (size_t)size);
-	setenv("PWD",ptr,1);
-	free(buf);
-	std::string name;
-	std::string usage;
-	BuiltInI* bic;
-
-	// create "cd" command
-	name = "cd";
-	usage = "cd usage:\n"
-			"cd [noargs]: changes directory to current user home.\n"
-			"cd directory_name: changes directory to directory_name if it exists.";
-	bic = new Cd(name,usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-
-	// create "bye" command
-	name = "bye";
-	usage = "bye usage:\n"
-			"bye [noargs]: This will exit OopShell cleanly.";
-	bic = new Bye(name, usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-
-	// create "alias"/"unalias" command
-	name = "alias";
-	usage = "alias & unalias usage:\n"
-			"alias [noargs]: prints out current aliases in session.\n"
-			"alias word=\"val\": creates alias word for val\n"
-			"unalias word: removes alias associated with word.";
-	bic = new Alias(name, usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-	name = "unalias";
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-
-	// create "set" command
-	name = "set";
-	usage = "set usage:\n"
-			"set [noargs]: prints out the current PATH and prompt variables.\n"
-			"set path [directory_name]+: adds specified directory_name(s) to PATH.\n"
-			"set prompt val: sets shell prompt to val.";
-	bic = new Set(name, usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-
-	// create "pwd" command
-	name = "pwd";
-	usage = "pwd usage:\n"
-			"pwd [noargs]: This command will display the current working directory.";
-	bic = new Pwd(name, usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-
-	// create "clear" command
-	name = "clear";
-	usage = "clear usage:\n"
-			"clear [noargs]: This command will clear the terminal of previous output.";
-	bic = new Clr(name, usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-
-	// create "history"/"last" command
-	name = "history";
-	usage = "history & prev usage:\n"
-			"history [noargs]: This command will print the session command history.\n\n"
-			"prev [noargs]: This command will print the previously entered command.";
-	bic = new History(name,usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-	name = "prev";
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
-
-	// create "help" command
-	name = "help";
-	usage = "Are you trying to be funny? Try entering help instead.";
-	bic = new Help(name,usage);
-	builtInCmds.insert(pair<string,BuiltInI*>(name,bic));
+	for (int i=0;i<builtInCount();i++)
+		cout << getBuiltInDecl(i)->name << " ";
 }
 
 /**
@@ -371,15 +767,393 @@ bool Runtime::completeCommand(string* cmd) {
 
 /**
  * This takes the inputed directory and appends it to PATH.
+ * Before the environment was imported, e.g. for the path entries of the settings file, it is only
+ * recorded, and importEnv appends it; loading the settings does not import the environment.
  *
  * @param newdir directory to add to path
  * @return true if new path is added
  */
 bool Runtime::addToPath(string newdir) {
-	string path = getenv("PATH");
-	string sep=":";
-	path.append(sep+newdir);
 	newPaths.push_back(newdir);
-	setenv("PATH",path.c_str(),1);
+	if (varsLoaded) {
+		string path;
+		string sep=":";
+		if (getVar("PATH",&path) && path.size()>0)
+			path.append(sep);
+		path.append(newdir);
+		setVar("PATH",path,true);
+	}
+	markSettingsChanged("path "+newdir);
+	return true;
+}
+
+/**
+ * Loads the process environment into the variable store, and sets PWD to the cwd.
+ * Every inherited variable is exported. The directories addToPath recorded before are appended to PATH.
+ * This runs on the first variable access, so a script that never launches a command never pays for it.
+ */
+void Runtime::importEnv() {
+	varsLoaded = true;
+	for (char** e=environ;*e!=NULL;e++) {
+		const char* eq = strchr(*e,'=');
+		if (eq==NULL) continue;
+		ShellVar var;
+		var.value = eq+1;
+		var.exported = true;
+		vars[string(*e,eq-*e)] = var;
+	}
+	envDirty = true;
+	setVar("PWD",cwd,true);
+	if (newPaths.size()>0) {
+		string path;
+		getVar("PATH",&path);
+		for (size_t i=0;i<newPaths.size();i++) {
+			if (path.size()>0)
+				path.append(":");
+			path.append(newPaths[i]);
+		}
+		setVar("PATH",path,true);
+	}
+}
+
+/**
+ * Looks up a shell variable.
+ *
+ * @param name -- variable name
+ * @param value -- set to the value of the variable, if it exists
+ * @return true if the variable exists
+ */
+bool Runtime::getVar(const string& name, string* value) {
+	// $1, $2... are the arguments of the running function
+	if (name.size()>0 && name.find_first_not_of("0123456789")==string::npos) {
+		size_t n = strtoul(name.c_str(),NULL,10);
+		if (n==0 || n>positional.size())
+			return false;
+		*value = positional[n-1];
+		return true;
+	}
+	if (!varsLoaded) importEnv();
+	map<string,ShellVar>::iterator itr = vars.find(name);
+	if (itr == vars.end())
+		return false;
+	*value = itr->second.value;
+	return true;
+}
+
+/**
+ * Sets a shell variable.
+ * A variable that is already exported stays exported.
+ *
+ * @param name -- variable name
+ * @param value -- new value
+ * @param exported -- true to export the variable to executed commands
+ */
+void Runtime::setVar(const string& name, const string& value, bool exported) {
+	if (!varsLoaded) importEnv();
+	map<string,ShellVar>::iterator itr = vars.find(name);
+	if (itr == vars.end()) {
+		ShellVar var;
+		var.exported = false;
+		itr = vars.insert(pair<string,ShellVar>(name,var)).first;
+	}
+	itr->second.value = value;
+	itr->second.exported = itr->second.exported || exported;
+	if (itr->second.exported)
+		envDirty = true;
+	varChanged(name);
+}
+
+/**
+ * Marks an existing shell variable for export.
+ *
+ * @param name -- variable name
+ * @return true if the variable exists
+ */
+bool Runtime::exportVar(const string& name) {
+	if (!varsLoaded) importEnv();
+	map<string,ShellVar>::iterator itr = vars.find(name);
+	if (itr == vars.end())
+		return false;
+	if (!itr->second.exported) {
+		itr->second.exported = true;
+		envDirty = true;
+		varChanged(name);
+	}
+	return true;
+}
+
+/**
+ * Removes a shell variable.
+ *
+ * @param name -- variable name
+ * @return true if the variable existed
+ */
+bool Runtime::unsetVar(const string& name) {
+	if (!varsLoaded) importEnv();
+	map<string,ShellVar>::iterator itr = vars.find(name);
+	if (itr == vars.end())
+		return false;
+	if (itr->second.exported)
+		envDirty = true;
+	vars.erase(itr);
+	varChanged(name);
+	return true;
+}
+
+/**
+ * Prints all exported variables to stdout.
+ */
+void Runtime::printVars() {
+	if (!varsLoaded) importEnv();
+	map<string,ShellVar>::iterator itr = vars.begin();
+	while (itr != vars.end()) {
+		if (itr->second.exported)
+			cout << "export " << itr->first << "=" << itr->second.value << endl;
+		++itr;
+	}
+}
+
+/**
+ * Returns the environment for execve.
+ * The array is a snapshot of the exported variables, rebuilt only when one of them changed,
+ * so launching a command costs no environment work.
+ *
+ * @return NULL terminated "NAME=value" array
+ */
+char** Runtime::getEnvp() {
+	if (!varsLoaded) importEnv();
+	if (envDirty) {
+		envStrings.clear();
+		map<string,ShellVar>::iterator itr = vars.begin();
+		while (itr != vars.end()) {
+			if (itr->second.exported)
+				envStrings.push_back(itr->first+"="+itr->second.value);
+			++itr;
+		}
+		envp.clear();
+		envBytes = sizeof(char*);
+		for (size_t i=0;i<envStrings.size();i++) {
+			envp.push_back(const_cast<char*>(envStrings[i].c_str()));
+			envBytes += envStrings[i].size()+1+sizeof(char*);
+		}
+		envp.push_back(NULL);
+		envDirty = false;
+	}
+	return &envp[0];
+}
+
+/**
+ * @return bytes the environment array takes up in execve: each string with its NUL, and each pointer
+ */
+size_t Runtime::getEnvBytes() {
+	getEnvp();
+	return envBytes;
+}
+
+/**
+ * Returns the current working directory.
+ * It is kept in memory and only refreshed by changeDir.
+ *
+ * @return fully qualified path of the cwd
+ */
+const string& Runtime::getCwd() {
+	return cwd;
+}
+
+/**
+ * Changes the working directory, then refreshes the in-memory cwd and PWD.
+ *
+ * @param dir -- new directory
+ * @return true if the directory was changed
+ */
+bool Runtime::changeDir(string* dir) {
+	if (chdir((*dir).c_str())!=0)
+		return false;
+	cwd = getPwd();
+	generations[GEN_CWD]++;
+	if (varsLoaded)
+		setVar("PWD",cwd,true);
+	return true;
+}
+
+/**
+ * Bumps the generations a change to a variable affects: every variable can appear in a command line,
+ * and PATH also decides which file a command runs.
+ *
+ * @param name -- variable that changed
+ */
+void Runtime::varChanged(const string& name) {
+	generations[GEN_ENV]++;
+	if (name=="PATH")
+		generations[GEN_PATH]++;
+}
+
+/**
+ * @param gen -- which part of the state
+ * @return its generation counter; it changes whenever that state changes
+ */
+unsigned long Runtime::generation(Generation gen) {
+	return generations[gen];
+}
+
+/**
+ * Finds the home directory of a user.
+ * Lookups go through a cache, so repeated ~name words cause no repeated NSS traffic:
+ * users found are kept for PASSWD_TTL seconds and unknown users for PASSWD_MISS_TTL seconds.
+ * The current user's home is $HOME, falling back to the passwd entry of the real uid; it is looked up again
+ * only after a variable changed. This may be called from the ParseAhead thread.
+ *
+ * @param user -- user name, or empty for the current user
+ * @param home -- receives the home directory
+ * @return false if the user does not exist, or has no home directory
+ */
+bool Runtime::getUserHome(const string& user, string* home) {
+	pthread_mutex_lock(&passwdLock);
+	bool found;
+	if (user.size()==0) {
+		if (homeGen != generations[GEN_ENV]) {
+			if (!getVar("HOME",&homeDir) || homeDir.size()==0)
+				lookupPasswd(user,&homeDir);
+			homeGen = generations[GEN_ENV];
+		}
+		*home = homeDir;
+		found = homeDir.size()>0;
+	}
+	else {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		unordered_map<string,PasswdEntry>::iterator itr = passwdCache.find(user);
+		if (itr == passwdCache.end() || itr->second.expires<=now.tv_sec) {
+			PasswdEntry entry;
+			entry.found = lookupPasswd(user,&entry.dir);
+			entry.expires = now.tv_sec+(entry.found ? PASSWD_TTL : PASSWD_MISS_TTL);
+			itr = passwdCache.insert(pair<string,PasswdEntry>(user,entry)).first;
+			itr->second = entry;
+		}
+		*home = itr->second.dir;
+		found = itr->second.found;
+	}
+	pthread_mutex_unlock(&passwdLock);
+	return found;
+}
+
+/**
+ * Looks a user's home directory up in the passwd database with the reentrant calls.
+ *
+ * @param user -- user name, or empty for the real uid
+ * @param home -- receives the home directory
+ * @return false if the user does not exist, the lookup failed, or there is no home directory
+ */
+bool Runtime::lookupPasswd(const string& user, string* home) {
+	long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+	vector<char> buf(size>0 ? size : 16384);
+	struct passwd pw;
+	struct passwd* result = NULL;
+	int rc;
+	while (true) {
+		if (user.size()==0)
+			rc = getpwuid_r(getuid(),&pw,&buf[0],buf.size(),&result);
+		else
+			rc = getpwnam_r(user.c_str(),&pw,&buf[0],buf.size(),&result);
+		if (rc!=ERANGE || buf.size()>=(1<<20))
+			break;
+		buf.resize(buf.size()*2);
+	}
+	if (rc!=0 || result==NULL || pw.pw_dir==NULL || pw.pw_dir[0]=='\0')
+		return false;
+	(*home).assign(pw.pw_dir);
+	return true;
+}
+
+/**
+ * Defines a script function, replacing any function of the same name.
+ * Function names are resolved while lines are expanded, like aliases, so cached plans are invalidated.
+ *
+ * @param name -- function name
+ * @param fn -- compiled body
+ */
+void Runtime::defineFunction(const string& name, const ShellFunction& fn) {
+	functions[name] = fn;
+	generations[GEN_ALIAS]++;
+}
+
+/**
+ * @param name -- command name
+ * @return true if name is a script function
+ */
+bool Runtime::isFunction(const string& name) {
+	return functions.size()>0 && functions.find(name)!=functions.end();
+}
+
+/**
+ * Runs a script function. Its arguments are $1, $2... while it runs; the caller's are restored afterwards.
+ *
+ * @param args -- function name and arguments
+ * @return exit status of the last command of the function
+ */
+int Runtime::callFunction(vector<string>* args) {
+	unordered_map<string,ShellFunction>::iterator itr = functions.find((*args)[0]);
+	if (itr == functions.end())
+		return 127;
+	if (callDepth>=MAX_CALL_DEPTH) {
+		cout << "Function " << (*args)[0] << ": too many nested calls." << endl;
+		return 1;
+	}
+	// hold the script, in case the function redefines itself while it runs
+	ShellFunction fn = itr->second;
+	vector<string> saved((*args).begin()+1,(*args).end());
+	positional.swap(saved);
+	callDepth++;
+	int status = (*fn.script).call(fn.entry);
+	callDepth--;
+	positional.swap(saved);
+	return status;
+}
+
+/**
+ * @return the parsed-plan cache
+ */
+PlanCache* Runtime::getPlanCache() {
+	return &planCache;
+}
+
+/**
+ * @return the output store used by the cache prefix
+ */
+OutputCache* Runtime::getOutputCache() {
+	return &outputCache;
+}
+
+/**
+ * @return the spawn helper, or NULL if it is not running
+ */
+Spawner* Runtime::getSpawner() {
+	return spawner.running() ? &spawner : NULL;
+}
+
+/**
+ * @return the counters and latency histograms of the session
+ */
+Metrics* Runtime::getMetrics() {
+	return &metrics;
+}
+
+/**
+ * @return the writer of --json-results lines; it writes nothing unless it was opened
+ */
+ResultLog* Runtime::getResults() {
+	return &results;
+}
+
+/**
+ * Starts or stops the spawn helper that launches commands.
+ *
+ * @param on -- true to start it, false to stop it
+ * @return false if it could not be started
+ */
+bool Runtime::setSpawner(bool on) {
+	if (on)
+		return spawner.start();
+	spawner.stop();
 	return true;
 }
@@ -6,7 +6,7 @@
 #include <map>
 #include <string>
 #include <unistd.h> // for getcwd
-#include <pwd.h> // for getpwnam
+#include <ctype.h> // for isalnum
 
 using std::cin;
 using std::cout;
@@ -20,6 +20,8 @@ Scanner::Scanner() {
 	FILE_OUT_TOKEN = ">";
 	PIPE_TOKEN = "|";
 	ARG_SEP = " ";
+	readEOF = false;
+	uncacheable = false;
 }
 
 /**
@@ -31,6 +33,7 @@ Scanner::Scanner() {
  * @return true if command was valid & parsed correctly, else false. If scanner read an EOF, readEOF is set true.
  */
 bool Scanner::readLine() {
+	TRACE_SCOPE("Scanner::readLine");
 	readEOF=false;
 	string rawInput;
 	if (getline(cin,rawInput)) {
@@ -53,6 +56,9 @@ bool Scanner::readLine() {
 				return false;
 			}
 		}
+		// read the rest of a block, up to its end
+		if (startsBlock(rawInput))
+			return readBlock(rawInput,NULL);
 		// execute command
 		return parse(rawInput);
 	}
@@ -61,21 +67,134 @@ bool Scanner::readLine() {
 	return false;
 }
 
+/**
+ * This method reads the next line of a script or -c string and dispatches it to the parser.
+ * Blank lines and lines starting with # are skipped, and there is no command completion.
+ *
+ * @param reader -- source of input lines
+ * @return true if command was valid & parsed correctly, else false. If scanner read an EOF, readEOF is set true.
+ */
+bool Scanner::readLine(LineReader* reader) {
+	TRACE_SCOPE("Scanner::readLine");
+	readEOF=false;
+	string rawInput;
+	if ((*reader).nextCommand(&rawInput))
+		return startsBlock(rawInput) ? readBlock(rawInput,reader) : parse(rawInput);
+	readEOF = true;
+	return false;
+}
+
+/**
+ * Returns the first word of a line, for recognizing script keywords.
+ */
+static string firstWord(const string& line) {
+	size_t start = line.find_first_not_of(" \t");
+	if (start==string::npos)
+		return "";
+	size_t end = line.find_first_of(" \t",start);
+	return line.substr(start,end==string::npos ? string::npos : end-start);
+}
+
+/**
+ * @param line -- a line of input
+ * @return true if the line starts an if, while, for or function block, which runs up to its matching end
+ */
+bool Scanner::startsBlock(const string& line) {
+	string word = firstWord(line);
+	return word=="if" || word=="while" || word=="for" || word=="function";
+}
+
+/**
+ * This method reads the lines of a block after its first line, up to the matching end, and compiles them into script.
+ * Lines come from reader, or from cin with a "> " prompt if reader is NULL.
+ *
+ * @param first -- the line that started the block
+ * @param reader -- source of the remaining lines, or NULL for cin
+ * @return true if the block was read and compiled. Otherwise, set ERROR_MSG and return false.
+ */
+bool Scanner::readBlock(string first, LineReader* reader) {
+	Runtime* runtime = Runtime::getRuntime();
+	(*runtime).addToHistory(first);
+	vector<string> lines(1,first);
+	string line;
+	int depth = 1;
+	while (depth>0) {
+		if (reader==NULL) {
+			cout << "> ";
+			if (!getline(cin,line)) break;
+		}
+		else if (!(*reader).nextCommand(&line)) break;
+		(*runtime).addToHistory(line);
+		if (startsBlock(line))
+			depth++;
+		else if (firstWord(line)=="end")
+			depth--;
+		lines.push_back(line);
+	}
+	if (depth>0) {
+		ERROR_MSG = "Missing end for "+firstWord(first)+" block.";
+		return false;
+	}
+	script = Script::compile(lines,&ERROR_MSG);
+	return script!=NULL;
+}
+
 /**
  * This method take a raw input string to be turned into command objects inside a CommandList class.
- * If input/output files exist, it will set the CommandList data members to those names; otherwise, the names are left empty.
- * The parser will marshall each Command object, setting IOTYPE, cmd, and args.
- * The Command objects will be stored in CommandList in intended order of execution.
+ * A line seen before is copied from the plan cache, as long as no alias, PATH, cwd or variable changed since;
+ * otherwise it is parsed by buildCommands, and cached with each command's executable path resolved.
+ * Lines with glob-expanded words are never cached, as their expansion depends on the file system,
+ * and neither are lines using $?, which changes after every command.
  *
  * @param rawInput validated input string from the user
  * @return true if parsing was successful. Otherwise, set ERROR_MSG and return false.
  */
 bool Scanner::parse(string rawInput) {
+	TRACE_SCOPE("Scanner::parse");
+	MetricScope parseTimer(HIST_PARSE);
 	Runtime* runtime = Runtime::getRuntime();
 	// add to command history
 	(*runtime).addToHistory(rawInput);
-	// initial input validation
 	collapseTabs(&rawInput);
+	string key = rawInput;
+	trimString(&key);
+	PlanCache* cache = (*runtime).getPlanCache();
+	if ((*cache).lookup(key,&input))
+		return true;
+	uncacheable = false;
+	if (!buildCommands(rawInput))
+		return false;
+	if (uncacheable) {
+		(*cache).noteUncacheable();
+		return true;
+	}
+	for (size_t i=0;i<input.cmdV.size();i++)
+		input.cmdV[i].resolvePath();
+	(*cache).insert(key,input);
+	return true;
+}
+
+/**
+ * This method builds the CommandList for a raw input string, by scanning it and expanding the result.
+ *
+ * @param rawInput input string from the user, with tabs collapsed
+ * @return true if parsing was successful. Otherwise, set ERROR_MSG and return false.
+ */
+bool Scanner::buildCommands(string rawInput) {
+	ScannedLine line;
+	return scanLine(rawInput,&line) && expandLine(line);
+}
+
+/**
+ * This method validates a raw input string and splits it into redirect file names and the words of each command.
+ * Nothing is expanded, so the result can be kept and expanded again each time the line runs.
+ *
+ * @param rawInput input string from the user, with tabs collapsed
+ * @param line receives the scanned line
+ * @return true if scanning was successful. Otherwise, set ERROR_MSG and return false.
+ */
+bool Scanner::scanLine(string rawInput, ScannedLine* line) {
+	// initial input validation
 	if (!verifyInput(&rawInput)) {
 		ERROR_MSG = "Invalid Input. See help for usage.";
 		return false;
@@ -91,8 +210,8 @@ bool Scanner::parse(string rawInput) {
 	if (vs==2) {
 		string fileName = v[1];
 		trimString(&fileName);
-		input.outputFile = fileName;
-	} else input.outputFile.clear();
+		(*line).outputFile = fileName;
+	} else (*line).outputFile.clear();
 	rawInput = v[0];
 
 	// Handle Input File
@@ -106,23 +225,52 @@ bool Scanner::parse(string rawInput) {
 	if (vs==2) {
 		string fileName = v[1];
 		trimString(&fileName);
-		input.inputFile = fileName;
-	} else input.inputFile.clear();
+		(*line).inputFile = fileName;
+	} else (*line).inputFile.clear();
 	rawInput = v[0];
 
 	// Handle Pipes
 	v.clear();
 	trimString(&rawInput);
 	tokenize(&rawInput,PIPE_TOKEN,&v);
-	int cmdc = v.size();
-
-	for (int i=0;i<cmdc;i++) {
+	(*line).stages.clear();
+	for (size_t i=0;i<v.size();i++) {
 		// make sure command is not null
 		if (v[i].size()==0) {
 			ERROR_MSG = "Invalid Input: null command. See help for usage.";
 			return false;
 		}
+		// clean up args
+		vector<string> words;
+		tokenize(&v[i],ARG_SEP,&words);
+		for (size_t w=0;w<words.size();w++)
+			removeWhiteSpaces(&words[w]);
+		(*line).stages.push_back(words);
+	}
+	return true;
+}
 
+/**
+ * This method turns a scanned line into command objects inside the CommandList class.
+ * If input/output files exist, it will set the CommandList data members to those names; otherwise, the names are left empty.
+ * The parser will marshall each Command object, setting IOTYPE, cmd, args and placement.
+ * The Command objects will be stored in CommandList in intended order of execution.
+ *
+ * @param line a line from scanLine
+ * @return true if expansion was successful. Otherwise, set ERROR_MSG and return false.
+ */
+bool Scanner::expandLine(const ScannedLine& line) {
+	input.cmdV.clear();
+	input.outputFile = line.outputFile;
+	expandVars(&input.outputFile);
+	input.inputFile = line.inputFile;
+	expandVars(&input.inputFile);
+	int cmdc = line.stages.size();
+	size_t skip;
+	if (!scanPrefixes(line.stages[0],&skip))
+		return false;
+
+	for (int i=0;i<cmdc;i++) {
 		Command c;
 		// First Command Special Cases
 		if (i==0) {
@@ -141,22 +289,88 @@ bool Scanner::parse(string rawInput) {
 			c.inputType = PIPE;
 			c.outputType = PIPE;
 		}
-		// clean up args, expand ~, and build arg vector
-		tokenize(&v[i],ARG_SEP,&(c.args));
-		vector<string>::iterator argItr = c.args.begin();
-		while (argItr != c.args.end()) {
-			removeWhiteSpaces(&(*argItr));
-			expandTilde(&(*argItr));
+		// expand ~, variables and globs, and build arg vector
+		vector<string>::const_iterator argItr = line.stages[i].begin()+(i==0 ? skip : 0);
+		// @name=value words before the command say where and how it runs
+		while (argItr != line.stages[i].end() && (*argItr).size()>1 && (*argItr)[0]=='@') {
+			string word = *argItr;
+			expandVars(&word);
+			if (!c.placement.parse(word,&ERROR_MSG))
+				return false;
+			++argItr;
+		}
+		bool expanded = false;
+		while (argItr != line.stages[i].end()) {
+			string word = *argItr;
+			expandTilde(&word);
+			expandVars(&word);
+			// a word that expanded to nothing is dropped, as in sh
+			if (word.size()==0) {
+				++argItr;
+				continue;
+			}
+			// words matching no file are kept as typed, as in sh
+			size_t first = c.args.size();
+			bool magic = Glob::hasMagic(&word);
+			uncacheable = uncacheable || magic;
+			if (!magic || !Glob(word).expand(&c.args))
+				c.args.push_back(word);
+			// remember the span of expanded args; only that span is split if cmd exceeds ARG_MAX
+			else if (first>0) {
+				if (!expanded) c.batchFrom = first;
+				c.batchTo = c.args.size();
+				expanded = true;
+			}
 			++argItr;
 		}
+		if (c.args.size()==0) {
+			ERROR_MSG = "Invalid Input: null command. See help for usage.";
+			return false;
+		}
 		// clean up the cmd, expand aliases, and set Command->cmd
 		Runtime* runtime = Runtime::getRuntime();
-		(*runtime).expandAlias(&c.args[0]);
+		size_t argc = c.args.size();
+		(*runtime).expandAlias(&c.args);
+		// keep the batchable span pointing at the same args
+		if (c.args.size()>argc && c.batchTo>0) {
+			c.batchFrom += c.args.size()-argc;
+			c.batchTo += c.args.size()-argc;
+		}
 		c.cmd = c.args[0];
-		c.builtIn = (*runtime).isBuiltIn(&c.cmd);
-		// Disalow executing piped/redirected built-ins
-		if (c.builtIn && (v.size()>1 || input.inputFile.size()>0 || input.outputFile.size()>0)) {
-			ERROR_MSG = "OopShell does not allow piping or file redirection with built-in commands.";
+		c.builtInId = findBuiltIn(c.cmd.data(),c.cmd.size());
+		c.builtIn = c.builtInId >= 0;
+		c.function = !c.builtIn && (*runtime).isFunction(c.cmd);
+		if ((c.builtIn || c.function) && input.memoize) {
+			ERROR_MSG = "cache can only run external commands. See help cache for usage.";
+			return false;
+		}
+		if ((c.builtIn || c.function) && input.timed) {
+			ERROR_MSG = "time can only run external commands. See help for usage.";
+			return false;
+		}
+		if ((c.builtIn || c.function) && input.timeout>0) {
+			ERROR_MSG = "timeout can only run external commands. See help for usage.";
+			return false;
+		}
+		if ((c.builtIn || c.function) && input.benchRuns>0) {
+			ERROR_MSG = "bench can only run external commands. See help for usage.";
+			return false;
+		}
+		if ((c.builtIn || c.function) && input.pipeStat!=PIPESTAT_OFF) {
+			ERROR_MSG = "pipestat can only run external commands. See help for usage.";
+			return false;
+		}
+		if ((c.builtIn || c.function) && input.limits.isSet()) {
+			ERROR_MSG = "limit can only run external commands. See help limit for usage.";
+			return false;
+		}
+		if ((c.builtIn || c.function) && c.placement.isSet()) {
+			ERROR_MSG = "Placement can only be given for external commands.";
+			return false;
+		}
+		// Disalow executing piped/redirected built-ins and functions
+		if ((c.builtIn || c.function) && (cmdc>1 || input.inputFile.size()>0 || input.outputFile.size()>0)) {
+			ERROR_MSG = "OopShell does not allow piping or file redirection with built-in commands or functions.";
 			return false;
 		}
 		input.cmdV.push_back(c);
@@ -164,6 +378,136 @@ bool Scanner::parse(string rawInput) {
 	return true;
 }
 
+/**
+ * This method reads the prefixes at the start of the first command's words, and sets them on the CommandList.
+ * cache [-e name]* marks the line for the output cache; cache stats and cache clear are the cache built-in.
+ * limit [-m|-t|-n|-c|-i value]* sets the limits of the line's job; limit with nothing after it is the limit built-in.
+ * timeout [-k grace] duration stops the line's job once it ran for duration.
+ * time prints what each stage of the line's job cost.
+ * pipestat [-l] relays and measures the pipes of the line's job; -l reports them every second while it runs.
+ * bench [-n runs] [-w warmups] [-k] runs the line's job repeatedly and prints statistics of its wall and CPU time.
+ *
+ * @param words the words of the first command, as typed
+ * @param skip receives the number of prefix words, which are not part of the command
+ * @return true if the prefixes were valid. Otherwise, set ERROR_MSG and return false.
+ */
+bool Scanner::scanPrefixes(const vector<string>& words, size_t* skip) {
+	input.memoize = false;
+	input.memoEnv.clear();
+	input.limits = Limits();
+	input.timeout = -1;
+	input.killGrace = -1;
+	input.timed = false;
+	input.pipeStat = PIPESTAT_OFF;
+	input.benchRuns = 0;
+	input.benchWarmup = 0;
+	input.benchKeep = false;
+	size_t pos = 0;
+	while (pos<words.size()) {
+		if (words[pos]=="cache" && !(pos==0 && (words.size()==1
+				|| (words.size()==2 && (words[1]=="stats" || words[1]=="clear"))))) {
+			input.memoize = true;
+			pos++;
+			while (pos<words.size() && words[pos]=="-e") {
+				if (pos+1==words.size()) {
+					ERROR_MSG = "Invalid Input: -e needs a variable name. See help cache for usage.";
+					return false;
+				}
+				input.memoEnv.push_back(words[pos+1]);
+				pos += 2;
+			}
+		}
+		else if (words[pos]=="limit") {
+			size_t start = pos++;
+			while (pos<words.size() && words[pos].size()>1 && words[pos][0]=='-') {
+				if (pos+1==words.size()) {
+					ERROR_MSG = "Invalid Input: "+words[pos]+" needs a value. See help limit for usage.";
+					return false;
+				}
+				string value = words[pos+1];
+				expandVars(&value);
+				if (!input.limits.parse(words[pos],value,&ERROR_MSG))
+					return false;
+				pos += 2;
+			}
+			// limit with nothing after its options is the builtin, which sets the limits of every job
+			if (start==0 && pos==words.size()) {
+				input.limits = Limits();
+				pos = 0;
+				break;
+			}
+		}
+		else if (words[pos]=="time") {
+			input.timed = true;
+			pos++;
+		}
+		else if (words[pos]=="bench") {
+			pos++;
+			input.benchRuns = 10;
+			input.benchWarmup = 1;
+			while (pos<words.size() && (words[pos]=="-n" || words[pos]=="-w" || words[pos]=="-k")) {
+				if (words[pos]=="-k") {
+					input.benchKeep = true;
+					pos++;
+					continue;
+				}
+				string value = pos+1<words.size() ? words[pos+1] : "";
+				expandVars(&value);
+				char* end;
+				long n = strtol(value.c_str(),&end,10);
+				bool runs = words[pos]=="-n";
+				if (value.size()==0 || *end!='\0' || n<(runs ? 1 : 0) || n>1000000) {
+					ERROR_MSG = "Invalid Input: "+words[pos]+(runs ? " needs a number of runs" : " needs a number of warmup runs")
+							+". See help for usage.";
+					return false;
+				}
+				if (runs) input.benchRuns = n;
+				else input.benchWarmup = n;
+				pos += 2;
+			}
+		}
+		else if (words[pos]=="pipestat") {
+			pos++;
+			input.pipeStat = PIPESTAT_SUMMARY;
+			if (pos<words.size() && words[pos]=="-l") {
+				input.pipeStat = PIPESTAT_LIVE;
+				pos++;
+			}
+		}
+		else if (words[pos]=="timeout") {
+			pos++;
+			string value;
+			if (pos+1<words.size() && words[pos]=="-k") {
+				value = words[pos+1];
+				expandVars(&value);
+				if (!parseDuration(value,&input.killGrace)) {
+					ERROR_MSG = "Invalid Input: -k needs a duration. See help for usage.";
+					return false;
+				}
+				pos += 2;
+			}
+			if (pos<words.size()) {
+				value = words[pos];
+				expandVars(&value);
+			}
+			if (pos==words.size() || !parseDuration(value,&input.timeout)) {
+				ERROR_MSG = "Invalid Input: timeout needs a duration. See help for usage.";
+				return false;
+			}
+			pos++;
+		}
+		else break;
+	}
+	if (pos>0 && pos==words.size()) {
+		// prefixes that are not also a built-in are described in the general help
+		string topic = findBuiltIn(words[0].data(),words[0].size())>=0 ? " "+words[0] : "";
+		ERROR_MSG = "Invalid Input: "+words[0]+" needs a command. See help"+topic+" for usage.";
+		return false;
+	}
+	*skip = pos;
+	return true;
+}
+
 /**
  * This method examines the structure of the inputed string,
  * and rejects it if it matches the following cases:
@@ -255,31 +599,79 @@ CommandList* Scanner::getInput() {
  * Case ~: /path/to/current/user/home
  * Case ~name: /path/to/user/name/home
  * case ~/word: /path/to/current/user/home/word
+ * case ~name/word: /path/to/user/name/home/word
+ * Home directories come from Runtime's passwd cache. If the user does not exist, the word is kept as typed.
  *
  * @param val a pointer to a cmd or arg string where tilde expansion is desirable.
  */
 void Scanner::expandTilde(string* val) {
 	if ((*val).find("~",0)==0) {
-		string sep = "/";
-		string path;
-		// expand ~ to /path/to/home/currentuser
-		if ((*val).size()==1) {
-			path.append(getenv("HOME"));
-			(*val).replace(0,1,path);
+		// the user name runs up to the first '/'; it is empty for ~ and ~/dirname
+		size_t sep = (*val).find('/',1);
+		string user = (*val).substr(1,sep==string::npos ? string::npos : sep-1);
+		string home;
+		if (!Runtime::getRuntime()->getUserHome(user,&home))
+			return;
+		// keep a single '/' between home and the rest of the word
+		if (sep!=string::npos && home.size()>1 && home[home.size()-1]=='/')
+			home.erase(home.size()-1);
+		(*val).replace(0,sep==string::npos ? (*val).size() : sep,home);
+	}
+}
+
+/**
+ * This method replaces shell variable references in the value of a string pointer:
+ * $name and ${name} are replaced by the value of variable name, or by nothing if it is not set.
+ * $? is replaced by the exit status of the last command, and $1, $2... by the arguments of the running function.
+ * A $ that does not start a variable name is kept.
+ *
+ * @param val a pointer to a cmd, arg or file name string where variable expansion is desirable.
+ */
+void Scanner::expandVars(string* val) {
+	size_t pos = (*val).find('$');
+	if (pos==string::npos) return;
+	Runtime* runtime = Runtime::getRuntime();
+	string out = (*val).substr(0,pos);
+	while (pos<(*val).size()) {
+		char c = (*val)[pos];
+		if (c!='$') {
+			out.append(1,c);
+			pos++;
+			continue;
 		}
-		// expand ~username to /path/to/home/username
-		else if ((*val).find(sep,1)==string::npos) {
-			(*val).replace(0,1,"");
-			struct passwd* pw = getpwnam( const_cast<char *>((*val).c_str()) );
-			(*val).clear();
-			(*val).append(pw->pw_dir);
+		size_t start = pos+1;
+		size_t end = start;
+		bool braced = start<(*val).size() && (*val)[start]=='{';
+		if (braced) {
+			end = (*val).find('}',start);
+			if (end==string::npos) {
+				out.append((*val),pos,string::npos);
+				break;
+			}
+			start++;
 		}
-		// expand ~/dirname to /path/to/home/currentuser/dirname
+		else if (end<(*val).size() && (*val)[end]=='?')
+			end++;
 		else {
-			path.append(getenv("HOME"));
-			if ((*val).find(sep,1)!=1)
-				path.append(sep);
-			(*val).replace(0,1,path);
+			while (end<(*val).size() && (isalnum((unsigned char)(*val)[end]) || (*val)[end]=='_'))
+				end++;
+		}
+		// lone $
+		if (end==start) {
+			out.append(1,'$');
+			pos++;
+			continue;
+		}
+		string name = (*val).substr(start,end-start);
+		string value;
+		// $? is the exit status of the last command
+		if (name=="?") {
+			out.append(std::to_string((*runtime).lastStatus));
+			uncacheable = true;
 		}
+		else if ((*runtime).getVar(name,&value))
+			out.append(value);
+		pos = braced ? end+1 : end;
 	}
+	(*val).swap(out);
 }
@@ -0,0 +1,390 @@
+#include "OopShell.h"
+
+#include <iostream> // for cout, endl
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+/**
+ * Struct Script::Node
+ * A node of the AST a block is parsed into before it is compiled.
+ *
+ * Members:
+ *	 kind -- what the node is
+ *	 ref -- PIPELINE, IF, WHILE: the command line in lines; FOR: the loop in loops; FUNCTION: the function in functions
+ *	 body -- nodes of the if, while, for or function body
+ *	 elseBody, hasElse -- nodes of the else part of an if
+ */
+struct Script::Node {
+	enum Kind { PIPELINE, IF, WHILE, FOR, FUNCTION };
+	Kind kind;
+	unsigned int ref;
+	vector<Node> body;
+	vector<Node> elseBody;
+	bool hasElse;
+	Node() : kind(PIPELINE), ref(0), hasElse(false) {}
+};
+
+/**
+ * Builds the message for an error on a line of the block.
+ */
+static string lineError(size_t lineNo, const string& msg) {
+	return "Script error on line "+std::to_string(lineNo+1)+": "+msg;
+}
+
+/**
+ * Splits a line into words at spaces.
+ */
+static void splitWords(const string& line, vector<string>* words) {
+	size_t pos = 0;
+	while ((pos = line.find_first_not_of(' ',pos))!=string::npos) {
+		size_t end = line.find(' ',pos);
+		(*words).push_back(line.substr(pos,end==string::npos ? string::npos : end-pos));
+		pos = end;
+	}
+}
+
+/**
+ * @return true if word can name a variable
+ */
+static bool isName(const string& word) {
+	if (word.size()==0 || isdigit((unsigned char)word[0]))
+		return false;
+	for (size_t i=0;i<word.size();i++)
+		if (!isalnum((unsigned char)word[i]) && word[i]!='_')
+			return false;
+	return true;
+}
+
+/**
+ * Compiles the lines of a block.
+ *
+ * @param src -- the lines, starting with the line that opened the block
+ * @param error -- receives the error if the block is malformed
+ * @return the compiled script, or NULL if the block is malformed
+ */
+shared_ptr<Script> Script::compile(const vector<string>& src, string* error) {
+	shared_ptr<Script> script(new Script());
+	vector<Node> nodes;
+	size_t pos = 0;
+	string terminator;
+	if (!(*script).parseNodes(src,&pos,&nodes,&terminator,error))
+		return NULL;
+	if (terminator.size()>0) {
+		*error = lineError(pos-1,terminator+" without a block.");
+		return NULL;
+	}
+	for (size_t i=0;i<nodes.size();i++)
+		(*script).emit(nodes[i]);
+	return script;
+}
+
+/**
+ * Parses lines into AST nodes, stopping after an else or end line, or at the end of the lines.
+ *
+ * @param src -- the lines of the block
+ * @param pos -- index of the next line to parse; it is advanced past the lines parsed
+ * @param out -- receives the nodes
+ * @param terminator -- receives "else" or "end" if parsing stopped at one, otherwise it is empty
+ * @param error -- receives the error if a line is malformed
+ * @return false if a line is malformed
+ */
+bool Script::parseNodes(const vector<string>& src, size_t* pos, vector<Node>* out,
+		string* terminator, string* error) {
+	(*terminator).clear();
+	while (*pos<src.size()) {
+		size_t lineNo = (*pos)++;
+		string line = src[lineNo];
+		collapseTabs(&line);
+		trimString(&line);
+		if (line.size()==0 || line[0]=='#')
+			continue;
+		vector<string> words;
+		splitWords(line,&words);
+		const string& keyword = words[0];
+		if (keyword=="end" || keyword=="else") {
+			if (words.size()>1) {
+				*error = lineError(lineNo,keyword+" takes no arguments.");
+				return false;
+			}
+			*terminator = keyword;
+			return true;
+		}
+		Node node;
+		string term;
+		if (keyword=="if" || keyword=="while") {
+			node.kind = keyword=="if" ? Node::IF : Node::WHILE;
+			if (words.size()<2) {
+				*error = lineError(lineNo,keyword+" needs a command.");
+				return false;
+			}
+			if (!scanInto(line.substr(keyword.size()),lineNo,&node.ref,error)
+					|| !parseNodes(src,pos,&node.body,&term,error))
+				return false;
+			if (term=="else" && node.kind==Node::IF) {
+				node.hasElse = true;
+				if (!parseNodes(src,pos,&node.elseBody,&term,error))
+					return false;
+			}
+		}
+		else if (keyword=="for") {
+			node.kind = Node::FOR;
+			if (words.size()<3 || !isName(words[1]) || words[2]!="in") {
+				*error = lineError(lineNo,"for needs the form: for name in [word]*");
+				return false;
+			}
+			ForLoop loop;
+			loop.var = words[1];
+			loop.words.assign(words.begin()+3,words.end());
+			loops.push_back(loop);
+			node.ref = loops.size()-1;
+			if (!parseNodes(src,pos,&node.body,&term,error))
+				return false;
+		}
+		else if (keyword=="function") {
+			node.kind = Node::FUNCTION;
+			if (words.size()!=2 || !isName(words[1])) {
+				*error = lineError(lineNo,"function needs the form: function name");
+				return false;
+			}
+			if (findBuiltIn(words[1].data(),words[1].size())>=0) {
+				*error = lineError(lineNo,words[1]+" is a built-in command.");
+				return false;
+			}
+			FunctionDef fn;
+			fn.name = words[1];
+			fn.entry = 0;
+			functions.push_back(fn);
+			node.ref = functions.size()-1;
+			if (!parseNodes(src,pos,&node.body,&term,error))
+				return false;
+		}
+		else {
+			if (!scanInto(line,lineNo,&node.ref,error))
+				return false;
+			(*out).push_back(node);
+			continue;
+		}
+		if (term!="end") {
+			*error = lineError(term.size()>0 ? *pos-1 : lineNo,
+					term.size()>0 ? term+" does not belong to "+keyword+"." : "Missing end for "+keyword+" block.");
+			return false;
+		}
+		(*out).push_back(node);
+	}
+	return true;
+}
+
+/**
+ * Scans a command line once, and keeps it for OP_RUN.
+ *
+ * @param text -- the command line
+ * @param lineNo -- line of the block it is on, for errors
+ * @param ref -- receives its index in lines
+ * @param error -- receives the error if the line is malformed
+ * @return false if the line is malformed
+ */
+bool Script::scanInto(const string& text, size_t lineNo, unsigned int* ref, string* error) {
+	Scanner scanner;
+	ScannedLine line;
+	if (!scanner.scanLine(text,&line)) {
+		*error = lineError(lineNo,scanner.ERROR_MSG);
+		return false;
+	}
+	lines.push_back(line);
+	*ref = lines.size()-1;
+	return true;
+}
+
+/**
+ * Compiles an AST node into instructions, appended to code.
+ * Jump targets are filled in once the code they jump over has been emitted.
+ */
+void Script::emit(const Node& node) {
+	Instr instr = { OP_RUN, node.ref, 0 };
+	size_t top, jump, skip;
+	switch (node.kind) {
+		case Node::PIPELINE:
+			code.push_back(instr);
+			break;
+		case Node::IF:
+			code.push_back(instr);
+			jump = code.size();
+			instr.op = OP_JUMP_FAIL;
+			code.push_back(instr);
+			for (size_t i=0;i<node.body.size();i++)
+				emit(node.body[i]);
+			if (node.hasElse) {
+				skip = code.size();
+				instr.op = OP_JUMP;
+				code.push_back(instr);
+				code[jump].target = code.size();
+				for (size_t i=0;i<node.elseBody.size();i++)
+					emit(node.elseBody[i]);
+				code[skip].target = code.size();
+			}
+			else code[jump].target = code.size();
+			break;
+		case Node::WHILE:
+			top = code.size();
+			code.push_back(instr);
+			jump = code.size();
+			instr.op = OP_JUMP_FAIL;
+			code.push_back(instr);
+			for (size_t i=0;i<node.body.size();i++)
+				emit(node.body[i]);
+			instr.op = OP_JUMP;
+			instr.target = top;
+			code.push_back(instr);
+			code[jump].target = code.size();
+			break;
+		case Node::FOR:
+			instr.op = OP_FOR_START;
+			code.push_back(instr);
+			top = code.size();
+			instr.op = OP_FOR_NEXT;
+			code.push_back(instr);
+			for (size_t i=0;i<node.body.size();i++)
+				emit(node.body[i]);
+			instr.op = OP_JUMP;
+			instr.target = top;
+			code.push_back(instr);
+			code[top].target = code.size();
+			break;
+		case Node::FUNCTION:
+			instr.op = OP_DEFINE;
+			code.push_back(instr);
+			skip = code.size();
+			instr.op = OP_JUMP;
+			code.push_back(instr);
+			functions[node.ref].entry = code.size();
+			for (size_t i=0;i<node.body.size();i++)
+				emit(node.body[i]);
+			instr.op = OP_RET;
+			code.push_back(instr);
+			code[skip].target = code.size();
+			break;
+	}
+}
+
+/**
+ * Runs the script from its first instruction.
+ *
+ * @return exit status of the last command run
+ */
+int Script::run() {
+	return exec(0);
+}
+
+/**
+ * Runs a function body of this script.
+ *
+ * @param entry -- first instruction of the body
+ * @return exit status of the last command run
+ */
+int Script::call(size_t entry) {
+	return exec(entry);
+}
+
+/**
+ * The VM loop. Runs instructions from pc until an OP_RET or the end of the code.
+ * Each call has its own stack of running for loops, so functions may recurse.
+ *
+ * @param pc -- first instruction to run
+ * @return exit status of the last command run
+ */
+int Script::exec(size_t pc) {
+	struct LoopState {
+		vector<string> items;
+		size_t next;
+	};
+	Runtime* runtime = Runtime::getRuntime();
+	vector<LoopState> loopStack;
+	int status = 0;
+	while (pc<code.size()) {
+		const Instr& instr = code[pc];
+		switch (instr.op) {
+			case OP_RUN:
+				status = runLine(lines[instr.arg]);
+				(*runtime).lastStatus = status;
+				pc++;
+				break;
+			case OP_JUMP:
+				pc = instr.target;
+				break;
+			case OP_JUMP_FAIL:
+				// a failed condition is not a failure of the if or while
+				if (status!=0) {
+					status = 0;
+					pc = instr.target;
+				}
+				else pc++;
+				break;
+			case OP_FOR_START: {
+				// the word list is expanded once, when the loop starts
+				LoopState state;
+				state.next = 0;
+				Scanner scanner;
+				const vector<string>& words = loops[instr.arg].words;
+				for (size_t i=0;i<words.size();i++) {
+					string word = words[i];
+					scanner.expandTilde(&word);
+					scanner.expandVars(&word);
+					if (word.size()==0)
+						continue;
+					if (!Glob::hasMagic(&word) || !Glob(word).expand(&state.items))
+						state.items.push_back(word);
+				}
+				loopStack.push_back(state);
+				pc++;
+				break;
+			}
+			case OP_FOR_NEXT: {
+				LoopState& state = loopStack.back();
+				if (state.next<state.items.size()) {
+					(*runtime).setVar(loops[instr.arg].var,state.items[state.next++],false);
+					pc++;
+				}
+				else {
+					loopStack.pop_back();
+					pc = instr.target;
+				}
+				break;
+			}
+			case OP_DEFINE: {
+				ShellFunction fn;
+				fn.script = shared_from_this();
+				fn.entry = functions[instr.arg].entry;
+				(*runtime).defineFunction(functions[instr.arg].name,fn);
+				status = 0;
+				pc++;
+				break;
+			}
+			case OP_RET:
+				return status;
+		}
+	}
+	return status;
+}
+
+/**
+ * Expands a scanned line and runs it.
+ *
+ * @param line -- the line, as scanned by compile
+ * @return exit status of the line; 1 if it could not be expanded or executed
+ */
+int Script::runLine(const ScannedLine& line) {
+	Scanner scanner;
+	if (!scanner.expandLine(line)) {
+		cout << scanner.ERROR_MSG << endl;
+		return 1;
+	}
+	Executor executor(scanner.getInput());
+	return executor.run();
+}
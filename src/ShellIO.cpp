@@ -0,0 +1,155 @@
+#include "OopShell.h"
+
+#include <iostream> // for cout
+#include <string>
+#include <errno.h>
+#include <unistd.h> // for read, write
+
+using std::cout;
+using std::string;
+
+// input is read in blocks of this size
+static const size_t READ_BLOCK = 1<<16;
+
+// cout's buffer while output is block buffered, NULL otherwise
+static BlockOutBuf* outBuf = NULL;
+
+/**
+ * Constructor for a LineReader reading a file descriptor.
+ *
+ * @param fdi -- file descriptor to read; it is not closed by LineReader
+ */
+LineReader::LineReader(int fdi) {
+	fd = fdi;
+	pos = 0;
+	eof = false;
+}
+
+/**
+ * Constructor for a LineReader reading the lines of a string, as given to -c.
+ *
+ * @param text -- input lines
+ */
+LineReader::LineReader(const string& text) {
+	fd = -1;
+	buf = text;
+	pos = 0;
+	eof = true;
+}
+
+/**
+ * Returns the next line of input. A last line without a newline is still returned.
+ *
+ * @param line -- receives the line, without its newline
+ * @return false at end of input
+ */
+bool LineReader::next(string* line) {
+	size_t scanFrom = pos;
+	while (true) {
+		size_t nl = buf.find('\n',scanFrom);
+		if (nl != string::npos) {
+			(*line).assign(buf,pos,nl-pos);
+			pos = nl+1;
+			return true;
+		}
+		if (eof) {
+			if (pos>=buf.size())
+				return false;
+			(*line).assign(buf,pos,string::npos);
+			pos = buf.size();
+			return true;
+		}
+		// drop returned lines, then read another block after the partial line
+		buf.erase(0,pos);
+		pos = 0;
+		scanFrom = buf.size();
+		buf.resize(scanFrom+READ_BLOCK);
+		ssize_t n;
+		do {
+			n = read(fd,&buf[scanFrom],READ_BLOCK);
+		} while (n<0 && errno==EINTR);
+		buf.resize(scanFrom+(n>0 ? n : 0));
+		if (n<=0)
+			eof = true;
+	}
+}
+
+/**
+ * Returns the next line holding a command, skipping blank lines and # comments.
+ *
+ * @param line -- receives the line, without its newline
+ * @return false at end of input
+ */
+bool LineReader::nextCommand(string* line) {
+	while (next(line)) {
+		size_t first = (*line).find_first_not_of(" \t\r");
+		if (first!=string::npos && (*line)[first]!='#')
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Constructor for BlockOutBuf.
+ *
+ * @param fdi -- file descriptor output is written to
+ */
+BlockOutBuf::BlockOutBuf(int fdi) {
+	fd = fdi;
+	setp(buf,buf+sizeof(buf));
+}
+
+/**
+ * Writes out everything buffered.
+ *
+ * @return false if the output could not be written
+ */
+bool BlockOutBuf::flushAll() {
+	char* p = pbase();
+	while (p<pptr()) {
+		ssize_t n = write(fd,p,pptr()-p);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			break;
+		}
+		p += n;
+	}
+	bool ok = p==pptr();
+	setp(buf,buf+sizeof(buf));
+	return ok;
+}
+
+int BlockOutBuf::overflow(int c) {
+	if (!flushAll())
+		return traits_type::eof();
+	if (c!=traits_type::eof())
+		sputc(c);
+	return traits_type::not_eof(c);
+}
+
+int BlockOutBuf::sync() {
+	return 0;
+}
+
+/**
+ * Switches cout to a fully buffered BlockOutBuf on stdout, for the non-interactive modes.
+ * From then on flushOutput must be called before anything else writes to stdout.
+ */
+void bufferOutput() {
+	if (outBuf!=NULL)
+		return;
+	cout.flush();
+	outBuf = new BlockOutBuf(STDOUT_FILENO);
+	cout.rdbuf(outBuf);
+}
+
+/**
+ * Writes out buffered shell output. This is called before forking, so a child's output
+ * never overtakes the shell's, and at exit.
+ */
+void flushOutput() {
+	if (outBuf!=NULL)
+		outBuf->flushAll();
+	else
+		cout.flush();
+}
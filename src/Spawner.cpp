@@ -0,0 +1,423 @@
+#include "OopShell.h"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using std::string;
+using std::vector;
+
+// the helper's end of the socketpair, after it is re-executed
+static const int SPAWN_SOCK_FD = 3;
+
+/**
+ * A spawn request. It is followed by bytes of payload: the executable, the cwd, then argc args and envc
+ * environment strings, each NUL terminated. stdin, stdout and stderr for the command travel with it,
+ * followed by the job's cgroup.procs if it has a cgroup leaf.
+ */
+struct SpawnRequest {
+	uint32_t argc, envc;
+	uint64_t bytes;
+	int32_t pgid;
+	Placement placement;
+	Limits limits;
+	int32_t timed;
+};
+
+/**
+ * A reply from the helper: SPAWNED with the pid (or -errno if fork failed) and, for a timed request,
+ * the time the command exec'd; or EXITED with a wait status and rusage.
+ */
+struct SpawnReply {
+	enum Kind { SPAWNED, EXITED };
+	int32_t kind;
+	int32_t pid;
+	int32_t status;
+	struct timespec execed;
+	struct rusage usage;
+};
+
+/**
+ * Reads exactly len bytes from a socket.
+ *
+ * @return false on end of file or error
+ */
+static bool readAll(int fd, void* buf, size_t len) {
+	char* p = (char*)buf;
+	while (len>0) {
+		ssize_t n = read(fd,p,len);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Writes exactly len bytes to a socket, without raising SIGPIPE if the other end is gone.
+ *
+ * @return false on error
+ */
+static bool sendAll(int fd, const void* buf, size_t len) {
+	const char* p = (const char*)buf;
+	while (len>0) {
+		ssize_t n = send(fd,p,len,MSG_NOSIGNAL);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Constructor for Spawner. The helper is not started until start is called.
+ */
+Spawner::Spawner() {
+	sock = -1;
+	helper = 0;
+}
+
+/**
+ * Destructor for Spawner. Stops the helper.
+ */
+Spawner::~Spawner() {
+	stop();
+}
+
+/**
+ * Starts the helper: OopShell re-executed with --spawn-server, holding its end of a socketpair as fd 3.
+ *
+ * @return true if the helper is running
+ */
+bool Spawner::start() {
+	if (sock>=0)
+		return true;
+	int sv[2];
+	if (socketpair(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0,sv)!=0)
+		return false;
+	flushOutput();
+	pid_t pid = fork();
+	if (pid<0) {
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
+	if (pid==0) {
+		// dup2 clears close-on-exec, so only fd 3 survives into the helper
+		dup2(sv[1],SPAWN_SOCK_FD);
+		closeFrom(SPAWN_SOCK_FD+1);
+		char* args[] = { const_cast<char*>("OopShell"), const_cast<char*>("--spawn-server"), NULL };
+		execv("/proc/self/exe",args);
+		_exit(127);
+	}
+	close(sv[1]);
+	sock = sv[0];
+	helper = pid;
+	return true;
+}
+
+/**
+ * Stops the helper. Closing the socketpair makes it exit; it is then reaped.
+ * Statuses of commands it launched that were never waited for are dropped.
+ */
+void Spawner::stop() {
+	if (sock<0)
+		return;
+	close(sock);
+	sock = -1;
+	waitpid(helper,NULL,0);
+	helper = 0;
+	exited.clear();
+}
+
+/**
+ * @return true if the helper is running
+ */
+bool Spawner::running() {
+	return sock>=0;
+}
+
+/**
+ * Launches a command through the helper.
+ *
+ * @param path -- executable to run
+ * @param args -- argv of the command
+ * @param fds -- stdin, stdout and stderr for the command, and the cgroup.procs it joins or -1
+ * @param pgid -- process group to put the command in; 0 for a new group led by the command
+ * @param placement -- CPUs, node and priorities to apply before exec
+ * @param limits -- rlimits to apply before exec
+ * @param times -- receives the time the command exec'd; NULL if the command is not timed
+ * @return pid of the command, or -1 if it could not be launched
+ */
+pid_t Spawner::spawn(const string& path, const vector<string>& args, const int fds[4], pid_t pgid,
+		const Placement& placement, const Limits& limits, StageTimes* times) {
+	if (sock<0)
+		return -1;
+	Runtime* runtime = Runtime::getRuntime();
+	string payload = path;
+	payload.push_back('\0');
+	payload.append((*runtime).getCwd());
+	payload.push_back('\0');
+	for (size_t i=0;i<args.size();i++) {
+		payload.append(args[i]);
+		payload.push_back('\0');
+	}
+	SpawnRequest req;
+	req.argc = args.size();
+	req.envc = 0;
+	for (char** e=(*runtime).getEnvp();*e!=NULL;e++) {
+		payload.append(*e);
+		payload.push_back('\0');
+		req.envc++;
+	}
+	req.bytes = payload.size();
+	req.pgid = pgid;
+	req.placement = placement;
+	req.limits = limits;
+	req.timed = times!=NULL;
+	// the header carries the fds; the payload follows on the stream
+	int nfds = fds[3]>=0 ? 4 : 3;
+	struct iovec iov = { &req, sizeof(req) };
+	char control[CMSG_SPACE(4*sizeof(int))];
+	memset(control,0,sizeof(control));
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+	memcpy(CMSG_DATA(cmsg),fds,nfds*sizeof(int));
+	ssize_t n;
+	do n = sendmsg(sock,&msg,MSG_NOSIGNAL);
+	while (n<0 && errno==EINTR);
+	if (n!=(ssize_t)sizeof(req) || !sendAll(sock,payload.data(),payload.size())) {
+		stop();
+		return -1;
+	}
+	// exit statuses of earlier commands may arrive before the reply
+	int kind;
+	pid_t pid;
+	struct timespec execed;
+	do {
+		if (!readReply(&kind,&pid,&execed)) {
+			stop();
+			return -1;
+		}
+	} while (kind!=SpawnReply::SPAWNED);
+	if (times!=NULL)
+		(*times).execed = execed;
+	return pid>0 ? pid : -1;
+}
+
+/**
+ * Waits for a command launched by spawn.
+ *
+ * @param pid -- the command
+ * @param usage -- receives its rusage; zeroed if the helper died
+ * @return its wait status; if the helper died, the status of an exit with 1
+ */
+int Spawner::wait(pid_t pid, struct rusage* usage) {
+	int kind;
+	pid_t from;
+	struct timespec execed;
+	while (exited.find(pid)==exited.end()) {
+		if (!readReply(&kind,&from,&execed)) {
+			stop();
+			memset(usage,0,sizeof(*usage));
+			return 1<<8;
+		}
+	}
+	int status = exited[pid].first;
+	*usage = exited[pid].second;
+	exited.erase(pid);
+	return status;
+}
+
+/**
+ * Reads one reply from the helper. An exit status and rusage are kept in exited, for wait.
+ *
+ * @return false if the helper is gone
+ */
+bool Spawner::readReply(int* kind, pid_t* pid, struct timespec* execed) {
+	SpawnReply reply;
+	if (sock<0 || !readAll(sock,&reply,sizeof(reply)))
+		return false;
+	*kind = reply.kind;
+	*pid = reply.pid;
+	*execed = reply.execed;
+	if (reply.kind==SpawnReply::EXITED)
+		exited[reply.pid] = std::make_pair((int)reply.status,reply.usage);
+	return true;
+}
+
+/**
+ * Child side of a spawn request: sets up the process and execs the command. Never returns.
+ * execFd is closed by the exec, which tells the helper when it happened; -1 if the request is not timed.
+ */
+static void execRequest(const SpawnRequest& req, const vector<char>& payload, const int fds[4], int execFd) {
+	vector<char*> strings;
+	for (size_t pos=0;pos<payload.size();pos+=strlen(&payload[pos])+1)
+		strings.push_back(const_cast<char*>(&payload[pos]));
+	if (strings.size()!=2+req.argc+req.envc || req.argc==0)
+		_exit(127);
+	// join the job's cgroup first, so all the child uses is charged to the job
+	bool joined = fds[3]<0 || write(fds[3],"0",1)==1;
+	setpgid(0,req.pgid);
+	// if the shell's directory is gone, the command runs from the helper's
+	if (chdir(strings[1])!=0) {}
+	for (int i=0;i<3;i++)
+		if (fds[i]!=i)
+			dup2(fds[i],i);
+	// keep execFd open until the exec, as fd 3
+	if (execFd>=0 && dup3(execFd,3,O_CLOEXEC)==3)
+		closeFrom(4);
+	else closeFrom(3);
+	// failures go to stderr: stdout may be the pipe or > file the command writes its data to
+	string failed;
+	if (req.placement.isSet() && !req.placement.apply(&failed)) {
+		failed = string("Could not apply")+failed+" for cmd "+strings[2]+"\n";
+		if (write(STDERR_FILENO,failed.data(),failed.size())<0) {}
+	}
+	failed.clear();
+	if (req.limits.isSet() && !req.limits.apply(&failed)) {
+		failed = string("Could not apply limit")+failed+" for cmd "+strings[2]+"\n";
+		if (write(STDERR_FILENO,failed.data(),failed.size())<0) {}
+	}
+	if (!joined) {
+		failed = string("Could not join the cgroup of the job for cmd ")+strings[2]+"\n";
+		if (write(STDERR_FILENO,failed.data(),failed.size())<0) {}
+	}
+	vector<char*> args(strings.begin()+2,strings.begin()+2+req.argc);
+	args.push_back(NULL);
+	vector<char*> envp(strings.begin()+2+req.argc,strings.end());
+	envp.push_back(NULL);
+	execve(strings[0],&args[0],&envp[0]);
+	// like execvp, an executable that is not a binary is run by /bin/sh
+	if (errno==ENOEXEC) {
+		vector<char*> shArgs;
+		shArgs.push_back(const_cast<char*>("/bin/sh"));
+		shArgs.push_back(strings[0]);
+		shArgs.insert(shArgs.end(),args.begin()+1,args.end());
+		execve("/bin/sh",&shArgs[0],&envp[0]);
+	}
+	string msg = string("Command ")+args[0]+" was not found.\n";
+	if (write(STDOUT_FILENO,msg.data(),msg.size())<0) {}
+	_exit(127);
+}
+
+/**
+ * The helper's main loop. It forks and execs each request, and reports each child's exit.
+ * It exits when the shell closes its end of the socketpair.
+ *
+ * @return exit status of the helper
+ */
+int Spawner::serve() {
+	int sock = SPAWN_SOCK_FD;
+	sigset_t chld, old;
+	sigemptyset(&chld);
+	sigaddset(&chld,SIGCHLD);
+	sigprocmask(SIG_BLOCK,&chld,&old);
+	int sigFd = signalfd(-1,&chld,SFD_CLOEXEC);
+	if (sigFd<0)
+		return 1;
+	fcntl(sock,F_SETFD,FD_CLOEXEC);
+	while (true) {
+		struct pollfd pfd[2] = { { sock, POLLIN, 0 }, { sigFd, POLLIN, 0 } };
+		if (poll(pfd,2,-1)<0) {
+			if (errno==EINTR) continue;
+			return 1;
+		}
+		if (pfd[1].revents & POLLIN) {
+			struct signalfd_siginfo info;
+			if (read(sigFd,&info,sizeof(info))<0) {}
+			int status;
+			pid_t pid;
+			struct rusage usage;
+			while ((pid = wait4(-1,&status,WNOHANG,&usage))>0) {
+				SpawnReply reply;
+				memset(&reply,0,sizeof(reply));
+				reply.kind = SpawnReply::EXITED;
+				reply.pid = pid;
+				reply.status = status;
+				reply.usage = usage;
+				if (!sendAll(sock,&reply,sizeof(reply)))
+					return 0;
+			}
+		}
+		if (!(pfd[0].revents & (POLLIN|POLLHUP|POLLERR)))
+			continue;
+		SpawnRequest req;
+		char control[CMSG_SPACE(4*sizeof(int))];
+		struct iovec iov = { &req, sizeof(req) };
+		struct msghdr msg;
+		memset(&msg,0,sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t n = recvmsg(sock,&msg,MSG_CMSG_CLOEXEC);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0)
+			return 0;
+		int fds[4] = { -1, -1, -1, -1 };
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg!=NULL && cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_RIGHTS) {
+			if (cmsg->cmsg_len==CMSG_LEN(4*sizeof(int)))
+				memcpy(fds,CMSG_DATA(cmsg),4*sizeof(int));
+			else if (cmsg->cmsg_len==CMSG_LEN(3*sizeof(int)))
+				memcpy(fds,CMSG_DATA(cmsg),3*sizeof(int));
+		}
+		vector<char> payload;
+		if ((size_t)n<sizeof(req) && !readAll(sock,(char*)&req+n,sizeof(req)-n))
+			return 0;
+		payload.resize(req.bytes);
+		if (req.bytes>0 && !readAll(sock,&payload[0],req.bytes))
+			return 0;
+		SpawnReply reply;
+		memset(&reply,0,sizeof(reply));
+		reply.kind = SpawnReply::SPAWNED;
+		reply.pid = -EBADF;
+		// for a timed request, the read end sees EOF once the child exec'd
+		int execPipe[2] = { -1, -1 };
+		if (fds[0]>=0 && req.timed && pipe2(execPipe,O_CLOEXEC)!=0)
+			execPipe[0] = execPipe[1] = -1;
+		if (fds[0]>=0) {
+			pid_t pid = fork();
+			if (pid==0) {
+				sigprocmask(SIG_SETMASK,&old,NULL);
+				execRequest(req,payload,fds,execPipe[1]);
+			}
+			if (pid>0)
+				setpgid(pid,req.pgid==0 ? pid : req.pgid);
+			reply.pid = pid>0 ? pid : -errno;
+		}
+		if (execPipe[0]>=0) {
+			close(execPipe[1]);
+			char c;
+			while (read(execPipe[0],&c,1)<0 && errno==EINTR) {}
+			close(execPipe[0]);
+		}
+		clock_gettime(CLOCK_MONOTONIC,&reply.execed);
+		for (int i=0;i<4;i++)
+			if (fds[i]>=0)
+				close(fds[i]);
+		if (!sendAll(sock,&reply,sizeof(reply)))
+			return 0;
+	}
+}
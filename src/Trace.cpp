@@ -0,0 +1,203 @@
+#include "OopShell.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdio.h> // for snprintf
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h> // for SYS_gettid
+
+using std::string;
+using std::vector;
+
+// events each thread keeps; about 1MB per thread that records any
+static const uint64_t TRACE_EVENTS = 1<<14;
+
+/**
+ * One complete event: what ran, from when to when, and a little detail such as the command.
+ */
+struct TraceEvent {
+	const char* name;
+	uint64_t start, end;
+	char detail[32];
+};
+
+/**
+ * The ring buffer of one thread. Only that thread writes it; head counts the events it ever wrote,
+ * and is published with release ordering once an event is complete.
+ */
+struct TraceBuffer {
+	pid_t tid;
+	char name[16];
+	std::atomic<uint64_t> head;
+	TraceEvent events[TRACE_EVENTS];
+};
+
+std::atomic<bool> Trace::on(false);
+
+// every thread's buffer; a thread that exits leaves its buffer here, so its events are still dumped
+static vector<TraceBuffer*> buffers;
+static pthread_mutex_t buffersLock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local TraceBuffer* localBuffer = NULL;
+// set by nameThread, for a thread that has no buffer yet
+static thread_local const char* localName = NULL;
+
+/**
+ * The calling thread's buffer, made and registered the first time the thread records something.
+ */
+static TraceBuffer* threadBuffer() {
+	if (localBuffer!=NULL)
+		return localBuffer;
+	TraceBuffer* buffer = new TraceBuffer();
+	(*buffer).tid = syscall(SYS_gettid);
+	if (localName==NULL)
+		localName = (*buffer).tid==getpid() ? "main" : "thread";
+	snprintf((*buffer).name,sizeof((*buffer).name),"%s",localName);
+	(*buffer).head.store(0,std::memory_order_relaxed);
+	pthread_mutex_lock(&buffersLock);
+	buffers.push_back(buffer);
+	pthread_mutex_unlock(&buffersLock);
+	localBuffer = buffer;
+	return buffer;
+}
+
+/**
+ * Appends s to out as the contents of a JSON string.
+ */
+static void appendJson(string* out, const char* s) {
+	for (;*s!='\0';s++) {
+		unsigned char c = *s;
+		if (c=='"' || c=='\\') {
+			(*out) += '\\';
+			(*out) += c;
+		}
+		else if (c<0x20) {
+			char esc[8];
+			snprintf(esc,sizeof(esc),"\\u%04x",c);
+			(*out) += esc;
+		}
+		else (*out) += c;
+	}
+}
+
+/**
+ * Turns recording on or off. Events already recorded are kept until they are overwritten.
+ */
+void Trace::setEnabled(bool enable) {
+	on.store(enable,std::memory_order_relaxed);
+}
+
+/**
+ * @return CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t Trace::now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (uint64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
+
+/**
+ * Adds an event to the calling thread's buffer, overwriting its oldest event if it is full.
+ *
+ * @param name -- what ran; a string literal, as only the pointer is kept
+ * @param start, end -- when it began and ended, from now
+ * @param detail -- e.g. the command it ran, or NULL; it is copied, and cut short if it is long
+ */
+void Trace::record(const char* name, uint64_t start, uint64_t end, const char* detail) {
+	TraceBuffer* buffer = threadBuffer();
+	uint64_t head = (*buffer).head.load(std::memory_order_relaxed);
+	TraceEvent* event = &(*buffer).events[head%TRACE_EVENTS];
+	(*event).name = name;
+	(*event).start = start;
+	(*event).end = end;
+	(*event).detail[0] = '\0';
+	if (detail!=NULL)
+		snprintf((*event).detail,sizeof((*event).detail),"%s",detail);
+	(*buffer).head.store(head+1,std::memory_order_release);
+}
+
+/**
+ * Names the calling thread in the trace, e.g. "parser". A thread that never records gets no buffer.
+ *
+ * @param name -- a string literal, as only the pointer is kept until the thread records something
+ */
+void Trace::nameThread(const char* name) {
+	localName = name;
+	if (localBuffer!=NULL)
+		snprintf((*localBuffer).name,sizeof((*localBuffer).name),"%s",name);
+}
+
+/**
+ * @return the number of events held in all buffers
+ */
+size_t Trace::count() {
+	size_t n = 0;
+	pthread_mutex_lock(&buffersLock);
+	for (size_t i=0;i<buffers.size();i++) {
+		uint64_t head = (*buffers[i]).head.load(std::memory_order_acquire);
+		n += head<TRACE_EVENTS ? head : TRACE_EVENTS;
+	}
+	pthread_mutex_unlock(&buffersLock);
+	return n;
+}
+
+/**
+ * Writes the events held in every buffer to a file, as Chrome trace JSON with one complete ("X") event each,
+ * and the name of each thread. Other threads keep recording while it runs: events they overwrote
+ * while they were being copied are left out.
+ *
+ * @param file -- path of the file to write
+ * @param error -- set if the file could not be written
+ * @return true if the file was written
+ */
+bool Trace::dump(const string& file, string* error) {
+	pid_t pid = getpid();
+	string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	char line[256];
+	bool first = true;
+	pthread_mutex_lock(&buffersLock);
+	vector<TraceBuffer*> all = buffers;
+	pthread_mutex_unlock(&buffersLock);
+	vector<TraceEvent> events;
+	for (size_t i=0;i<all.size();i++) {
+		TraceBuffer* buffer = all[i];
+		uint64_t head = (*buffer).head.load(std::memory_order_acquire);
+		uint64_t from = head>TRACE_EVENTS ? head-TRACE_EVENTS : 0;
+		events.clear();
+		for (uint64_t e=from;e<head;e++)
+			events.push_back((*buffer).events[e%TRACE_EVENTS]);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t after = (*buffer).head.load(std::memory_order_relaxed);
+		// the writer may have lapped the copy: drop the slots it reused, and the one it may be writing,
+		// as record fills slot head before it publishes head+1
+		uint64_t valid = after>=TRACE_EVENTS ? after-TRACE_EVENTS+1 : 0;
+		snprintf(line,sizeof(line),"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+				first ? "" : ",",pid,(*buffer).tid);
+		out += line;
+		appendJson(&out,(*buffer).name);
+		out += "\"}}";
+		first = false;
+		for (size_t e=0;e<events.size();e++) {
+			if (from+e<valid)
+				continue;
+			const TraceEvent& event = events[e];
+			snprintf(line,sizeof(line),",\n{\"name\":\"%s\",\"cat\":\"oopshell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+					event.name,event.start/1000.0,(event.end-event.start)/1000.0,pid,(*buffer).tid);
+			out += line;
+			if (event.detail[0]!='\0') {
+				out += ",\"args\":{\"detail\":\"";
+				appendJson(&out,event.detail);
+				out += "\"}";
+			}
+			out += "}";
+		}
+	}
+	out += "]}\n";
+	std::ofstream f(file.c_str(),std::ios::out|std::ios::trunc);
+	if (!f || !f.write(out.data(),out.size()) || !f.flush()) {
+		*error = "Could not write trace to "+file;
+		return false;
+	}
+	return true;
+}
@@ -6,6 +6,13 @@
 #include <vector>
 #include <string>
 #include <signal.h> //for kill
+#include <string.h> // for strcmp
+#include <stdlib.h> // for strtod
+#include <sys/syscall.h> // for SYS_close_range
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h> // for getcwd, chdir
 
 using std::stringstream;
 using std::cout;
@@ -145,14 +152,51 @@ void trimString(string* str) {
 
 /**
  * This method should be registered with atexit.
- * It will attempt to clean up loose processes, and
- * trigger writing shell settings to a file.
+ * It will attempt to clean up loose processes,
+ * trigger writing shell settings to a file, write out buffered output, remove the shell's cgroups,
+ * write the metrics export file a last time, and write out buffered --json-results lines.
  */
 void exitCleanup() {
 	Runtime::getRuntime()->writeSettingsFile();
+	flushOutput();
 	pid_t gpid = Command::gpid;
 	if (gpid>0)
 		killpg(gpid, SIGKILL);
+	JobCgroup::cleanup();
+	Runtime::getRuntime()->getMetrics()->exportNow(true);
+	Runtime::getRuntime()->getResults()->flush();
+}
+
+/**
+ * Formats a duration for a table, in the unit that keeps it short: 850us, 12.3ms, 4.567s.
+ */
+string formatSeconds(double s) {
+	char buf[32];
+	if (s<0) s = 0;
+	if (s<1e-3) snprintf(buf,sizeof(buf),"%.0fus",s*1e6);
+	else if (s<1) snprintf(buf,sizeof(buf),"%.1fms",s*1e3);
+	else snprintf(buf,sizeof(buf),"%.3fs",s);
+	return buf;
+}
+
+/**
+ * Parses a duration such as 30, 2.5, 90s, 10m or 1h, as timeout and set cmdtimeout take it.
+ *
+ * @param str -- the duration; a number of seconds, optionally followed by s, m or h
+ * @param seconds -- receives the duration in seconds
+ * @return false if str is not a duration
+ */
+bool parseDuration(const string& str, double* seconds) {
+	char* end;
+	double v = strtod(str.c_str(),&end);
+	if (str.size()==0 || end==str.c_str() || !(v>=0 && v<=1e9) || str[0]=='+' || str[0]==' ')
+		return false;
+	string unit = end;
+	if (unit=="m") v *= 60;
+	else if (unit=="h") v *= 3600;
+	else if (unit!="" && unit!="s") return false;
+	*seconds = v;
+	return true;
 }
 
 /**
@@ -207,3 +251,203 @@ void escapeString(string* str, string token) {
 		}
 	}
 }
+
+/**
+ * Closes every file descriptor from lowfd up.
+ * This is used by forked children that do not exec, since they do not benefit from close-on-exec.
+ *
+ * @param lowfd -- lowest file descriptor to close
+ */
+void closeFrom(int lowfd) {
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, lowfd, ~0U, 0)==0)
+		return;
+#endif
+	long maxFd = sysconf(_SC_OPEN_MAX);
+	for (long fd=lowfd;fd<maxFd;fd++)
+		close(fd);
+}
+
+/**
+ * Replaces a file atomically: the data is written to a temporary file in the same directory,
+ * flushed with fsync, and renamed over path. Readers see either the old or the new file, never a mix.
+ *
+ * @param path -- file to replace
+ * @param data -- new contents
+ * @return true if the file was replaced
+ */
+bool writeFileAtomic(const string& path, const string& data) {
+	stringstream tmp;
+	tmp << path << ".tmp." << getpid();
+	string tmpPath = tmp.str();
+	int fd = open(tmpPath.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+	if (fd<0)
+		return false;
+	size_t done = 0;
+	while (done<data.size()) {
+		ssize_t n = write(fd,data.data()+done,data.size()-done);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) break;
+		done += n;
+	}
+	bool ok = done==data.size() && fsync(fd)==0;
+	if (close(fd)!=0)
+		ok = false;
+	if (ok && rename(tmpPath.c_str(),path.c_str())==0)
+		return true;
+	unlink(tmpPath.c_str());
+	return false;
+}
+
+/**
+ * Copies a file from its start to another file descriptor.
+ * sendfile is used so the bytes never pass through user space.
+ *
+ * @param in -- file to copy
+ * @param out -- descriptor to write to, e.g. stdout
+ * @return true if the whole file was copied
+ */
+bool copyFile(int in, int out) {
+	off_t offset = 0;
+	while (true) {
+		ssize_t n = sendfile(out, in, &offset, 1<<30);
+		if (n>0) continue;
+		if (n==0) return true;
+		if (errno==EINTR) continue;
+		break;
+	}
+	// sendfile is not supported for this pair of fds: fall back to read/write
+	char buf[65536];
+	if (lseek(in, offset, SEEK_SET)<0)
+		return false;
+	ssize_t n;
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		ssize_t done = 0;
+		while (done<n) {
+			ssize_t w = write(out, buf+done, n-done);
+			if (w<0 && errno==EINTR) continue;
+			if (w<=0) return false;
+			done += w;
+		}
+	}
+	return n==0;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x<<r) | (x>>(64-r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+	k ^= k>>33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k>>33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k>>33;
+	return k;
+}
+
+/**
+ * MurmurHash3 x64 128 bit hash, with seed 0.
+ *
+ * @param data -- bytes to hash
+ * @param len -- number of bytes
+ * @param out -- receives the two 64 bit halves of the hash
+ */
+void murmur3(const void* data, size_t len, uint64_t out[2]) {
+	const unsigned char* p = (const unsigned char*)data;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0;
+	size_t blocks = len/16;
+	for (size_t i=0;i<blocks;i++) {
+		uint64_t k1, k2;
+		memcpy(&k1,p+i*16,8);
+		memcpy(&k2,p+i*16+8,8);
+		k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+		k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+	}
+	// the last len%16 bytes
+	const unsigned char* tail = p+blocks*16;
+	size_t rest = len&15;
+	uint64_t k1 = 0, k2 = 0;
+	for (size_t i=rest;i>8;i--)
+		k2 ^= (uint64_t)tail[i-1] << ((i-9)*8);
+	if (rest>8) {
+		k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+	}
+	for (size_t i=rest<8 ? rest : 8;i>0;i--)
+		k1 ^= (uint64_t)tail[i-1] << ((i-1)*8);
+	if (rest>0) {
+		k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+	}
+	h1 ^= len; h2 ^= len;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+	out[0] = h1;
+	out[1] = h2;
+}
+
+/**
+ * Character of a string at depth d, or 0 past its end.
+ */
+static inline int charAt(const string* s, size_t d) {
+	return (unsigned char)(*s).c_str()[d];
+}
+
+/**
+ * Multikey quicksort (Bentley & Sedgewick) on string pointers.
+ * Partitions three ways on the character at depth d, so equal prefixes are never compared twice.
+ *
+ * @param a -- array of string pointers to sort
+ * @param n -- number of elements
+ * @param d -- depth of the characters already known to be equal
+ */
+static void multikeySort(string** a, size_t n, size_t d) {
+	while (n>1) {
+		// small partitions: insertion sort on the remaining suffixes
+		if (n<16) {
+			for (size_t i=1;i<n;i++)
+				for (size_t j=i;j>0 && strcmp((*a[j]).c_str()+d,(*a[j-1]).c_str()+d)<0;j--)
+					std::swap(a[j],a[j-1]);
+			return;
+		}
+		std::swap(a[0],a[n/2]);
+		int pivot = charAt(a[0],d);
+		size_t lt=0, i=1, gt=n;
+		while (i<gt) {
+			int c = charAt(a[i],d);
+			if (c<pivot) std::swap(a[lt++],a[i++]);
+			else if (c>pivot) std::swap(a[i],a[--gt]);
+			else i++;
+		}
+		multikeySort(a,lt,d);
+		multikeySort(a+gt,n-gt,d);
+		// strings equal up to their terminator are done
+		if (pivot==0) return;
+		a += lt;
+		n = gt-lt;
+		d++;
+	}
+}
+
+/**
+ * This method sorts a vector of strings in byte order.
+ * It is used for glob results, which can hold 100k names sharing long prefixes.
+ *
+ * @param v -- pointer to the vector which will be sorted
+ */
+void sortStrings(vector<string>* v) {
+	size_t n = (*v).size();
+	if (n<2) return;
+	vector<string*> p(n);
+	for (size_t i=0;i<n;i++)
+		p[i] = &(*v)[i];
+	multikeySort(&p[0],n,0);
+	vector<string> sorted(n);
+	for (size_t i=0;i<n;i++)
+		sorted[i].swap(*p[i]);
+	(*v).swap(sorted);
+}